@@ -22,13 +22,15 @@
 #include <cpuid.h>
 
 
+/* Prefix for /dev, /sys and /proc (-R or $HW_ROOT) */
+static char *hw_root="";
 
 static int open_msr(int core) {
 
 	char msr_filename[BUFSIZ];
 	int fd;
 
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
+	sprintf(msr_filename, "%s/dev/cpu/%d/msr", hw_root, core);
 	fd = open(msr_filename, O_RDONLY);
 	if ( fd < 0 ) {
 		if ( errno == ENXIO ) {
@@ -257,6 +259,15 @@ int test_apm_pwr_reporting(int family) {
 }
 
 
+static int open_pci_config(char *device) {
+
+	char filename[BUFSIZ];
+
+	sprintf(filename,"%s/sys/bus/pci/devices/%s/config",hw_root,device);
+
+	return open(filename,O_RDONLY);
+}
+
 int test_tdp_reporting(int is_excavator) {
 
 	unsigned int eax,ebx,ecx,edx=0;
@@ -297,7 +308,7 @@ int test_tdp_reporting(int is_excavator) {
 
 	/* FIXME: we need to do this for each processor package */
 
-	fd=open("/sys/bus/pci/devices/0000:00:18.5/config",O_RDONLY);
+	fd=open_pci_config("0000:00:18.5");
 	if (fd<0) {
 		printf("Couldn't open PCI: %s\n",strerror(errno));
 		return 0;
@@ -332,7 +343,7 @@ int test_tdp_reporting(int is_excavator) {
 	/* 28:16 ApmTdpLimit */
 	/* 9:0 Tdp2Watt fixed point 0.10 conversion factor */
 
-	fd=open("/sys/bus/pci/devices/0000:00:18.5/config",O_RDONLY);
+	fd=open_pci_config("0000:00:18.5");
 	if (fd<0) {
 		printf("Couldn't open PCI: %s\n",strerror(errno));
 		return 0;
@@ -358,7 +369,7 @@ int test_tdp_reporting(int is_excavator) {
 	/* A lot of this doesn't seem to be documented?*/
 
 	/* read 18f4x1b8 REG_PROCESSOR_TDP -- undocumented? */
-	fd=open("/sys/bus/pci/devices/0000:00:18.4/config",O_RDONLY);
+	fd=open_pci_config("0000:00:18.4");
 	if (fd<0) {
 		printf("Couldn't open PCI: %s\n",strerror(errno));
 		return 0;
@@ -420,7 +431,8 @@ static int detect_packages(void) {
 
 	printf("\t");
 	for(i=0;i<MAX_CPUS;i++) {
-		sprintf(filename,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",i);
+		sprintf(filename,"%s/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+			hw_root,i);
 		fff=fopen(filename,"r");
 		if (fff==NULL) break;
 		fscanf(fff,"%d",&package);
@@ -452,6 +464,24 @@ int main(int argc, char **argv) {
 	unsigned int stepping,model,family;
 	char vendor_string[13];
 	int is_excavator=0;
+	int c;
+
+	if (getenv("HW_ROOT")) hw_root=getenv("HW_ROOT");
+
+	while ((c = getopt (argc, argv, "hR:")) != -1) {
+		switch (c) {
+		case 'h':
+			printf("Usage: %s [-h] [-R dir]\n\n",argv[0]);
+			printf("\t-h      : displays this help\n");
+			printf("\t-R dir  : read /dev and /sys under dir (default $HW_ROOT)\n");
+			exit(0);
+		case 'R':
+			hw_root = optarg;
+			break;
+		default:
+			exit(-1);
+		}
+	}
 
 	/* Get CPUID leaf 0 which has name and level */
 	__get_cpuid (0x0,&eax,&ebx,&ecx,&edx);
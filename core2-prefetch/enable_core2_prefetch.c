@@ -16,13 +16,32 @@ int main(int argc, char *argv[]) {
    uint64_t data;
    int fd;
    int cpu = 0;
-   char msr_file_name[64];
+   int c;
+   char msr_file_name[BUFSIZ];
+   /* -R or $HW_ROOT to run against a fake /dev tree */
+   char *hw_root = "";
+
+   if (getenv("HW_ROOT")) hw_root = getenv("HW_ROOT");
+
+   while ((c = getopt(argc, argv, "hR:")) != -1) {
+      switch (c) {
+         case 'h':
+            printf("Usage: %s [-h] [-R dir]\n", argv[0]);
+            exit(0);
+         case 'R':
+            hw_root = optarg;
+            break;
+         default:
+            exit(-1);
+      }
+   }
 
    reg = 0x1a0;
 
    for(cpu=0;cpu<MAX_CPUS;cpu++) {
 
-      sprintf(msr_file_name, "/dev/cpu/%d/msr", cpu);
+      snprintf(msr_file_name, sizeof(msr_file_name), "%s/dev/cpu/%d/msr",
+               hw_root, cpu);
       fd = open(msr_file_name, O_RDONLY);
       if (fd < 0) {
          if (errno == ENXIO) {
@@ -77,7 +96,8 @@ int main(int argc, char *argv[]) {
       printf("        Writing out new value: 0x%llx\n",(long long)data);
       
 
-      sprintf(msr_file_name, "/dev/cpu/%d/msr", cpu);
+      snprintf(msr_file_name, sizeof(msr_file_name), "%s/dev/cpu/%d/msr",
+               hw_root, cpu);
       fd = open(msr_file_name, O_WRONLY);
       if (fd < 0) {
          if (errno == ENXIO) {
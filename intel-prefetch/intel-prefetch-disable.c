@@ -30,12 +30,15 @@
 
 #include <sys/syscall.h>
 
+/* Prefix for /dev, /sys and /proc (-R or $HW_ROOT) */
+static char *hw_root="";
+
 static int open_msr(int core) {
 
 	char msr_filename[BUFSIZ];
 	int fd;
 
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
+	sprintf(msr_filename, "%s/dev/cpu/%d/msr", hw_root, core);
 	fd = open(msr_filename, O_RDWR);
 	if ( fd < 0 ) {
 		if ( errno == ENXIO ) {
@@ -86,7 +89,8 @@ static int detect_cpu(void) {
 	char vendor[BUFSIZ];
 	int is_core2=-1;
 
-	fff=fopen("/proc/cpuinfo","r");
+	sprintf(buffer,"%s/proc/cpuinfo",hw_root);
+	fff=fopen(buffer,"r");
 	if (fff==NULL) return -1;
 
 	while(1) {
@@ -451,7 +455,9 @@ int main(int argc, char **argv) {
 
 	opterr=0;
 
-	while ((c = getopt (argc, argv, "c:deh")) != -1) {
+	if (getenv("HW_ROOT")) hw_root=getenv("HW_ROOT");
+
+	while ((c = getopt (argc, argv, "c:dehR:")) != -1) {
 		switch (c) {
 		case 'c':
 			core = atoi(optarg);
@@ -464,8 +470,11 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'h':
-			printf("Usage: %s [-c core] [-d] [-e] [-h]\n\n",argv[0]);
+			printf("Usage: %s [-c core] [-d] [-e] [-h] [-R dir]\n\n",argv[0]);
 			exit(0);
+		case 'R':
+			hw_root = optarg;
+			break;
 		default:
 			exit(-1);
 		}
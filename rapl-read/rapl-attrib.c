@@ -0,0 +1,616 @@
+/* Attribute RAPL package energy to processes or cgroups		*/
+/*									*/
+/* Each interval, every package's energy is split by CPU time:	*/
+/*	a task (or cgroup) that used t seconds of CPU on a package	*/
+/*	with n CPUs gets E*t/(n*interval) of that package's energy,	*/
+/*	the time the package's CPUs spent idle gets the same share	*/
+/*	and is reported as idle.  Whatever is left (tasks that came	*/
+/*	and went between scans, rounding) is reported as other.		*/
+/*									*/
+/* Tasks are charged to the package of the CPU they last ran on.	*/
+/* Cgroup v2 cpu.stat has no per-CPU breakdown, so cgroups are	*/
+/* charged against the busy energy of all packages together.	*/
+/*									*/
+/* To stay cheap with thousands of tasks the stat files are opened	*/
+/* once and re-read with pread(), and only new pids are opened	*/
+/* when /proc is rescanned each interval.				*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+
+#include "rapl-lib.h"
+
+#define HASH_BUCKETS	4096
+#define STAT_BUFFER	1024
+#define DEFAULT_TOP	20
+
+struct entity {
+	struct entity *next;
+	int pid;			/* 0 for a cgroup */
+	char name[256];
+	int fd;				/* -1 once it's gone */
+	unsigned long long last_time;	/* ticks, or usec for cgroups */
+	int cpu;
+	double cpu_seconds;
+	double joules;
+};
+
+static struct entity *buckets[HASH_BUCKETS];
+static int num_entities=0;
+
+static int cgroup_mode=0;
+static char *cgroup_root="/sys/fs/cgroup";
+
+/* /proc and the cgroup root under rapl_root() */
+static char proc_dir[BUFSIZ],cgroup_dir[BUFSIZ];
+
+static double ticks_per_second;
+
+/* Per-CPU package and busy/idle ticks from /proc/stat */
+static int cpu_package[RAPL_MAX_CPUS];
+static int package_cpus[RAPL_MAX_PACKAGES];
+static unsigned long long cpu_busy[RAPL_MAX_CPUS],cpu_idle[RAPL_MAX_CPUS];
+static int proc_stat_fd=-1;
+static char proc_stat_buffer[RAPL_MAX_CPUS*128];
+
+static double idle_joules=0.0,other_joules=0.0,total_joules=0.0;
+
+static volatile sig_atomic_t done=0;
+
+static void sigint_handler(int signum) {
+
+	done=1;
+}
+
+static unsigned int hash_key(int pid, const char *name) {
+
+	unsigned int hash=pid;
+
+	if (pid) return hash%HASH_BUCKETS;
+
+	while(*name) hash=hash*31+*name++;
+
+	return hash%HASH_BUCKETS;
+}
+
+static struct entity *lookup(int pid, const char *name) {
+
+	struct entity *e;
+
+	for(e=buckets[hash_key(pid,name)];e;e=e->next) {
+		if ((e->pid==pid) && ((pid) || (!strcmp(e->name,name)))) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static struct entity *add_entity(int pid, const char *name, int fd) {
+
+	struct entity *e;
+	unsigned int hash;
+
+	e=calloc(1,sizeof(struct entity));
+	if (e==NULL) {
+		fprintf(stderr,"Out of memory\n");
+		exit(-1);
+	}
+
+	e->pid=pid;
+	snprintf(e->name,sizeof(e->name),"%s",name);
+	e->fd=fd;
+	e->cpu=-1;
+
+	hash=hash_key(pid,name);
+	e->next=buckets[hash];
+	buckets[hash]=e;
+	num_entities++;
+
+	return e;
+}
+
+/* Parse an unsigned decimal, return a pointer past it */
+static char *parse_ull(char *p, unsigned long long *value) {
+
+	unsigned long long result=0;
+
+	while(*p==' ') p++;
+	while((*p>='0') && (*p<='9')) {
+		result=result*10+(*p-'0');
+		p++;
+	}
+	*value=result;
+
+	return p;
+}
+
+/* /proc/<pid>/stat: "pid (comm) state ppid ..." and comm can hold	*/
+/* spaces or parens, so work from the last ')'.  utime and stime are	*/
+/* fields 14 and 15, the CPU it last ran on is field 39.		*/
+static int read_task(struct entity *e, unsigned long long *ticks) {
+
+	char buffer[STAT_BUFFER];
+	unsigned long long value,utime=0,stime=0;
+	char *p,*start,*end;
+	ssize_t size;
+	int field;
+
+	size=pread(e->fd,buffer,sizeof(buffer)-1,0);
+	if (size<=0) return -1;
+	buffer[size]=0;
+
+	start=strchr(buffer,'(');
+	end=strrchr(buffer,')');
+	if ((start==NULL) || (end==NULL)) return -1;
+
+	if (e->name[0]==0) {
+		size=end-start-1;
+		if (size>=(ssize_t)sizeof(e->name)) size=sizeof(e->name)-1;
+		memcpy(e->name,start+1,size);
+		e->name[size]=0;
+	}
+
+	/* skip ") state" */
+	p=end+2;
+	while((*p) && (*p!=' ')) p++;
+
+	for(field=4;field<=39;field++) {
+		p=parse_ull(p,&value);
+		if (field==14) utime=value;
+		if (field==15) stime=value;
+		if (field==39) e->cpu=value;
+		/* skip anything that isn't a plain number */
+		while((*p) && (*p!=' ')) p++;
+	}
+
+	*ticks=utime+stime;
+
+	return 0;
+}
+
+/* cpu.stat starts with "usage_usec N" */
+static int read_cgroup(struct entity *e, unsigned long long *usec) {
+
+	char buffer[STAT_BUFFER];
+	ssize_t size;
+	char *p;
+
+	size=pread(e->fd,buffer,sizeof(buffer)-1,0);
+	if (size<=0) return -1;
+	buffer[size]=0;
+
+	p=strstr(buffer,"usage_usec");
+	if (p==NULL) return -1;
+
+	parse_ull(p+10,usec);
+
+	return 0;
+}
+
+static int read_entity(struct entity *e, unsigned long long *time) {
+
+	if (cgroup_mode) return read_cgroup(e,time);
+
+	return read_task(e,time);
+}
+
+/* Find new tasks or cgroups and open their stat files */
+static void rescan(void) {
+
+	char filename[BUFSIZ*2];
+	struct dirent *entry;
+	struct entity *e;
+	DIR *dir;
+	int pid,fd;
+
+	dir=opendir(cgroup_mode?cgroup_dir:proc_dir);
+	if (dir==NULL) {
+		fprintf(stderr,"Error opening %s: %s\n",
+			cgroup_mode?cgroup_dir:proc_dir,strerror(errno));
+		exit(-1);
+	}
+
+	while((entry=readdir(dir))!=NULL) {
+
+		if (cgroup_mode) {
+			if ((entry->d_type!=DT_DIR) ||
+				(entry->d_name[0]=='.')) continue;
+			pid=0;
+		}
+		else {
+			if ((entry->d_name[0]<'1') ||
+				(entry->d_name[0]>'9')) continue;
+			pid=atoi(entry->d_name);
+		}
+
+		e=lookup(pid,entry->d_name);
+		if ((e) && (e->fd>=0)) continue;
+
+		if (cgroup_mode) {
+			snprintf(filename,sizeof(filename),"%s/%s/cpu.stat",
+				cgroup_dir,entry->d_name);
+		}
+		else {
+			snprintf(filename,sizeof(filename),"%s/%d/stat",
+				proc_dir,pid);
+		}
+
+		fd=open(filename,O_RDONLY);
+		if (fd<0) continue;
+
+		/* a pid can be reused, keep the old one's total apart */
+		if (e) e->pid=-e->pid;
+
+		e=add_entity(pid,cgroup_mode?entry->d_name:"",fd);
+		if (read_entity(e,&e->last_time)<0) {
+			close(e->fd);
+			e->fd=-1;
+		}
+	}
+
+	closedir(dir);
+}
+
+static void detect_cpus(void) {
+
+	char filename[BUFSIZ];
+	FILE *fff;
+	int cpu,package;
+
+	for(cpu=0;cpu<rapl_total_cores;cpu++) {
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/topology/"
+			"physical_package_id",cpu);
+		package=0;
+		fff=fopen(filename,"r");
+		if (fff!=NULL) {
+			if (fscanf(fff,"%d",&package)!=1) package=0;
+			fclose(fff);
+		}
+		if ((package<0) || (package>=RAPL_MAX_PACKAGES)) package=0;
+		cpu_package[cpu]=package;
+		package_cpus[package]++;
+	}
+}
+
+/* Fill in busy and idle ticks per package since the last call */
+static int read_proc_stat(unsigned long long *busy, unsigned long long *idle) {
+
+	unsigned long long value[8],now_busy,now_idle;
+	ssize_t size;
+	char *p;
+	int cpu,i;
+
+	size=pread(proc_stat_fd,proc_stat_buffer,sizeof(proc_stat_buffer)-1,0);
+	if (size<=0) return -1;
+	proc_stat_buffer[size]=0;
+
+	memset(busy,0,RAPL_MAX_PACKAGES*sizeof(unsigned long long));
+	memset(idle,0,RAPL_MAX_PACKAGES*sizeof(unsigned long long));
+
+	/* skip the aggregate "cpu " line, then "cpuN user nice ..." */
+	p=strchr(proc_stat_buffer,'\n');
+	while((p) && (!strncmp(p+1,"cpu",3))) {
+		cpu=atoi(p+4);
+		p=strchr(p+4,' ');
+		if (p==NULL) break;
+
+		/* user nice system idle iowait irq softirq steal */
+		for(i=0;i<8;i++) p=parse_ull(p,&value[i]);
+
+		now_idle=value[3]+value[4];
+		now_busy=value[0]+value[1]+value[2]+value[5]+value[6]+value[7];
+
+		if ((cpu>=0) && (cpu<RAPL_MAX_CPUS)) {
+			busy[cpu_package[cpu]]+=now_busy-cpu_busy[cpu];
+			idle[cpu_package[cpu]]+=now_idle-cpu_idle[cpu];
+			cpu_busy[cpu]=now_busy;
+			cpu_idle[cpu]=now_idle;
+		}
+
+		p=strchr(p,'\n');
+	}
+
+	return 0;
+}
+
+/* Which domain to split, package if we have it */
+static int energy_domain(void) {
+
+	if (rapl_available&(1<<RAPL_DOMAIN_PKG)) return RAPL_DOMAIN_PKG;
+	if (rapl_available&(1<<RAPL_DOMAIN_PSYS)) return RAPL_DOMAIN_PSYS;
+
+	return -1;
+}
+
+static void attribute(double interval,
+		double energy[RAPL_MAX_PACKAGES]) {
+
+	unsigned long long busy[RAPL_MAX_PACKAGES],idle[RAPL_MAX_PACKAGES];
+	unsigned long long now;
+	double capacity[RAPL_MAX_PACKAGES];
+	double attributed=0.0,busy_energy=0.0,busy_seconds=0.0;
+	double seconds,share;
+	struct entity *e;
+	int i,j;
+
+	read_proc_stat(busy,idle);
+
+	for(j=0;j<rapl_total_packages;j++) {
+		capacity[j]=package_cpus[j]*interval;
+		total_joules+=energy[j];
+		if (capacity[j]<=0.0) continue;
+		share=energy[j]*((double)idle[j]/ticks_per_second)/capacity[j];
+		idle_joules+=share;
+		attributed+=share;
+		busy_energy+=energy[j]-share;
+		busy_seconds+=(double)busy[j]/ticks_per_second;
+	}
+
+	for(i=0;i<HASH_BUCKETS;i++) {
+		for(e=buckets[i];e;e=e->next) {
+			if (e->fd<0) continue;
+
+			if (read_entity(e,&now)<0) {
+				/* it went away */
+				close(e->fd);
+				e->fd=-1;
+				continue;
+			}
+
+			if (cgroup_mode) {
+				seconds=(double)(now-e->last_time)/1000000.0;
+				share=0.0;
+				if (busy_seconds>0.0) {
+					share=busy_energy*seconds/busy_seconds;
+				}
+			}
+			else {
+				seconds=(double)(now-e->last_time)/ticks_per_second;
+				j=((e->cpu>=0) && (e->cpu<RAPL_MAX_CPUS))?
+					cpu_package[e->cpu]:0;
+				share=0.0;
+				if (capacity[j]>0.0) {
+					share=energy[j]*seconds/capacity[j];
+				}
+			}
+			e->last_time=now;
+			e->cpu_seconds+=seconds;
+			e->joules+=share;
+			attributed+=share;
+		}
+	}
+
+	for(j=0;j<rapl_total_packages;j++) other_joules+=energy[j];
+	other_joules-=attributed;
+}
+
+static int compare_joules(const void *a, const void *b) {
+
+	const struct entity *x=*(struct entity * const *)a;
+	const struct entity *y=*(struct entity * const *)b;
+
+	if (x->joules!=y->joules) {
+		return (x->joules<y->joules)-(x->joules>y->joules);
+	}
+
+	return (x->cpu_seconds<y->cpu_seconds)-(x->cpu_seconds>y->cpu_seconds);
+}
+
+static void report(double seconds, int top) {
+
+	struct entity **sorted;
+	struct entity *e;
+	int i,n=0;
+
+	sorted=calloc(num_entities+1,sizeof(struct entity *));
+	if (sorted==NULL) return;
+
+	for(i=0;i<HASH_BUCKETS;i++) {
+		for(e=buckets[i];e;e=e->next) {
+			if ((e->joules>0.0) || (e->cpu_seconds>0.0)) {
+				sorted[n++]=e;
+			}
+		}
+	}
+	qsort(sorted,n,sizeof(struct entity *),compare_joules);
+
+	printf("\n%.3fJ over %.3fs, %d %s tracked\n\n",total_joules,seconds,
+		num_entities,cgroup_mode?"cgroups":"tasks");
+
+	if (cgroup_mode) {
+		printf("%-40s %10s %12s %8s\n","Cgroup","CPU(s)","Energy(J)",
+			"Share(%)");
+	}
+	else {
+		printf("%8s %-20s %10s %12s %8s\n","PID","Command","CPU(s)",
+			"Energy(J)","Share(%)");
+	}
+
+	for(i=0;(i<n) && (i<top);i++) {
+		e=sorted[i];
+		if (cgroup_mode) printf("%-40s ",e->name);
+		else printf("%8d %-20s ",e->pid<0?-e->pid:e->pid,e->name);
+		printf("%10.3f %12.3f %8.2f\n",e->cpu_seconds,e->joules,
+			total_joules>0.0?e->joules*100.0/total_joules:0.0);
+	}
+
+	if (cgroup_mode) printf("%-40s %10s ","idle","");
+	else printf("%8s %-20s %10s ","","idle","");
+	printf("%12.3f %8.2f\n",idle_joules,
+		total_joules>0.0?idle_joules*100.0/total_joules:0.0);
+
+	if (cgroup_mode) printf("%-40s %10s ","other","");
+	else printf("%8s %-20s %10s ","","other","");
+	printf("%12.3f %8.2f\n",other_joules,
+		total_joules>0.0?other_joules*100.0/total_joules:0.0);
+
+	printf("\n");
+
+	free(sorted);
+}
+
+int main(int argc, char **argv) {
+
+	int c;
+	int force_msr=0,force_perf_event=0,force_sysfs=0;
+	char filename[BUFSIZ];
+	int cpu_model,backend,domain;
+	int top=DEFAULT_TOP;
+	int j;
+	long long max_samples=0,samples=0;
+	long long period_ns=1000000000LL;
+	long long start,deadline,now,last,wake;
+	struct timespec deadline_ts;
+	uint64_t last_raw[RAPL_MAX_PACKAGES];
+	double energy[RAPL_MAX_PACKAGES];
+	unsigned long long busy[RAPL_MAX_PACKAGES],idle[RAPL_MAX_PACKAGES];
+
+	while ((c = getopt (argc, argv, "g::hi:k:mn:pR:s")) != -1) {
+		switch (c) {
+		case 'g':
+			cgroup_mode = 1;
+			if (optarg) cgroup_root = optarg;
+			break;
+		case 'h':
+			printf("Usage: %s [-g[root]] [-h] [-i ms] [-k num] [-m] [-n samples] [-p] [-R dir] [-s]\n\n",argv[0]);
+			printf("\t-g[dir] : split by the child cgroups of dir instead of by\n");
+			printf("\t          process (default /sys/fs/cgroup)\n");
+			printf("\t-h      : displays this help\n");
+			printf("\t-i ms   : attribution interval in milliseconds (default 1000)\n");
+			printf("\t-k num  : show the top num (default %d)\n",DEFAULT_TOP);
+			printf("\t-m      : forces use of MSR mode\n");
+			printf("\t-n num  : exit after num intervals, otherwise run until ^C\n");
+			printf("\t-p      : forces use of perf_event mode\n");
+			printf("\t-R dir  : read /dev, /sys and /proc under dir (default $HW_ROOT)\n");
+			printf("\t-s      : forces use of sysfs mode\n");
+			exit(0);
+		case 'i':
+			period_ns = (long long)(atof(optarg)*1000000.0);
+			if (period_ns<=0) {
+				fprintf(stderr,"Invalid interval %s\n",optarg);
+				exit(-1);
+			}
+			break;
+		case 'k':
+			top = atoi(optarg);
+			break;
+		case 'm':
+			force_msr = 1;
+			break;
+		case 'n':
+			max_samples = atoll(optarg);
+			break;
+		case 'p':
+			force_perf_event = 1;
+			break;
+		case 'R':
+			rapl_set_root(optarg);
+			break;
+		case 's':
+			force_sysfs = 1;
+			break;
+		default:
+			fprintf(stderr,"Unknown option %c\n",c);
+			exit(-1);
+		}
+	}
+
+	cpu_model=rapl_detect_cpu();
+	rapl_detect_packages();
+
+	if (force_msr) backend=RAPL_BACKEND_MSR;
+	else if (force_perf_event) backend=RAPL_BACKEND_PERF;
+	else if (force_sysfs) backend=RAPL_BACKEND_SYSFS;
+	else backend=RAPL_BACKEND_AUTO;
+
+	if (rapl_open(backend,cpu_model)<0) {
+		printf("Unable to read RAPL counters.\n");
+		return -1;
+	}
+
+	domain=energy_domain();
+	if (domain<0) {
+		printf("No package or platform energy to attribute.\n");
+		return -1;
+	}
+
+	ticks_per_second=(double)sysconf(_SC_CLK_TCK);
+
+	rapl_path(proc_dir,sizeof(proc_dir),"/proc");
+	rapl_path(cgroup_dir,sizeof(cgroup_dir),"%s",cgroup_root);
+
+	rapl_path(filename,sizeof(filename),"/proc/stat");
+	proc_stat_fd=open(filename,O_RDONLY);
+	if (proc_stat_fd<0) {
+		fprintf(stderr,"Error opening %s: %s\n",filename,strerror(errno));
+		return -1;
+	}
+	detect_cpus();
+	read_proc_stat(busy,idle);
+
+	printf("Attributing %s energy using %s to %s\n",
+		rapl_domain_name(domain),rapl_backend_name(rapl_backend),
+		cgroup_mode?cgroup_dir:"processes");
+
+	signal(SIGINT,sigint_handler);
+	signal(SIGTERM,sigint_handler);
+
+	rescan();
+	rapl_read();
+	for(j=0;j<rapl_total_packages;j++) last_raw[j]=rapl_raw[j][domain];
+
+	start=last=deadline=rapl_monotonic_ns();
+
+	while(!done) {
+		deadline+=period_ns;
+
+		/* MSR has to be polled often enough to not miss a wrap */
+		wake=rapl_monotonic_ns();
+		while((!done) && (wake<deadline)) {
+			if ((rapl_backend==RAPL_BACKEND_MSR) &&
+				(deadline-wake>rapl_msr_wrap_poll_ns)) {
+				wake+=rapl_msr_wrap_poll_ns;
+			}
+			else {
+				wake=deadline;
+			}
+			deadline_ts.tv_sec=wake/1000000000LL;
+			deadline_ts.tv_nsec=wake%1000000000LL;
+			clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,
+					&deadline_ts,NULL);
+			if (rapl_backend==RAPL_BACKEND_MSR) rapl_read();
+			wake=rapl_monotonic_ns();
+		}
+
+		rapl_read();
+		now=rapl_monotonic_ns();
+		for(j=0;j<rapl_total_packages;j++) {
+			energy[j]=(double)(rapl_raw[j][domain]-last_raw[j])*
+				rapl_units[j][domain];
+			last_raw[j]=rapl_raw[j][domain];
+		}
+
+		attribute((double)(now-last)/1000000000.0,energy);
+		last=now;
+
+		rescan();
+
+		samples++;
+		if ((max_samples) && (samples>=max_samples)) break;
+	}
+
+	report((double)(last-start)/1000000000.0,top);
+
+	rapl_close();
+
+	return 0;
+}
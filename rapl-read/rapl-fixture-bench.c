@@ -0,0 +1,281 @@
+/* Benchmark the librapl backends against a synthetic RAPL tree	*/
+/*									*/
+/* For each backend a fresh rapl-fixture tree is built with its	*/
+/* counters a little short of wrapping and kept running by a	*/
+/* thread.  Then the backend is timed the same way as		*/
+/* --bench-backends, and sampled in windows whose power is		*/
+/* compared against the wattage the fixture is running at.		*/
+/*									*/
+/* Runs anywhere, no RAPL or root needed, so sampler changes can be	*/
+/* checked on a build machine.  The perf_event backend needs the	*/
+/* kernel and is always reported as not available.		*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rapl-lib.h"
+#include "rapl-fixture.h"
+
+#define NUM_BACKENDS	3
+
+static const int backends[NUM_BACKENDS]={
+	RAPL_BACKEND_MSR,
+	RAPL_BACKEND_PERF,
+	RAPL_BACKEND_SYSFS,
+};
+
+struct accuracy {
+	int windows;
+	double mean_error,max_error;	/* % of the expected power */
+	double energy_error;		/* % over the whole run */
+};
+
+static struct rapl_fixture fixture;
+static pthread_t updater;
+static volatile int updater_exit=0;
+
+/* Stands in for the hardware, moving the counters every 1ms */
+static void *fixture_updater(void *arg) {
+
+	struct timespec deadline_ts;
+	long long deadline=fixture.start_ns;
+
+	while(!updater_exit) {
+		deadline+=1000000LL;
+		deadline_ts.tv_sec=deadline/1000000000LL;
+		deadline_ts.tv_nsec=deadline%1000000000LL;
+		clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&deadline_ts,NULL);
+		rapl_fixture_update(&fixture,rapl_monotonic_ns());
+	}
+
+	return NULL;
+}
+
+static int fixture_start(void) {
+
+	if (rapl_fixture_create(&fixture)<0) return -1;
+
+	updater_exit=0;
+	if (pthread_create(&updater,NULL,fixture_updater,NULL)) {
+		rapl_fixture_close(&fixture);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void fixture_stop(int keep) {
+
+	updater_exit=1;
+	pthread_join(updater,NULL);
+
+	/* the tree is rebuilt per backend, don't keep stale fds */
+	rapl_msr_fds_close();
+	rapl_fixture_close(&fixture);
+	if (!keep) rapl_fixture_remove(&fixture);
+}
+
+static double percent_error(double measured, double expected) {
+
+	if (expected==0.0) return 0.0;
+
+	return fabs(measured-expected)*100.0/expected;
+}
+
+static int measure_accuracy(int backend, int cpu_model, long long window_ns,
+		long long run_ns, struct accuracy *accuracy) {
+
+	uint64_t first[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	uint64_t last[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	struct timespec deadline_ts;
+	long long start,now,prev,deadline;
+	double error,total_error=0.0,seconds;
+	int d,j,n=0;
+
+	memset(accuracy,0,sizeof(*accuracy));
+
+	if (rapl_open(backend,cpu_model)!=backend) return -1;
+
+	start=rapl_monotonic_ns();
+	rapl_read();
+	memcpy(first,rapl_raw,sizeof(rapl_raw));
+	memcpy(last,rapl_raw,sizeof(rapl_raw));
+	prev=start;
+
+	for(deadline=start+window_ns;deadline<=start+run_ns;
+			deadline+=window_ns) {
+		deadline_ts.tv_sec=deadline/1000000000LL;
+		deadline_ts.tv_nsec=deadline%1000000000LL;
+		clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&deadline_ts,NULL);
+
+		now=rapl_monotonic_ns();
+		rapl_read();
+		seconds=(double)(now-prev)/1000000000.0;
+
+		for(j=0;j<rapl_total_packages;j++) {
+			for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+				if (!(rapl_available&(1<<d))) continue;
+				error=percent_error((double)(rapl_raw[j][d]-
+					last[j][d])*rapl_units[j][d]/seconds,
+					fixture.watts[d]);
+				total_error+=error;
+				if (error>accuracy->max_error) {
+					accuracy->max_error=error;
+				}
+				n++;
+			}
+		}
+		memcpy(last,rapl_raw,sizeof(rapl_raw));
+		prev=now;
+		accuracy->windows++;
+	}
+
+	/* Whole run, all domains together */
+	seconds=(double)(prev-start)/1000000000.0;
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!(rapl_available&(1<<d))) continue;
+			error=percent_error((double)(last[j][d]-first[j][d])*
+				rapl_units[j][d]/seconds,fixture.watts[d]);
+			if (error>accuracy->energy_error) {
+				accuracy->energy_error=error;
+			}
+		}
+	}
+
+	rapl_close();
+
+	if (n) accuracy->mean_error=total_error/n;
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	struct rapl_backend_cost cost[NUM_BACKENDS];
+	struct accuracy accuracy[NUM_BACKENDS];
+	int valid[NUM_BACKENDS];
+	char root[BUFSIZ];
+	char *base="/tmp";
+	long long window_ns=100000000LL,run_ns=2000000000LL;
+	int samples=RAPL_BENCH_SAMPLES;
+	int keep=0,cpu_model;
+	int c,i;
+
+	rapl_fixture_init(&fixture,"");
+	fixture.wrap_seconds=1.0;
+
+	while ((c = getopt (argc, argv, "d:hi:kn:p:s:t:w:")) != -1) {
+		switch (c) {
+		case 'd':
+			base = optarg;
+			break;
+		case 'h':
+			printf("Usage: %s [-d dir] [-h] [-i ms] [-k] [-n samples] [-p packages]\n"
+				"\t\t[-s sec] [-t sec] [-w watts]\n\n",argv[0]);
+			printf("\t-d dir  : build the fixtures under dir (default /tmp)\n");
+			printf("\t-h      : displays this help\n");
+			printf("\t-i ms   : accuracy window (default 100)\n");
+			printf("\t-k      : keep the fixture trees\n");
+			printf("\t-n num  : samples for the cost (default %d)\n",
+				RAPL_BENCH_SAMPLES);
+			printf("\t-p num  : packages in the fixture (default 1)\n");
+			printf("\t-s sec  : counters wrap this far into each run (default 1)\n");
+			printf("\t-t sec  : accuracy run per backend (default 2)\n");
+			printf("\t-w watts: package power, cores and DRAM scale with it\n");
+			exit(0);
+		case 'i':
+			window_ns = (long long)(atof(optarg)*1000000.0);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'n':
+			samples = atoi(optarg);
+			break;
+		case 'p':
+			fixture.packages = atoi(optarg);
+			break;
+		case 's':
+			fixture.wrap_seconds = atof(optarg);
+			break;
+		case 't':
+			run_ns = (long long)(atof(optarg)*1000000000.0);
+			break;
+		case 'w':
+			fixture.watts[RAPL_DOMAIN_PP0]*=
+				atof(optarg)/fixture.watts[RAPL_DOMAIN_PKG];
+			fixture.watts[RAPL_DOMAIN_DRAM]*=
+				atof(optarg)/fixture.watts[RAPL_DOMAIN_PKG];
+			fixture.watts[RAPL_DOMAIN_PKG] = atof(optarg);
+			break;
+		default:
+			fprintf(stderr,"Unknown option %c\n",c);
+			exit(-1);
+		}
+	}
+
+	if ((window_ns<=0) || (run_ns<window_ns) || (samples<=0) ||
+		(fixture.watts[RAPL_DOMAIN_PKG]<=0.0)) {
+		fprintf(stderr,"Invalid arguments, see -h\n");
+		return -1;
+	}
+
+	snprintf(root,sizeof(root),"%s/rapl-fixture-XXXXXX",base);
+	if (mkdtemp(root)==NULL) {
+		fprintf(stderr,"Can't make a directory under %s\n",base);
+		return -1;
+	}
+	snprintf(fixture.root,sizeof(fixture.root),"%s",root);
+	rapl_set_root(root);
+
+	for(i=0;i<NUM_BACKENDS;i++) {
+		valid[i]=0;
+		if (fixture_start()<0) return -1;
+
+		cpu_model=rapl_detect_cpu();
+		rapl_detect_packages();
+
+		if ((rapl_bench_backend(backends[i],cpu_model,samples,
+				&cost[i])==0) &&
+			(measure_accuracy(backends[i],cpu_model,window_ns,
+				run_ns,&accuracy[i])==0)) {
+			valid[i]=1;
+		}
+
+		fixture_stop(keep);
+	}
+
+	if (keep) printf("\nFixture left in %s\n",root);
+
+	printf("\n%d package(s) at PKG %.1fW, PP0 %.1fW, DRAM %.1fW, "
+		"counters wrapping %.1fs in\n",fixture.packages,
+		fixture.watts[RAPL_DOMAIN_PKG],fixture.watts[RAPL_DOMAIN_PP0],
+		fixture.watts[RAPL_DOMAIN_DRAM],fixture.wrap_seconds);
+	printf("Cost over %d samples in microseconds, error in %% over "
+		"%.0fms windows and the whole run\n\n",samples,
+		(double)window_ns/1000000.0);
+	printf("%-12s %9s %9s %9s %9s %9s %9s %9s\n","backend",
+		"avg","p99","stddev","syscalls","mean err","max err","run err");
+	for(i=0;i<NUM_BACKENDS;i++) {
+		if (!valid[i]) {
+			printf("%-12s not available\n",
+				rapl_backend_name(backends[i]));
+			continue;
+		}
+		printf("%-12s %9.3f %9.3f %9.3f %9.1f %9.3f %9.3f %9.3f\n",
+			rapl_backend_name(backends[i]),
+			cost[i].avg_ns/1000.0,cost[i].p99_ns/1000.0,
+			cost[i].stddev_ns/1000.0,cost[i].syscalls,
+			accuracy[i].mean_error,accuracy[i].max_error,
+			accuracy[i].energy_error);
+	}
+	printf("\n");
+
+	return 0;
+}
@@ -0,0 +1,338 @@
+/* Synthetic RAPL machine, see rapl-fixture.h			*/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <ftw.h>
+
+#include <sys/stat.h>
+
+#include "rapl-lib.h"
+#include "rapl-fixture.h"
+
+/* A regular file sized past the last MSR used, pread() beyond the	*/
+/* end would return 0 bytes and look like a missing MSR.		*/
+#define FIXTURE_MSR_FILE_SIZE	0x1000
+
+static const char *zone_names[RAPL_NUM_DOMAINS]={
+	NULL,"core",NULL,"dram",NULL,
+};
+
+static unsigned int energy_msr[RAPL_NUM_DOMAINS]={
+	MSR_INTEL_PKG_ENERGY_STATUS,MSR_INTEL_PP0_ENERGY_STATUS,0,
+	MSR_DRAM_ENERGY_STATUS,0,
+};
+
+void rapl_fixture_init(struct rapl_fixture *fixture, const char *root) {
+
+	int cpu,d,j;
+
+	memset(fixture,0,sizeof(*fixture));
+	snprintf(fixture->root,sizeof(fixture->root),"%s",root);
+	fixture->packages=1;
+	fixture->cpus_per_package=2;
+	fixture->watts[RAPL_DOMAIN_PKG]=50.0;
+	fixture->watts[RAPL_DOMAIN_PP0]=30.0;
+	fixture->watts[RAPL_DOMAIN_DRAM]=10.0;
+	fixture->wrap_seconds=0.0;
+
+	for(cpu=0;cpu<RAPL_MAX_CPUS;cpu++) fixture->msr_fd[cpu]=-1;
+	for(j=0;j<RAPL_MAX_PACKAGES;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) fixture->uj_fd[j][d]=-1;
+	}
+}
+
+/* mkdir -p */
+static int make_dirs(char *path) {
+
+	char *p;
+
+	for(p=path+1;*p;p++) {
+		if (*p!='/') continue;
+		*p=0;
+		if ((mkdir(path,0755)<0) && (errno!=EEXIST)) {
+			*p='/';
+			return -1;
+		}
+		*p='/';
+	}
+	if ((mkdir(path,0755)<0) && (errno!=EEXIST)) return -1;
+
+	return 0;
+}
+
+/* Write a whole small file under the root, making its directory */
+static int write_file(struct rapl_fixture *fixture, const char *contents,
+		const char *format, ...) __attribute__((format(printf,3,4)));
+
+static int write_file(struct rapl_fixture *fixture, const char *contents,
+		const char *format, ...) {
+
+	char filename[BUFSIZ*2],*slash;
+	va_list ap;
+	FILE *fff;
+	int len;
+
+	len=snprintf(filename,sizeof(filename),"%s",fixture->root);
+	va_start(ap,format);
+	vsnprintf(filename+len,sizeof(filename)-len,format,ap);
+	va_end(ap);
+
+	slash=strrchr(filename,'/');
+	*slash=0;
+	if (make_dirs(filename)<0) goto error;
+	*slash='/';
+
+	fff=fopen(filename,"w");
+	if (fff==NULL) goto error;
+	fputs(contents,fff);
+	fclose(fff);
+
+	return 0;
+
+error:
+	fprintf(stderr,"Error creating %s: %s\n",filename,strerror(errno));
+	return -1;
+}
+
+static int write_msr(struct rapl_fixture *fixture, int cpu,
+		unsigned int which, uint64_t value) {
+
+	if (pwrite(fixture->msr_fd[cpu],&value,sizeof(value),which)!=
+			sizeof(value)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The static MSRs: units, power info and a PL1 at TDP */
+static int create_msrs(struct rapl_fixture *fixture, int cpu) {
+
+	char filename[BUFSIZ*2];
+	uint64_t tdp,dram_max;
+	int fd;
+
+	snprintf(filename,sizeof(filename),"%s/dev/cpu/%d/msr",
+		fixture->root,cpu);
+	if (write_file(fixture,"","/dev/cpu/%d/msr",cpu)<0) return -1;
+
+	fd=open(filename,O_RDWR);
+	if ((fd<0) || (ftruncate(fd,FIXTURE_MSR_FILE_SIZE)<0)) {
+		fprintf(stderr,"Error creating %s: %s\n",
+			filename,strerror(errno));
+		if (fd>=0) close(fd);
+		return -1;
+	}
+	fixture->msr_fd[cpu]=fd;
+
+	/* in 1/8W, the power unit above */
+	tdp=(uint64_t)(fixture->watts[RAPL_DOMAIN_PKG]*8.0)&0x7fff;
+	dram_max=(uint64_t)(fixture->watts[RAPL_DOMAIN_DRAM]*2.0*8.0)&0x7fff;
+
+	write_msr(fixture,cpu,MSR_INTEL_RAPL_POWER_UNIT,RAPL_FIXTURE_UNITS);
+	write_msr(fixture,cpu,MSR_PKG_POWER_INFO,tdp|((tdp*2)<<32));
+	write_msr(fixture,cpu,MSR_PKG_RAPL_POWER_LIMIT,
+		tdp|(1ULL<<15)|(0xaULL<<17));
+	write_msr(fixture,cpu,MSR_DRAM_POWER_INFO,dram_max<<32);
+
+	return 0;
+}
+
+static int create_zone(struct rapl_fixture *fixture, int j, int d) {
+
+	char filename[BUFSIZ*3],dirname[BUFSIZ],contents[64];
+
+	if (d==RAPL_DOMAIN_PKG) {
+		snprintf(dirname,sizeof(dirname),
+			"/sys/class/powercap/intel-rapl/intel-rapl:%d",j);
+		snprintf(contents,sizeof(contents),"package-%d\n",j);
+	}
+	else {
+		snprintf(dirname,sizeof(dirname),
+			"/sys/class/powercap/intel-rapl/intel-rapl:%d/"
+			"intel-rapl:%d:%d",j,j,(d==RAPL_DOMAIN_PP0)?0:1);
+		snprintf(contents,sizeof(contents),"%s\n",zone_names[d]);
+	}
+
+	if (write_file(fixture,contents,"%s/name",dirname)<0) return -1;
+
+	snprintf(contents,sizeof(contents),"%llu\n",
+		(unsigned long long)fixture->max_range_uj[d]);
+	if (write_file(fixture,contents,"%s/max_energy_range_uj",dirname)<0) {
+		return -1;
+	}
+
+	if (write_file(fixture,"0\n","%s/energy_uj",dirname)<0) return -1;
+
+	snprintf(filename,sizeof(filename),"%s%s/energy_uj",
+		fixture->root,dirname);
+	fixture->uj_fd[j][d]=open(filename,O_WRONLY);
+	if (fixture->uj_fd[j][d]<0) {
+		fprintf(stderr,"Error opening %s: %s\n",
+			filename,strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int rapl_fixture_create(struct rapl_fixture *fixture) {
+
+	char buffer[BUFSIZ];
+	FILE *cpuinfo;
+	char *contents;
+	size_t size;
+	double wrap_joules;
+	int cpu,d,j;
+
+	if ((fixture->packages<1) ||
+		(fixture->packages>RAPL_MAX_PACKAGES) ||
+		(fixture->cpus_per_package<1) ||
+		(fixture->packages*fixture->cpus_per_package>RAPL_MAX_CPUS)) {
+		fprintf(stderr,"Fixture can't have %d packages of %d CPUs\n",
+			fixture->packages,fixture->cpus_per_package);
+		return -1;
+	}
+
+	/* Counters start wrap_seconds short of where the first of	*/
+	/* the MSR or sysfs view would wrap.				*/
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (!energy_msr[d]) continue;
+		fixture->units[d]=(d==RAPL_DOMAIN_DRAM)?RAPL_FIXTURE_DRAM_UNITS:
+			pow(0.5,(double)((RAPL_FIXTURE_UNITS>>8)&0x1f));
+		wrap_joules=4294967296.0*fixture->units[d];
+		fixture->max_range_uj[d]=(uint64_t)(wrap_joules*1000000.0);
+		fixture->start_joules[d]=0.0;
+		if (fixture->wrap_seconds>0.0) {
+			fixture->start_joules[d]=wrap_joules-
+				fixture->watts[d]*fixture->wrap_seconds;
+			if (fixture->start_joules[d]<0.0) {
+				fixture->start_joules[d]=0.0;
+			}
+		}
+	}
+
+	/* Every CPU gets its own cpuinfo block, like the real thing */
+	cpuinfo=open_memstream(&contents,&size);
+	if (cpuinfo==NULL) return -1;
+	for(cpu=0;cpu<fixture->packages*fixture->cpus_per_package;cpu++) {
+		fprintf(cpuinfo,"processor\t: %d\n"
+			"vendor_id\t: GenuineIntel\n"
+			"cpu family\t: 6\n"
+			"model\t\t: %d\n"
+			"model name\t: RAPL fixture\n\n",
+			cpu,RAPL_FIXTURE_MODEL);
+	}
+	fclose(cpuinfo);
+	if (write_file(fixture,contents,"/proc/cpuinfo")<0) {
+		free(contents);
+		return -1;
+	}
+	free(contents);
+
+	if (write_file(fixture,"0\n","/proc/sys/kernel/perf_event_paranoid")<0) {
+		return -1;
+	}
+
+	for(cpu=0;cpu<fixture->packages*fixture->cpus_per_package;cpu++) {
+		j=cpu/fixture->cpus_per_package;
+
+		snprintf(buffer,sizeof(buffer),"%d\n",j);
+		if (write_file(fixture,buffer,"/sys/devices/system/cpu/cpu%d/"
+				"topology/physical_package_id",cpu)<0) goto error;
+		snprintf(buffer,sizeof(buffer),"%d\n",cpu);
+		if (write_file(fixture,buffer,"/sys/devices/system/cpu/cpu%d/"
+				"topology/thread_siblings_list",cpu)<0) goto error;
+		if ((cpu) && (write_file(fixture,"1\n",
+				"/sys/devices/system/cpu/cpu%d/online",cpu)<0)) {
+			goto error;
+		}
+
+		if (create_msrs(fixture,cpu)<0) goto error;
+	}
+
+	for(j=0;j<fixture->packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!energy_msr[d]) continue;
+			if (create_zone(fixture,j,d)<0) goto error;
+		}
+	}
+
+	fixture->start_ns=rapl_monotonic_ns();
+	rapl_fixture_update(fixture,fixture->start_ns);
+
+	return 0;
+
+error:
+	rapl_fixture_close(fixture);
+	return -1;
+}
+
+void rapl_fixture_update(struct rapl_fixture *fixture, long long now_ns) {
+
+	char buffer[32];
+	double joules;
+	uint64_t raw,uj;
+	int cpu,d,j,len;
+
+	for(j=0;j<fixture->packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!energy_msr[d]) continue;
+
+			joules=fixture->start_joules[d]+fixture->watts[d]*
+				(double)(now_ns-fixture->start_ns)/1000000000.0;
+
+			/* Package MSRs read the same from every CPU in it */
+			raw=(uint32_t)(uint64_t)(joules/fixture->units[d]);
+			for(cpu=j*fixture->cpus_per_package;
+				cpu<(j+1)*fixture->cpus_per_package;cpu++) {
+				write_msr(fixture,cpu,energy_msr[d],raw);
+			}
+
+			/* A shorter number over a longer one leaves a tail	*/
+			/* after the newline until the truncate; readers	*/
+			/* stop at the newline so that's harmless.		*/
+			uj=(uint64_t)(joules*1000000.0)%fixture->max_range_uj[d];
+			len=snprintf(buffer,sizeof(buffer),"%llu\n",
+				(unsigned long long)uj);
+			if (pwrite(fixture->uj_fd[j][d],buffer,len,0)==len) {
+				if (ftruncate(fixture->uj_fd[j][d],len)<0) continue;
+			}
+		}
+	}
+}
+
+void rapl_fixture_close(struct rapl_fixture *fixture) {
+
+	int cpu,d,j;
+
+	for(cpu=0;cpu<RAPL_MAX_CPUS;cpu++) {
+		if (fixture->msr_fd[cpu]>=0) close(fixture->msr_fd[cpu]);
+		fixture->msr_fd[cpu]=-1;
+	}
+	for(j=0;j<RAPL_MAX_PACKAGES;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (fixture->uj_fd[j][d]>=0) close(fixture->uj_fd[j][d]);
+			fixture->uj_fd[j][d]=-1;
+		}
+	}
+}
+
+static int remove_entry(const char *path, const struct stat *st,
+		int type, struct FTW *ftw) {
+
+	return remove(path);
+}
+
+int rapl_fixture_remove(struct rapl_fixture *fixture) {
+
+	return nftw(fixture->root,remove_entry,16,FTW_DEPTH|FTW_PHYS);
+}
@@ -0,0 +1,135 @@
+/* Build a synthetic RAPL tree and keep its counters running	*/
+/*									*/
+/* For running rapl-read, rapl-plot and friends with -R dir on	*/
+/* machines without RAPL, or without root.  See rapl-fixture.h.	*/
+/*									*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include "rapl-lib.h"
+#include "rapl-fixture.h"
+
+static volatile sig_atomic_t done=0;
+
+static void sigint_handler(int signum) {
+
+	done=1;
+}
+
+int main(int argc, char **argv) {
+
+	static struct rapl_fixture fixture;
+	struct timespec deadline_ts;
+	long long period_ns=1000000LL,run_ns=0,deadline;
+	char *root=NULL;
+	int create_only=0;
+	int c;
+
+	rapl_fixture_init(&fixture,"");
+
+	while ((c = getopt (argc, argv, "c:d:hi:k:np:R:s:t:w:")) != -1) {
+		switch (c) {
+		case 'c':
+			fixture.cpus_per_package = atoi(optarg);
+			break;
+		case 'd':
+			fixture.watts[RAPL_DOMAIN_DRAM] = atof(optarg);
+			break;
+		case 'h':
+			printf("Usage: %s -R dir [-c cpus] [-d watts] [-h] [-i ms] [-k watts] [-n]\n"
+				"\t\t[-p packages] [-s sec] [-t sec] [-w watts]\n\n",argv[0]);
+			printf("\t-R dir  : where to build the tree\n");
+			printf("\t-c cpus : CPUs per package (default %d)\n",
+				fixture.cpus_per_package);
+			printf("\t-d watts: DRAM power (default %.1f)\n",
+				fixture.watts[RAPL_DOMAIN_DRAM]);
+			printf("\t-h      : displays this help\n");
+			printf("\t-i ms   : counter update period (default 1)\n");
+			printf("\t-k watts: cores (PP0) power (default %.1f)\n",
+				fixture.watts[RAPL_DOMAIN_PP0]);
+			printf("\t-n      : just build the tree, don't run the counters\n");
+			printf("\t-p num  : packages (default %d)\n",fixture.packages);
+			printf("\t-s sec  : start the counters sec before they wrap\n");
+			printf("\t-t sec  : stop after sec (default until interrupted)\n");
+			printf("\t-w watts: package power (default %.1f)\n",
+				fixture.watts[RAPL_DOMAIN_PKG]);
+			exit(0);
+		case 'i':
+			period_ns = (long long)(atof(optarg)*1000000.0);
+			if (period_ns<=0) {
+				fprintf(stderr,"Invalid period %s\n",optarg);
+				exit(-1);
+			}
+			break;
+		case 'k':
+			fixture.watts[RAPL_DOMAIN_PP0] = atof(optarg);
+			break;
+		case 'n':
+			create_only = 1;
+			break;
+		case 'p':
+			fixture.packages = atoi(optarg);
+			break;
+		case 'R':
+			root = optarg;
+			break;
+		case 's':
+			fixture.wrap_seconds = atof(optarg);
+			break;
+		case 't':
+			run_ns = (long long)(atof(optarg)*1000000000.0);
+			break;
+		case 'w':
+			fixture.watts[RAPL_DOMAIN_PKG] = atof(optarg);
+			break;
+		default:
+			fprintf(stderr,"Unknown option %c\n",c);
+			exit(-1);
+		}
+	}
+
+	if (root==NULL) {
+		fprintf(stderr,"Need -R dir, see -h\n");
+		return -1;
+	}
+	snprintf(fixture.root,sizeof(fixture.root),"%s",root);
+
+	if (rapl_fixture_create(&fixture)<0) return -1;
+
+	printf("Built %d package(s) of %d CPUs under %s: "
+		"PKG %.1fW, PP0 %.1fW, DRAM %.1fW\n",
+		fixture.packages,fixture.cpus_per_package,fixture.root,
+		fixture.watts[RAPL_DOMAIN_PKG],fixture.watts[RAPL_DOMAIN_PP0],
+		fixture.watts[RAPL_DOMAIN_DRAM]);
+
+	if (create_only) {
+		rapl_fixture_close(&fixture);
+		return 0;
+	}
+
+	printf("Updating every %.3fms, run the tools with -R %s\n",
+		(double)period_ns/1000000.0,fixture.root);
+	fflush(stdout);
+
+	signal(SIGINT,sigint_handler);
+	signal(SIGTERM,sigint_handler);
+
+	deadline=fixture.start_ns;
+	while(!done) {
+		deadline+=period_ns;
+		if ((run_ns) && (deadline-fixture.start_ns>run_ns)) break;
+		deadline_ts.tv_sec=deadline/1000000000LL;
+		deadline_ts.tv_nsec=deadline%1000000000LL;
+		clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&deadline_ts,NULL);
+		rapl_fixture_update(&fixture,rapl_monotonic_ns());
+	}
+
+	rapl_fixture_close(&fixture);
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+/* Synthetic RAPL machine for running the tools without RAPL	*/
+/*									*/
+/* rapl_fixture_create() builds a tree under root that looks like	*/
+/* a Skylake-X to librapl: proc/cpuinfo, the cpu topology in sys,	*/
+/* the powercap zones and a regular file per CPU standing in for	*/
+/* dev/cpu/N/msr, with each MSR at its own offset.  Point the tools	*/
+/* at it with -R root or $HW_ROOT.					*/
+/*									*/
+/* rapl_fixture_update() moves every energy counter to where it	*/
+/* would be after running at watts[] since rapl_fixture_create().	*/
+/* Call it about once a millisecond, like the hardware.  The MSR	*/
+/* counters wrap at 32 bits and the sysfs ones at			*/
+/* max_energy_range_uj; wrap_seconds starts them that close to	*/
+/* their wrap so it happens early in a run.			*/
+/*									*/
+/* Needs rapl-lib.h included first.				*/
+
+#define RAPL_FIXTURE_MODEL	CPU_SKYLAKE_X
+
+/* The power unit MSR: 1/8W, 2^-14J, 2^-10s */
+#define RAPL_FIXTURE_UNITS	0xA0E03ULL
+/* Skylake-X DRAM always counts in 2^-16J */
+#define RAPL_FIXTURE_DRAM_UNITS	(1.0/65536.0)
+
+struct rapl_fixture {
+	char root[BUFSIZ];
+	int packages;
+	int cpus_per_package;
+	double watts[RAPL_NUM_DOMAINS];	/* PKG, PP0 and DRAM are used */
+	double wrap_seconds;
+
+	/* filled in by rapl_fixture_create() */
+	long long start_ns;
+	double start_joules[RAPL_NUM_DOMAINS];
+	double units[RAPL_NUM_DOMAINS];
+	uint64_t max_range_uj[RAPL_NUM_DOMAINS];
+	int msr_fd[RAPL_MAX_CPUS];
+	int uj_fd[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+};
+
+/* Sensible defaults: one package of two CPUs at 50W */
+void rapl_fixture_init(struct rapl_fixture *fixture, const char *root);
+int rapl_fixture_create(struct rapl_fixture *fixture);
+void rapl_fixture_update(struct rapl_fixture *fixture, long long now_ns);
+void rapl_fixture_close(struct rapl_fixture *fixture);
+/* rm -rf the tree */
+int rapl_fixture_remove(struct rapl_fixture *fixture);
@@ -0,0 +1,2957 @@
+/* Shared RAPL code, factored out of rapl-read and rapl-plot		*/
+/*									*/
+/* The same three ways of reading RAPL as rapl-read:			*/
+/*	1. Read the MSRs directly with /dev/cpu/??/msr			*/
+/*	2. Use the perf_event_open() interface				*/
+/*	3. Read the values from the sysfs powercap interface		*/
+/*									*/
+/* The difference is each backend is opened once with rapl_open()	*/
+/* and then rapl_read() just re-reads the counters, so it can be	*/
+/* called from a hot loop or around a region of interest.		*/
+/*									*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "rapl-lib.h"
+
+int rapl_total_cores=0,rapl_total_packages=0;
+int rapl_package_map[RAPL_MAX_PACKAGES];
+
+unsigned int rapl_msr_units_reg,rapl_msr_pkg_energy_reg;
+unsigned int rapl_msr_pp0_energy_reg;
+
+double rapl_power_units[RAPL_MAX_PACKAGES];
+double rapl_time_units[RAPL_MAX_PACKAGES];
+uint64_t rapl_units_raw[RAPL_MAX_PACKAGES];
+
+uint64_t rapl_raw[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+double rapl_units[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+int rapl_available=0;
+int rapl_backend=0;
+
+long long rapl_msr_wrap_poll_ns=0;
+unsigned long long rapl_syscalls=0;
+
+static const char *domain_names[RAPL_NUM_DOMAINS]={
+	"PKG","PP0","PP1","DRAM","PSYS",
+};
+
+const char *rapl_domain_name(int domain) {
+
+	if ((domain<0) || (domain>=RAPL_NUM_DOMAINS)) return "unknown";
+
+	return domain_names[domain];
+}
+
+const char *rapl_backend_name(int backend) {
+
+	switch(backend) {
+		case RAPL_BACKEND_MSR:		return "msr";
+		case RAPL_BACKEND_PERF:		return "perf_event";
+		case RAPL_BACKEND_SYSFS:	return "sysfs";
+		case RAPL_BACKEND_CHEAPEST:	return "cheapest";
+	}
+
+	return "none";
+}
+
+/* Every /dev, /sys and /proc path goes through rapl_path(), so	*/
+/* the whole library can be pointed at a fake tree.		*/
+static char root_prefix[BUFSIZ];
+static int root_set=0;
+
+void rapl_set_root(const char *root) {
+
+	snprintf(root_prefix,sizeof(root_prefix),"%s",root?root:"");
+	root_set=1;
+}
+
+const char *rapl_root(void) {
+
+	if (!root_set) rapl_set_root(getenv("HW_ROOT"));
+
+	return root_prefix;
+}
+
+char *rapl_path(char *buffer, size_t size, const char *format, ...) {
+
+	va_list ap;
+	int len;
+
+	len=snprintf(buffer,size,"%s",rapl_root());
+	if (len>=(int)size) len=size-1;
+
+	va_start(ap,format);
+	vsnprintf(buffer+len,size-len,format,ap);
+	va_end(ap);
+
+	return buffer;
+}
+
+static int open_msr_mode(int core, int mode) {
+
+	char msr_filename[BUFSIZ];
+	int fd;
+
+	rapl_path(msr_filename,sizeof(msr_filename),"/dev/cpu/%d/msr",core);
+	fd = open(msr_filename, mode);
+	if ( fd < 0 ) {
+		if ( errno == ENXIO ) {
+			fprintf(stderr, "rdmsr: No CPU %d\n", core);
+		} else if ( errno == EIO ) {
+			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n",
+					core);
+		} else {
+			perror("rdmsr:open");
+			fprintf(stderr,"Trying to open %s\n",msr_filename);
+		}
+		return -1;
+	}
+
+	return fd;
+}
+
+int rapl_open_msr(int core) {
+
+	return open_msr_mode(core,O_RDONLY);
+}
+
+int rapl_open_msr_rw(int core) {
+
+	return open_msr_mode(core,O_RDWR);
+}
+
+/* fd+1 so that the zeroed array means nothing is open yet */
+static int msr_cpu_fd[RAPL_MAX_CPUS];
+
+int rapl_msr_fd(int cpu) {
+
+	int fd;
+
+	if ((cpu<0) || (cpu>=RAPL_MAX_CPUS)) return -1;
+
+	if (msr_cpu_fd[cpu]) return msr_cpu_fd[cpu]-1;
+
+	fd=rapl_open_msr(cpu);
+	if (fd<0) return -1;
+	msr_cpu_fd[cpu]=fd+1;
+
+	return fd;
+}
+
+void rapl_msr_fds_close(void) {
+
+	int cpu;
+
+	for(cpu=0;cpu<RAPL_MAX_CPUS;cpu++) {
+		if (msr_cpu_fd[cpu]) close(msr_cpu_fd[cpu]-1);
+		msr_cpu_fd[cpu]=0;
+	}
+}
+
+/* Like rapl_read_msr() but quiet, for MSRs that might not exist,	*/
+/* which the msr driver reports as EIO.				*/
+int rapl_probe_msr(int fd, unsigned int which, uint64_t *value) {
+
+	rapl_syscalls++;
+	if ( pread(fd, value, sizeof *value, which) != sizeof *value ) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int rapl_write_msr(int fd, unsigned int which, uint64_t value) {
+
+	if ( pwrite(fd, &value, sizeof value, which) != sizeof value ) {
+		fprintf(stderr,"wrmsr: Error writing MSR %x: %s\n",
+			which,strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int rapl_read_msr(int fd, unsigned int which, uint64_t *value) {
+
+	ssize_t result;
+
+	rapl_syscalls++;
+	result=pread(fd, value, sizeof *value, which);
+	if ( result != sizeof *value ) {
+		/* a short read leaves errno alone */
+		if (result>=0) errno=EIO;
+		fprintf(stderr,"rdmsr: Error reading MSR %x: %s\n",
+			which,strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int rapl_perf_event_open(struct perf_event_attr *hw_event_uptr,
+                    pid_t pid, int cpu, int group_fd, unsigned long flags) {
+
+        return syscall(__NR_perf_event_open,hw_event_uptr, pid, cpu,
+                        group_fd, flags);
+}
+
+int rapl_check_paranoid(void) {
+
+	char filename[BUFSIZ];
+	int paranoid_value;
+	FILE *fff;
+
+	rapl_path(filename,sizeof(filename),
+		"/proc/sys/kernel/perf_event_paranoid");
+	fff=fopen(filename,"r");
+	if (fff==NULL) {
+		fprintf(stderr,"Error! could not open %s %s\n",
+			filename,strerror(errno));
+
+		/* We can't return a negative value as that implies no paranoia */
+		return 500;
+	}
+
+	fscanf(fff,"%d",&paranoid_value);
+	fclose(fff);
+
+	return paranoid_value;
+
+}
+
+long long rapl_monotonic_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+
+	return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+uint64_t rapl_rdtsc(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned a,d;
+
+	__asm__ volatile("rdtsc" : "=a" (a), "=d" (d));
+
+	return ((uint64_t)a) | (((uint64_t)d) << 32);
+#else
+	return (uint64_t)rapl_monotonic_ns();
+#endif
+}
+
+double rapl_tsc_hz(void) {
+
+	static double tsc_hz=0.0;
+	long long ns_before,ns_after;
+	uint64_t tsc_before,tsc_after;
+
+	if (tsc_hz!=0.0) return tsc_hz;
+
+	ns_before=rapl_monotonic_ns();
+	tsc_before=rapl_rdtsc();
+	usleep(20000);
+	tsc_after=rapl_rdtsc();
+	ns_after=rapl_monotonic_ns();
+
+	tsc_hz=(double)(tsc_after-tsc_before)*1000000000.0/
+		(double)(ns_after-ns_before);
+
+	return tsc_hz;
+}
+
+
+/* TODO: on Skylake, also may support  PSys "platform" domain,	*/
+/* the whole SoC not just the package.				*/
+/* see dcee75b3b7f025cc6765e6c92ba0a4e59a4d25f4			*/
+
+int rapl_detect_cpu(void) {
+
+	FILE *fff;
+
+	int vendor=-1,family,model=-1;
+	char buffer[BUFSIZ],*result;
+	char vendor_string[BUFSIZ];
+
+	fff=fopen(rapl_path(buffer,sizeof(buffer),"/proc/cpuinfo"),"r");
+	if (fff==NULL) return -1;
+
+	while(1) {
+		result=fgets(buffer,BUFSIZ,fff);
+		if (result==NULL) break;
+
+		if (!strncmp(result,"vendor_id",8)) {
+			sscanf(result,"%*s%*s%s",vendor_string);
+
+			if (!strncmp(vendor_string,"GenuineIntel",12)) {
+				vendor=CPU_VENDOR_INTEL;
+			}
+			if (!strncmp(vendor_string,"AuthenticAMD",12)) {
+				vendor=CPU_VENDOR_AMD;
+			}
+		}
+
+		if (!strncmp(result,"cpu family",10)) {
+			sscanf(result,"%*s%*s%*s%d",&family);
+		}
+
+		if (!strncmp(result,"model",5)) {
+			sscanf(result,"%*s%*s%d",&model);
+		}
+
+	}
+
+	fclose(fff);
+
+	if (vendor==CPU_VENDOR_INTEL) {
+		if (family!=6) {
+			printf("Wrong CPU family %d\n",family);
+			return -1;
+		}
+
+		rapl_msr_units_reg=MSR_INTEL_RAPL_POWER_UNIT;
+		rapl_msr_pkg_energy_reg=MSR_INTEL_PKG_ENERGY_STATUS;
+		rapl_msr_pp0_energy_reg=MSR_INTEL_PP0_ENERGY_STATUS;
+
+		printf("Found ");
+
+		switch(model) {
+			case CPU_SANDYBRIDGE:
+				printf("Sandybridge");
+				break;
+			case CPU_SANDYBRIDGE_EP:
+				printf("Sandybridge-EP");
+				break;
+			case CPU_IVYBRIDGE:
+				printf("Ivybridge");
+				break;
+			case CPU_IVYBRIDGE_EP:
+				printf("Ivybridge-EP");
+				break;
+			case CPU_HASWELL:
+			case CPU_HASWELL_ULT:
+			case CPU_HASWELL_GT3E:
+				printf("Haswell");
+				break;
+			case CPU_HASWELL_EP:
+				printf("Haswell-EP");
+				break;
+			case CPU_BROADWELL:
+			case CPU_BROADWELL_GT3E:
+				printf("Broadwell");
+				break;
+			case CPU_BROADWELL_EP:
+				printf("Broadwell-EP");
+				break;
+			case CPU_SKYLAKE:
+			case CPU_SKYLAKE_HS:
+				printf("Skylake");
+				break;
+			case CPU_SKYLAKE_X:
+				printf("Skylake-X");
+				break;
+			case CPU_KABYLAKE:
+			case CPU_KABYLAKE_MOBILE:
+				printf("Kaby Lake");
+				break;
+			case CPU_KNIGHTS_LANDING:
+				printf("Knight's Landing");
+				break;
+			case CPU_KNIGHTS_MILL:
+				printf("Knight's Mill");
+				break;
+			case CPU_ATOM_GOLDMONT:
+			case CPU_ATOM_GEMINI_LAKE:
+			case CPU_ATOM_DENVERTON:
+				printf("Atom");
+				break;
+			default:
+				printf("Unsupported model %d\n",model);
+				model=-1;
+				break;
+		}
+	}
+
+	if (vendor==CPU_VENDOR_AMD) {
+
+		rapl_msr_units_reg=MSR_AMD_RAPL_POWER_UNIT;
+		rapl_msr_pkg_energy_reg=MSR_AMD_PKG_ENERGY_STATUS;
+		rapl_msr_pp0_energy_reg=MSR_AMD_PP0_ENERGY_STATUS;
+
+		if (family!=23) {
+			printf("Wrong CPU family %d\n",family);
+			return -1;
+		}
+		model=CPU_AMD_FAM17H;
+	}
+
+	printf(" Processor type\n");
+
+	return model;
+}
+
+int rapl_detect_packages(void) {
+
+	char filename[BUFSIZ];
+	FILE *fff;
+	int package;
+	int i;
+
+	for(i=0;i<RAPL_MAX_PACKAGES;i++) rapl_package_map[i]=-1;
+	rapl_total_packages=0;
+
+	printf("\t");
+	for(i=0;i<RAPL_MAX_CPUS;i++) {
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",i);
+		fff=fopen(filename,"r");
+		if (fff==NULL) break;
+		fscanf(fff,"%d",&package);
+		printf("%d (%d)",i,package);
+		if (i%8==7) printf("\n\t"); else printf(", ");
+		fclose(fff);
+
+		if ((package<0) || (package>=RAPL_MAX_PACKAGES)) continue;
+
+		if (rapl_package_map[package]==-1) {
+			rapl_total_packages++;
+			rapl_package_map[package]=i;
+		}
+
+	}
+
+	printf("\n");
+
+	rapl_total_cores=i;
+
+	printf("\tDetected %d cores in %d packages\n\n",
+		rapl_total_cores,rapl_total_packages);
+
+	return 0;
+}
+
+
+/*******************************/
+/* MSR code                    */
+/*******************************/
+
+/* One fd per package kept open for the whole run, and a fixed list	*/
+/* of energy MSRs to read.  Re-opening /dev/cpu/N/msr every sample	*/
+/* was most of the sampling overhead.  The fds come from		*/
+/* rapl_msr_fd() so the other MSR readers share them.		*/
+static int msr_fd[RAPL_MAX_PACKAGES];
+static int msr_num_domains=0;
+static int msr_domain[RAPL_NUM_DOMAINS];
+static unsigned int msr_domain_reg[RAPL_NUM_DOMAINS];
+
+/* The energy status MSRs are only 32 bits and wrap.  rapl_raw[][]	*/
+/* is extended to 64 bits by summing 32-bit deltas, which is exact	*/
+/* as long as each counter is read at least once per wrap.		*/
+static uint32_t msr_last_raw[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+/* Used when a domain doesn't report a maximum power.  On purpose	*/
+/* way too high; that only makes us poll a bit more often.	*/
+#define RAPL_DEFAULT_MAX_POWER	1000.0
+
+static void msr_add_domain(int domain, unsigned int reg) {
+
+	msr_domain[msr_num_domains]=domain;
+	msr_domain_reg[msr_num_domains]=reg;
+	msr_num_domains++;
+	rapl_available|=(1<<domain);
+}
+
+static int rapl_msr_open(int cpu_model) {
+
+	int fd;
+	uint64_t result;
+	double power_units,time_units;
+	double cpu_energy_units,dram_energy_units;
+	double thermal_spec_power,minimum_power,maximum_power,time_window;
+	double domain_max_power,wrap_time,min_wrap_time=0.0;
+	int i,j,d;
+
+	int dram_avail=0,pp0_avail=0,pp1_avail=0,psys_avail=0;
+	int different_units=0;
+
+	if (cpu_model<0) {
+		printf("\tUnsupported CPU model %d\n",cpu_model);
+		return -1;
+	}
+
+	switch(cpu_model) {
+
+		case CPU_SANDYBRIDGE_EP:
+		case CPU_IVYBRIDGE_EP:
+			pp0_avail=1;
+			pp1_avail=0;
+			dram_avail=1;
+			different_units=0;
+			psys_avail=0;
+			break;
+
+		case CPU_HASWELL_EP:
+		case CPU_BROADWELL_EP:
+		case CPU_SKYLAKE_X:
+			pp0_avail=1;
+			pp1_avail=0;
+			dram_avail=1;
+			different_units=1;
+			psys_avail=0;
+			break;
+
+		case CPU_KNIGHTS_LANDING:
+		case CPU_KNIGHTS_MILL:
+			pp0_avail=0;
+			pp1_avail=0;
+			dram_avail=1;
+			different_units=1;
+			psys_avail=0;
+			break;
+
+		case CPU_SANDYBRIDGE:
+		case CPU_IVYBRIDGE:
+			pp0_avail=1;
+			pp1_avail=1;
+			dram_avail=0;
+			different_units=0;
+			psys_avail=0;
+			break;
+
+		case CPU_HASWELL:
+		case CPU_HASWELL_ULT:
+		case CPU_HASWELL_GT3E:
+		case CPU_BROADWELL:
+		case CPU_BROADWELL_GT3E:
+		case CPU_ATOM_GOLDMONT:
+		case CPU_ATOM_GEMINI_LAKE:
+		case CPU_ATOM_DENVERTON:
+			pp0_avail=1;
+			pp1_avail=1;
+			dram_avail=1;
+			different_units=0;
+			psys_avail=0;
+			break;
+
+		case CPU_SKYLAKE:
+		case CPU_SKYLAKE_HS:
+		case CPU_KABYLAKE:
+		case CPU_KABYLAKE_MOBILE:
+			pp0_avail=1;
+			pp1_avail=1;
+			dram_avail=1;
+			different_units=0;
+			psys_avail=1;
+			break;
+
+		case CPU_AMD_FAM17H:
+			pp0_avail=1;		// maybe
+			pp1_avail=0;
+			dram_avail=0;
+			different_units=0;
+			psys_avail=0;
+			break;
+	}
+
+	msr_num_domains=0;
+	msr_add_domain(RAPL_DOMAIN_PKG,rapl_msr_pkg_energy_reg);
+	if (pp0_avail) msr_add_domain(RAPL_DOMAIN_PP0,rapl_msr_pp0_energy_reg);
+	if (pp1_avail) msr_add_domain(RAPL_DOMAIN_PP1,MSR_PP1_ENERGY_STATUS);
+	if (dram_avail) msr_add_domain(RAPL_DOMAIN_DRAM,MSR_DRAM_ENERGY_STATUS);
+	if (psys_avail) msr_add_domain(RAPL_DOMAIN_PSYS,MSR_PLATFORM_ENERGY_STATUS);
+
+	for(j=0;j<rapl_total_packages;j++) {
+		printf("\tListing paramaters for package #%d\n",j);
+
+		fd=rapl_msr_fd(rapl_package_map[j]);
+		if (fd<0) return -1;
+		msr_fd[j]=fd;
+
+		/* Calculate the units used */
+		if (rapl_read_msr(fd,rapl_msr_units_reg,&result)<0) return -1;
+		rapl_units_raw[j]=result;
+
+		power_units=pow(0.5,(double)(result&0xf));
+		cpu_energy_units=pow(0.5,(double)((result>>8)&0x1f));
+		time_units=pow(0.5,(double)((result>>16)&0xf));
+
+		/* On Haswell EP and Knights Landing */
+		/* The DRAM units differ from the CPU ones */
+		if (different_units) {
+			dram_energy_units=pow(0.5,(double)16);
+			printf("DRAM: Using %lf instead of %lf\n",
+				dram_energy_units,cpu_energy_units);
+		}
+		else {
+			dram_energy_units=cpu_energy_units;
+		}
+
+		rapl_power_units[j]=power_units;
+		rapl_time_units[j]=time_units;
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			rapl_units[j][d]=(d==RAPL_DOMAIN_DRAM)?
+				dram_energy_units:cpu_energy_units;
+		}
+
+		printf("\t\tPower units = %.3fW\n",power_units);
+		printf("\t\tCPU Energy units = %.8fJ\n",cpu_energy_units);
+		printf("\t\tDRAM Energy units = %.8fJ\n",dram_energy_units);
+		printf("\t\tTime units = %.8fs\n",time_units);
+		printf("\n");
+
+		thermal_spec_power=0.0;
+		maximum_power=0.0;
+
+		if (cpu_model!=CPU_AMD_FAM17H) {
+			/* Show package power info */
+			if (rapl_read_msr(fd,MSR_PKG_POWER_INFO,&result)<0) {
+				return -1;
+			}
+			thermal_spec_power=power_units*(double)(result&0x7fff);
+			printf("\t\tPackage thermal spec: %.3fW\n",thermal_spec_power);
+			minimum_power=power_units*(double)((result>>16)&0x7fff);
+			printf("\t\tPackage minimum power: %.3fW\n",minimum_power);
+			maximum_power=power_units*(double)((result>>32)&0x7fff);
+			printf("\t\tPackage maximum power: %.3fW\n",maximum_power);
+			time_window=time_units*(double)((result>>48)&0x7fff);
+			printf("\t\tPackage maximum time window: %.6fs\n",time_window);
+
+			/* Show package power limit */
+			if (rapl_read_msr(fd,MSR_PKG_RAPL_POWER_LIMIT,&result)<0) {
+				return -1;
+			}
+			printf("\t\tPackage power limits are %s\n", (result >> 63) ? "locked" : "unlocked");
+			double pkg_power_limit_1 = power_units*(double)((result>>0)&0x7FFF);
+			double pkg_time_window_1 = time_units*(double)((result>>17)&0x007F);
+			printf("\t\tPackage power limit #1: %.3fW for %.6fs (%s, %s)\n",
+				pkg_power_limit_1, pkg_time_window_1,
+				(result & (1LL<<15)) ? "enabled" : "disabled",
+				(result & (1LL<<16)) ? "clamped" : "not_clamped");
+			double pkg_power_limit_2 = power_units*(double)((result>>32)&0x7FFF);
+			double pkg_time_window_2 = time_units*(double)((result>>49)&0x007F);
+			printf("\t\tPackage power limit #2: %.3fW for %.6fs (%s, %s)\n",
+				pkg_power_limit_2, pkg_time_window_2,
+				(result & (1LL<<47)) ? "enabled" : "disabled",
+				(result & (1LL<<48)) ? "clamped" : "not_clamped");
+		}
+
+		/* Work out how fast each counter can wrap.  PP0/PP1 are	*/
+		/* part of the package so can't beat the package max power.	*/
+		/* Fall back to TDP and then to something silly if the chip	*/
+		/* doesn't report a maximum.					*/
+		if (maximum_power<=0.0) maximum_power=2.0*thermal_spec_power;
+		if (maximum_power<=0.0) maximum_power=RAPL_DEFAULT_MAX_POWER;
+
+		for(i=0;i<msr_num_domains;i++) {
+			d=msr_domain[i];
+			domain_max_power=maximum_power;
+			if (d==RAPL_DOMAIN_DRAM) {
+				if (rapl_read_msr(fd,MSR_DRAM_POWER_INFO,
+						&result)<0) {
+					return -1;
+				}
+				domain_max_power=power_units*
+					(double)((result>>32)&0x7fff);
+				if (domain_max_power<=0.0) {
+					domain_max_power=RAPL_DEFAULT_MAX_POWER;
+				}
+			}
+			/* PSys is the whole platform, no upper bound known */
+			if (d==RAPL_DOMAIN_PSYS) {
+				domain_max_power=RAPL_DEFAULT_MAX_POWER;
+			}
+
+			wrap_time=4294967296.0*rapl_units[j][d]/domain_max_power;
+			if ((min_wrap_time==0.0) || (wrap_time<min_wrap_time)) {
+				min_wrap_time=wrap_time;
+			}
+
+			/* Starting point for the 64-bit accumulators */
+			if (rapl_read_msr(fd,msr_domain_reg[i],&result)<0) {
+				return -1;
+			}
+			msr_last_raw[j][i]=(uint32_t)result;
+			rapl_raw[j][d]=msr_last_raw[j][i];
+		}
+
+		/* fd is left open, rapl_read() re-uses it every sample */
+	}
+
+	/* Poll at twice the fastest possible wrap rate to be safe */
+	rapl_msr_wrap_poll_ns=(long long)(min_wrap_time*1000000000.0/2.0);
+	printf("\tFastest counter wrap %.1fs, polling at least every %.1fs\n",
+		min_wrap_time,(double)rapl_msr_wrap_poll_ns/1000000000.0);
+	printf("\n");
+
+	return 0;
+}
+
+/* Called every sample, so no opens and no allocation in here.	*/
+/* The unsigned 32-bit subtract handles a single wrap for free.	*/
+static int rapl_msr_read_package(int j) {
+
+	uint64_t value;
+	uint32_t raw;
+	int i;
+
+	for(i=0;i<msr_num_domains;i++) {
+		if (rapl_read_msr(msr_fd[j],msr_domain_reg[i],&value)<0) {
+			return -1;
+		}
+		raw=(uint32_t)value;
+		rapl_raw[j][msr_domain[i]]+=(uint32_t)(raw-msr_last_raw[j][i]);
+		msr_last_raw[j][i]=raw;
+	}
+
+	return 0;
+}
+
+/* Nothing to do, the fds are shared and rapl_msr_fds_close()	*/
+/* closes them.							*/
+static void rapl_msr_close(void) {
+
+}
+
+
+/*******************************/
+/* perf_event code             */
+/*******************************/
+
+static const char *perf_event_names[RAPL_NUM_DOMAINS]= {
+	"energy-pkg",
+	"energy-cores",
+	"energy-gpu",
+	"energy-ram",
+	"energy-psys",
+};
+
+static int perf_fd[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+/* Each package's domains are one event group, so a single read()	*/
+/* of the leader returns them all, in the order they were added.	*/
+static int perf_leader[RAPL_MAX_PACKAGES];
+static int perf_group_size[RAPL_MAX_PACKAGES];
+static int perf_group_domain[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+static void rapl_perf_close(void) {
+
+	int d,j;
+
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (perf_fd[j][d]>=0) close(perf_fd[j][d]);
+			perf_fd[j][d]=-1;
+		}
+		perf_leader[j]=-1;
+		perf_group_size[j]=0;
+	}
+}
+
+static int rapl_perf_open(void) {
+
+	FILE *fff;
+
+	int type;
+	int config[RAPL_NUM_DOMAINS];
+	double scale[RAPL_NUM_DOMAINS];
+	char units[RAPL_NUM_DOMAINS][BUFSIZ];
+	char filename[BUFSIZ];
+	struct perf_event_attr attr;
+	int paranoid_value;
+
+	int d,j;
+
+	rapl_path(filename,sizeof(filename),
+		"/sys/bus/event_source/devices/power/type");
+	fff=fopen(filename,"r");
+	if (fff==NULL) {
+		printf("\tNo perf_event rapl support found (requires Linux 3.14)\n");
+		printf("\tFalling back to raw msr support\n\n");
+		return -1;
+	}
+	fscanf(fff,"%d",&type);
+	fclose(fff);
+
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+
+		config[d]=0;
+		scale[d]=0.0;
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/bus/event_source/devices/power/events/%s",
+			perf_event_names[d]);
+
+		fff=fopen(filename,"r");
+
+		if (fff!=NULL) {
+			fscanf(fff,"event=%x",&config[d]);
+			printf("\tType=%d Event=%s Config=%d ",type,
+				perf_event_names[d],config[d]);
+			fclose(fff);
+		} else {
+			continue;
+		}
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/bus/event_source/devices/power/events/%s.scale",
+			perf_event_names[d]);
+		fff=fopen(filename,"r");
+
+		if (fff!=NULL) {
+			fscanf(fff,"%lf",&scale[d]);
+			printf("scale=%g ",scale[d]);
+			fclose(fff);
+		}
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/bus/event_source/devices/power/events/%s.unit",
+			perf_event_names[d]);
+		fff=fopen(filename,"r");
+
+		if (fff!=NULL) {
+			fscanf(fff,"%s",units[d]);
+			printf("units=%s ",units[d]);
+			fclose(fff);
+		}
+
+		printf("\n");
+	}
+
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) perf_fd[j][d]=-1;
+		perf_leader[j]=-1;
+		perf_group_size[j]=0;
+	}
+
+	for(j=0;j<rapl_total_packages;j++) {
+
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+
+			memset(&attr,0x0,sizeof(attr));
+			attr.type=type;
+			attr.config=config[d];
+			attr.read_format=PERF_FORMAT_GROUP;
+			if (config[d]==0) continue;
+
+			perf_fd[j][d]=rapl_perf_event_open(&attr,-1,
+						rapl_package_map[j],perf_leader[j],0);
+			if (perf_fd[j][d]<0) {
+				if (errno==EACCES) {
+					paranoid_value=rapl_check_paranoid();
+					if (paranoid_value>0) {
+						printf("\t/proc/sys/kernel/perf_event_paranoid is %d\n",paranoid_value);
+						printf("\tThe value must be 0 or lower to read system-wide RAPL values\n");
+					}
+
+					printf("\tPermission denied; run as root or adjust paranoid value\n\n");
+				}
+				else {
+					printf("\terror opening core %d config %d: %s\n\n",
+						rapl_package_map[j], config[d], strerror(errno));
+				}
+				rapl_perf_close();
+				return -1;
+			}
+
+			if (perf_leader[j]==-1) perf_leader[j]=perf_fd[j][d];
+			perf_group_domain[j][perf_group_size[j]]=d;
+			perf_group_size[j]++;
+
+			rapl_units[j][d]=scale[d];
+			rapl_available|=(1<<d);
+		}
+	}
+
+	return 0;
+}
+
+static int rapl_perf_read_package(int j) {
+
+	/* PERF_FORMAT_GROUP layout: nr, then one value per member */
+	uint64_t buffer[1+RAPL_NUM_DOMAINS];
+	ssize_t size;
+	uint64_t i;
+
+	if (perf_leader[j]==-1) return 0;
+
+	rapl_syscalls++;
+	size=read(perf_leader[j],buffer,sizeof(buffer));
+	if (size<(ssize_t)sizeof(uint64_t)) return -1;
+
+	for(i=0;(i<buffer[0]) && (i<(uint64_t)perf_group_size[j]);i++) {
+		rapl_raw[j][perf_group_domain[j][i]]=buffer[1+i];
+	}
+
+	return 0;
+}
+
+
+/*******************************/
+/* sysfs powercap code         */
+/*******************************/
+
+/* energy_uj is opened once and re-read with pread() at offset 0,	*/
+/* so a sample is one syscall per domain with no path lookups.		*/
+/* The counter wraps at max_energy_range_uj, which we read once.	*/
+static int sysfs_fd[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+static uint64_t sysfs_max_range[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+static uint64_t sysfs_last[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+static int sysfs_domain(char *name) {
+
+	if (!strncmp("package",name,7)) return RAPL_DOMAIN_PKG;
+	if (!strcmp("core",name)) return RAPL_DOMAIN_PP0;
+	if (!strcmp("uncore",name)) return RAPL_DOMAIN_PP1;
+	if (!strcmp("dram",name)) return RAPL_DOMAIN_DRAM;
+	if (!strcmp("psys",name)) return RAPL_DOMAIN_PSYS;
+
+	printf("Unknown %s\n",name);
+
+	return -1;
+}
+
+/* energy_uj is a plain decimal number and a newline, so skip stdio */
+static int sysfs_read_uj(int fd, uint64_t *value) {
+
+	char buffer[32];
+	ssize_t size;
+	uint64_t result=0;
+	int i;
+
+	rapl_syscalls++;
+	size=pread(fd,buffer,sizeof(buffer),0);
+	if (size<=0) return -1;
+
+	for(i=0;i<size;i++) {
+		if ((buffer[i]<'0') || (buffer[i]>'9')) break;
+		result=result*10+(buffer[i]-'0');
+	}
+	if (i==0) return -1;
+
+	*value=result;
+
+	return 0;
+}
+
+static void rapl_sysfs_close(void) {
+
+	int d,j;
+
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (sysfs_fd[j][d]>=0) close(sysfs_fd[j][d]);
+			sysfs_fd[j][d]=-1;
+		}
+	}
+}
+
+static int rapl_sysfs_open(void) {
+
+	char event_name[256];
+	char basename[256];
+	char dirname[512];
+	char tempfile[BUFSIZ];
+	unsigned long long max_range;
+	int i,j,d;
+	FILE *fff;
+
+	/* /sys/class/powercap/intel-rapl/intel-rapl:0/ */
+	/* name has name */
+	/* energy_uj has energy */
+	/* subdirectories intel-rapl:0:0 intel-rapl:0:1 intel-rapl:0:2 */
+
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			sysfs_fd[j][d]=-1;
+			rapl_units[j][d]=1.0/1000000.0;
+		}
+	}
+
+	for(j=0;j<rapl_total_packages;j++) {
+		rapl_path(basename,sizeof(basename),
+			"/sys/class/powercap/intel-rapl/intel-rapl:%d",j);
+
+		/* i==0 is the package itself, then the subdomains */
+		for(i=0;i<RAPL_NUM_DOMAINS;i++) {
+			if (i==0) {
+				sprintf(dirname,"%s",basename);
+			}
+			else {
+				sprintf(dirname,"%s/intel-rapl:%d:%d",
+					basename,j,i-1);
+			}
+			sprintf(tempfile,"%s/name",dirname);
+			fff=fopen(tempfile,"r");
+			if (fff==NULL) {
+				if (i==0) {
+					fprintf(stderr,"\tCould not open %s\n",
+						tempfile);
+					rapl_sysfs_close();
+					return -1;
+				}
+				continue;
+			}
+			fscanf(fff,"%255s",event_name);
+			fclose(fff);
+
+			d=sysfs_domain(event_name);
+			if (d<0) continue;
+
+			/* Without the range we can't undo a wrap, so	*/
+			/* assume the full 64 bits.			*/
+			max_range=0;
+			sprintf(tempfile,"%s/max_energy_range_uj",dirname);
+			fff=fopen(tempfile,"r");
+			if (fff!=NULL) {
+				if (fscanf(fff,"%llu",&max_range)!=1) max_range=0;
+				fclose(fff);
+			}
+			sysfs_max_range[j][d]=max_range;
+
+			sprintf(tempfile,"%s/energy_uj",dirname);
+			sysfs_fd[j][d]=open(tempfile,O_RDONLY);
+			if (sysfs_fd[j][d]<0) {
+				fprintf(stderr,"\tError opening %s: %s\n",
+					tempfile,strerror(errno));
+				continue;
+			}
+
+			if (sysfs_read_uj(sysfs_fd[j][d],&sysfs_last[j][d])<0) {
+				fprintf(stderr,"\tError reading %s\n",tempfile);
+				close(sysfs_fd[j][d]);
+				sysfs_fd[j][d]=-1;
+				continue;
+			}
+			rapl_raw[j][d]=sysfs_last[j][d];
+			rapl_available|=(1<<d);
+		}
+	}
+
+	return 0;
+}
+
+static int rapl_sysfs_read_package(int j) {
+
+	uint64_t value,delta;
+	int d;
+
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (sysfs_fd[j][d]<0) continue;
+
+		if (sysfs_read_uj(sysfs_fd[j][d],&value)<0) return -1;
+
+		if (value>=sysfs_last[j][d]) {
+			delta=value-sysfs_last[j][d];
+		}
+		else {
+			/* wrapped past max_energy_range_uj back to 0 */
+			delta=sysfs_max_range[j][d]-sysfs_last[j][d]+value;
+		}
+		sysfs_last[j][d]=value;
+		rapl_raw[j][d]+=delta;
+	}
+
+	return 0;
+}
+
+
+/*******************************/
+/* Generic interface           */
+/*******************************/
+
+int rapl_open(int backend, int cpu_model) {
+
+	int result=-1;
+
+	rapl_close();
+
+	memset(rapl_raw,0,sizeof(rapl_raw));
+	memset(rapl_units,0,sizeof(rapl_units));
+	memset(rapl_units_raw,0,sizeof(rapl_units_raw));
+
+	if (backend==RAPL_BACKEND_CHEAPEST) {
+		backend=rapl_bench_backends(cpu_model,RAPL_BENCH_SAMPLES,0);
+		if (backend<0) return -1;
+		return rapl_open(backend,cpu_model);
+	}
+
+	if ((backend==RAPL_BACKEND_AUTO) || (backend==RAPL_BACKEND_SYSFS)) {
+		result=rapl_sysfs_open();
+		if (result==0) {
+			rapl_backend=RAPL_BACKEND_SYSFS;
+			goto opened;
+		}
+		rapl_available=0;
+		if (backend==RAPL_BACKEND_SYSFS) return -1;
+	}
+
+	if (backend==RAPL_BACKEND_PERF) {
+		result=rapl_perf_open();
+		if (result==0) {
+			rapl_backend=RAPL_BACKEND_PERF;
+			goto opened;
+		}
+		rapl_available=0;
+		return -1;
+	}
+
+	result=rapl_msr_open(cpu_model);
+	if (result==0) {
+		rapl_backend=RAPL_BACKEND_MSR;
+		goto opened;
+	}
+	rapl_available=0;
+
+	return -1;
+
+opened:
+	rapl_read();
+
+	return rapl_backend;
+}
+
+void rapl_close(void) {
+
+	switch(rapl_backend) {
+		case RAPL_BACKEND_MSR:	 rapl_msr_close(); break;
+		case RAPL_BACKEND_PERF:	 rapl_perf_close(); break;
+		case RAPL_BACKEND_SYSFS: rapl_sysfs_close(); break;
+	}
+
+	rapl_backend=0;
+	rapl_available=0;
+}
+
+int rapl_read_package(int package) {
+
+	switch(rapl_backend) {
+		case RAPL_BACKEND_MSR:	 return rapl_msr_read_package(package);
+		case RAPL_BACKEND_PERF:	 return rapl_perf_read_package(package);
+		case RAPL_BACKEND_SYSFS: return rapl_sysfs_read_package(package);
+	}
+
+	return -1;
+}
+
+int rapl_read(void) {
+
+	int j;
+
+	for(j=0;j<rapl_total_packages;j++) {
+		if (rapl_read_package(j)<0) return -1;
+	}
+
+	return 0;
+}
+
+/* Watch the package domain if we have it, otherwise whatever is there */
+static int edge_domain(void) {
+
+	int d;
+
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (rapl_available&(1<<d)) return d;
+	}
+
+	return RAPL_DOMAIN_PKG;
+}
+
+int rapl_wait_edge(int package, uint64_t *tsc_lo, uint64_t *tsc_hi) {
+
+	uint64_t start_value,last_tsc,tsc;
+	long long timeout;
+	int d;
+
+	d=edge_domain();
+
+	last_tsc=rapl_rdtsc();
+	if (rapl_read_package(package)<0) return -1;
+	start_value=rapl_raw[package][d];
+
+	timeout=rapl_monotonic_ns()+RAPL_EDGE_TIMEOUT_NS;
+
+	while(1) {
+		tsc=rapl_rdtsc();
+		if (rapl_read_package(package)<0) return -1;
+		if (rapl_raw[package][d]!=start_value) break;
+		last_tsc=tsc;
+		if (rapl_monotonic_ns()>timeout) return -1;
+	}
+
+	/* The previous read didn't see the update and this one did,	*/
+	/* so the edge is after the previous read started and before	*/
+	/* this one finished.						*/
+	*tsc_lo=last_tsc;
+	*tsc_hi=rapl_rdtsc();
+
+	return 0;
+}
+
+
+/*******************************/
+/* AMD per-core energy         */
+/*******************************/
+
+/* On Family 17h and later the core energy MSR is per physical core.	*/
+/* Reading another CPU's MSR costs an IPI, so with 100+ cores doing	*/
+/* it from one thread is slow and smears the samples out in time.	*/
+/* Instead the cores are split into batches of RAPL_CORE_BATCH	*/
+/* within a package, each swept by a thread pinned to the first CPU	*/
+/* of its batch, and all the batches run in parallel.		*/
+int rapl_core_count=0;
+int rapl_core_cpu[RAPL_MAX_CPUS];
+int rapl_core_package[RAPL_MAX_CPUS];
+uint64_t rapl_core_raw[RAPL_MAX_CPUS];
+double rapl_core_units[RAPL_MAX_CPUS];
+
+struct core_batch {
+	pthread_t thread;
+	int first;
+	int count;
+};
+
+static int core_fd[RAPL_MAX_CPUS];
+static uint32_t core_last[RAPL_MAX_CPUS];
+static struct core_batch core_batches[RAPL_MAX_CPUS];
+static int core_num_batches=0;
+static pthread_barrier_t core_start_barrier,core_done_barrier;
+static int core_threads_exit=0;
+
+/* The barriers need every batch, so the threads hold off on them	*/
+/* until all have been created; if one can't be, the rest are told	*/
+/* to exit instead.							*/
+static pthread_mutex_t core_go_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t core_go_cond=PTHREAD_COND_INITIALIZER;
+static int core_threads_go=0;
+
+static int read_sysfs_int(char *filename, int *value) {
+
+	FILE *fff;
+	int result;
+
+	fff=fopen(filename,"r");
+	if (fff==NULL) return -1;
+	result=fscanf(fff,"%d",value);
+	fclose(fff);
+
+	return (result==1)?0:-1;
+}
+
+static void core_batch_read(struct core_batch *batch) {
+
+	uint64_t value;
+	int i;
+
+	for(i=batch->first;i<batch->first+batch->count;i++) {
+		if (pread(core_fd[i],&value,sizeof(value),
+				MSR_AMD_PP0_ENERGY_STATUS)!=sizeof(value)) {
+			continue;
+		}
+		rapl_core_raw[i]+=(uint32_t)((uint32_t)value-core_last[i]);
+		core_last[i]=(uint32_t)value;
+	}
+}
+
+static void *core_batch_sampler(void *arg) {
+
+	struct core_batch *batch=arg;
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(rapl_core_cpu[batch->first],&mask);
+	pthread_setaffinity_np(pthread_self(),sizeof(mask),&mask);
+
+	pthread_mutex_lock(&core_go_lock);
+	while(!core_threads_go) pthread_cond_wait(&core_go_cond,&core_go_lock);
+	pthread_mutex_unlock(&core_go_lock);
+	if (core_threads_exit) return NULL;
+
+	while(1) {
+		pthread_barrier_wait(&core_start_barrier);
+		if (core_threads_exit) break;
+		core_batch_read(batch);
+		pthread_barrier_wait(&core_done_barrier);
+	}
+
+	return NULL;
+}
+
+void rapl_cores_close(void) {
+
+	int i;
+
+	if (core_num_batches) {
+		core_threads_exit=1;
+		pthread_barrier_wait(&core_start_barrier);
+		for(i=0;i<core_num_batches;i++) {
+			pthread_join(core_batches[i].thread,NULL);
+		}
+		pthread_barrier_destroy(&core_start_barrier);
+		pthread_barrier_destroy(&core_done_barrier);
+		core_num_batches=0;
+	}
+
+	/* core_fd[] are shared, rapl_msr_fds_close() closes them */
+	rapl_core_count=0;
+}
+
+int rapl_cores_open(void) {
+
+	char filename[BUFSIZ];
+	struct core_batch *batch=NULL;
+	sigset_t block,old;
+	uint64_t result,value;
+	int cpu,online,sibling,package;
+	int i,fd,error;
+
+	rapl_cores_close();
+
+	if (rapl_msr_units_reg!=MSR_AMD_RAPL_POWER_UNIT) {
+		fprintf(stderr,"Per-core energy is only on AMD Family 17h+\n");
+		return -1;
+	}
+
+	for(cpu=0;cpu<rapl_total_cores;cpu++) {
+
+		/* cpu0 usually has no online file, it can't go offline */
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/online",cpu);
+		if ((read_sysfs_int(filename,&online)==0) && (!online)) continue;
+
+		/* SMT siblings share the counter, read it on the first */
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/topology/"
+			"thread_siblings_list",cpu);
+		if ((read_sysfs_int(filename,&sibling)==0) && (sibling!=cpu)) {
+			continue;
+		}
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/topology/"
+			"physical_package_id",cpu);
+		if (read_sysfs_int(filename,&package)<0) package=0;
+
+		fd=rapl_msr_fd(cpu);
+		if (fd<0) {
+			/* no threads yet */
+			core_num_batches=0;
+			rapl_cores_close();
+			return -1;
+		}
+
+		i=rapl_core_count;
+		core_fd[i]=fd;
+		rapl_core_cpu[i]=cpu;
+		rapl_core_package[i]=package;
+
+		if ((rapl_read_msr(fd,MSR_AMD_RAPL_POWER_UNIT,&result)<0) ||
+			(rapl_read_msr(fd,MSR_AMD_PP0_ENERGY_STATUS,&value)<0)) {
+			core_num_batches=0;
+			rapl_cores_close();
+			return -1;
+		}
+		rapl_core_units[i]=pow(0.5,(double)((result>>8)&0x1f));
+
+		core_last[i]=(uint32_t)value;
+		rapl_core_raw[i]=core_last[i];
+
+		/* Start a new batch when full or on a new package */
+		if ((batch==NULL) || (batch->count==RAPL_CORE_BATCH) ||
+			(rapl_core_package[batch->first]!=package)) {
+			batch=&core_batches[core_num_batches++];
+			batch->first=i;
+			batch->count=0;
+		}
+		batch->count++;
+
+		rapl_core_count++;
+	}
+
+	if (rapl_core_count==0) return -1;
+
+	pthread_barrier_init(&core_start_barrier,NULL,core_num_batches+1);
+	pthread_barrier_init(&core_done_barrier,NULL,core_num_batches+1);
+	core_threads_exit=0;
+	core_threads_go=0;
+
+	/* Leave signals to the caller's thread */
+	sigfillset(&block);
+	pthread_sigmask(SIG_BLOCK,&block,&old);
+
+	for(i=0;i<core_num_batches;i++) {
+		error=pthread_create(&core_batches[i].thread,NULL,
+				core_batch_sampler,&core_batches[i]);
+		if (error) {
+			fprintf(stderr,"Error creating core sampler thread %d: "
+				"%s\n",i,strerror(error));
+			core_threads_exit=1;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&core_go_lock);
+	core_threads_go=1;
+	pthread_cond_broadcast(&core_go_cond);
+	pthread_mutex_unlock(&core_go_lock);
+
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
+
+	if (core_threads_exit) {
+		while(i>0) pthread_join(core_batches[--i].thread,NULL);
+		pthread_barrier_destroy(&core_start_barrier);
+		pthread_barrier_destroy(&core_done_barrier);
+		core_num_batches=0;
+		rapl_core_count=0;
+		return -1;
+	}
+
+	return 0;
+}
+
+int rapl_cores_read(void) {
+
+	if (core_num_batches==0) return -1;
+
+	rapl_syscalls+=rapl_core_count;
+	pthread_barrier_wait(&core_start_barrier);
+	pthread_barrier_wait(&core_done_barrier);
+
+	return 0;
+}
+
+
+/*******************************/
+/* Hardware counters           */
+/*******************************/
+
+/* One perf event group per CPU: instructions leads, then cycles and	*/
+/* LLC misses.  PERF_FORMAT_GROUP means one read() per CPU returns	*/
+/* all three, and being a group they're scheduled together so the	*/
+/* ratios stay meaningful even when the PMU is multiplexed.		*/
+uint64_t rapl_hw_raw[RAPL_MAX_PACKAGES][RAPL_HW_NUM];
+int rapl_hw_available=0;
+
+static const unsigned long long hw_config[RAPL_HW_NUM]={
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static int hw_num_cpus=0;
+static int hw_package[RAPL_MAX_CPUS];
+static int hw_fd[RAPL_MAX_CPUS][RAPL_HW_NUM];
+static int hw_group_size=0;
+static int hw_group_event[RAPL_HW_NUM];
+static uint64_t hw_last[RAPL_MAX_CPUS][3+RAPL_HW_NUM];
+
+void rapl_hw_close(void) {
+
+	int i,e;
+
+	for(i=0;i<hw_num_cpus;i++) {
+		for(e=0;e<RAPL_HW_NUM;e++) {
+			if (hw_fd[i][e]>=0) close(hw_fd[i][e]);
+		}
+	}
+	hw_num_cpus=0;
+	hw_group_size=0;
+	rapl_hw_available=0;
+}
+
+static int hw_open_event(int cpu, int event, int group_fd) {
+
+	struct perf_event_attr attr;
+
+	memset(&attr,0,sizeof(attr));
+	attr.type=PERF_TYPE_HARDWARE;
+	attr.config=hw_config[event];
+	attr.read_format=PERF_FORMAT_GROUP|
+			PERF_FORMAT_TOTAL_TIME_ENABLED|
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return rapl_perf_event_open(&attr,-1,cpu,group_fd,0);
+}
+
+int rapl_hw_open(void) {
+
+	char filename[BUFSIZ];
+	FILE *fff;
+	int cpu,package,i,e,fd;
+
+	rapl_hw_close();
+	memset(rapl_hw_raw,0,sizeof(rapl_hw_raw));
+
+	/* Work out which events this machine has from the first CPU */
+	for(e=0;e<RAPL_HW_NUM;e++) {
+		fd=hw_open_event(0,e,-1);
+		if (fd<0) {
+			if (e==RAPL_HW_INSTRUCTIONS) {
+				fprintf(stderr,"Cannot open instructions "
+					"counter: %s\n",strerror(errno));
+				return -1;
+			}
+			continue;
+		}
+		close(fd);
+		hw_group_event[hw_group_size++]=e;
+		rapl_hw_available|=(1<<e);
+	}
+
+	for(cpu=0;cpu<rapl_total_cores;cpu++) {
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/topology/"
+			"physical_package_id",cpu);
+		fff=fopen(filename,"r");
+		if (fff==NULL) continue;
+		if (fscanf(fff,"%d",&package)!=1) package=0;
+		fclose(fff);
+		if ((package<0) || (package>=RAPL_MAX_PACKAGES)) continue;
+
+		i=hw_num_cpus;
+		for(e=0;e<RAPL_HW_NUM;e++) hw_fd[i][e]=-1;
+
+		for(e=0;e<hw_group_size;e++) {
+			fd=hw_open_event(cpu,hw_group_event[e],
+					(e==0)?-1:hw_fd[i][0]);
+			if (fd<0) break;
+			hw_fd[i][e]=fd;
+		}
+
+		/* Offline CPUs just get skipped */
+		if (e<hw_group_size) {
+			for(e=0;e<RAPL_HW_NUM;e++) {
+				if (hw_fd[i][e]>=0) close(hw_fd[i][e]);
+			}
+			continue;
+		}
+
+		hw_package[i]=package;
+		memset(hw_last[i],0,sizeof(hw_last[i]));
+		hw_num_cpus++;
+	}
+
+	if (hw_num_cpus==0) {
+		rapl_hw_available=0;
+		return -1;
+	}
+
+	return 0;
+}
+
+int rapl_hw_read(void) {
+
+	/* nr, time_enabled, time_running, then the values */
+	uint64_t buffer[3+RAPL_HW_NUM];
+	uint64_t enabled,running;
+	double scale;
+	ssize_t size;
+	int i,e;
+
+	if (hw_num_cpus==0) return -1;
+
+	for(i=0;i<hw_num_cpus;i++) {
+		rapl_syscalls++;
+		size=read(hw_fd[i][0],buffer,sizeof(buffer));
+		if (size<(ssize_t)((3+hw_group_size)*sizeof(uint64_t))) {
+			continue;
+		}
+
+		/* If the group was multiplexed, scale this interval's	*/
+		/* counts up to the whole time.				*/
+		enabled=buffer[1]-hw_last[i][1];
+		running=buffer[2]-hw_last[i][2];
+		scale=1.0;
+		if ((running) && (running<enabled)) {
+			scale=(double)enabled/(double)running;
+		}
+
+		for(e=0;e<hw_group_size;e++) {
+			rapl_hw_raw[hw_package[i]][hw_group_event[e]]+=
+				(uint64_t)((double)(buffer[3+e]-
+					hw_last[i][3+e])*scale);
+		}
+
+		memcpy(hw_last[i],buffer,sizeof(buffer));
+	}
+
+	return 0;
+}
+
+
+/*******************************/
+/* Memory controller traffic   */
+/*******************************/
+
+/* The uncore IMC PMUs count CAS commands per memory controller,	*/
+/* uncore_imc_N on servers.  Client parts have a single uncore_imc	*/
+/* that counts data_reads/data_writes instead, so fall back to those.	*/
+/* Uncore events belong to the whole package: whichever CPU of it	*/
+/* they're opened on, the kernel moves them to the one in the PMU's	*/
+/* cpumask.  So one read+write group per controller per package,	*/
+/* read with one read() each, scaled up if multiplexed like the	*/
+/* hardware counters.							*/
+uint64_t rapl_imc_raw[RAPL_MAX_PACKAGES][RAPL_IMC_NUM];
+double rapl_imc_units[RAPL_IMC_NUM];
+int rapl_imc_count=0;
+
+#define IMC_EVENT_SETS	2
+
+static const char *imc_event_names[IMC_EVENT_SETS][RAPL_IMC_NUM]={
+	{ "cas_count_read", "cas_count_write" },
+	{ "data_reads", "data_writes" },
+};
+
+/* Which of imc_event_names every opened PMU uses */
+static int imc_set;
+
+static int imc_fd[RAPL_MAX_PACKAGES][RAPL_MAX_IMCS][RAPL_IMC_NUM];
+static uint64_t imc_last[RAPL_MAX_PACKAGES][RAPL_MAX_IMCS][3+RAPL_IMC_NUM];
+
+/* Turn a PMU's events/<event>, e.g. "event=0x04,umask=0x03", into	*/
+/* attr.config using the bit offsets in its format/<term> files,	*/
+/* e.g. "config:8-15".  Only terms in config are supported.	*/
+static int pmu_event_config(const char *pmu, const char *event,
+		uint64_t *config) {
+
+	char filename[BUFSIZ],terms[BUFSIZ];
+	char *term,*value,*saveptr;
+	unsigned long long v;
+	FILE *fff;
+	int lo,result;
+
+	rapl_path(filename,sizeof(filename),
+		"/sys/bus/event_source/devices/%s/events/%s",pmu,event);
+	fff=fopen(filename,"r");
+	if (fff==NULL) return -1;
+	result=(fgets(terms,sizeof(terms),fff)!=NULL);
+	fclose(fff);
+	if (!result) return -1;
+
+	*config=0;
+	for(term=strtok_r(terms,",\n",&saveptr);term!=NULL;
+			term=strtok_r(NULL,",\n",&saveptr)) {
+		v=1;
+		value=strchr(term,'=');
+		if (value!=NULL) {
+			*value++=0;
+			v=strtoull(value,NULL,0);
+		}
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/bus/event_source/devices/%s/format/%s",pmu,term);
+		fff=fopen(filename,"r");
+		if (fff==NULL) return -1;
+		result=fscanf(fff,"config:%d",&lo);
+		fclose(fff);
+		if ((result!=1) || (lo<0) || (lo>63)) return -1;
+
+		*config|=(uint64_t)v<<lo;
+	}
+
+	return 0;
+}
+
+/* Bytes per count from the event's .scale and .unit, which the	*/
+/* kernel gives in MiB; without them a count is one 64-byte line.	*/
+static double pmu_event_bytes(const char *pmu, const char *event) {
+
+	char filename[BUFSIZ],unit[BUFSIZ];
+	double scale=0.0;
+	FILE *fff;
+
+	rapl_path(filename,sizeof(filename),
+		"/sys/bus/event_source/devices/%s/events/%s.scale",pmu,event);
+	fff=fopen(filename,"r");
+	if (fff==NULL) return 64.0;
+	if (fscanf(fff,"%lf",&scale)!=1) scale=0.0;
+	fclose(fff);
+
+	rapl_path(filename,sizeof(filename),
+		"/sys/bus/event_source/devices/%s/events/%s.unit",pmu,event);
+	fff=fopen(filename,"r");
+	if (fff==NULL) return 64.0;
+	if (fscanf(fff,"%s",unit)!=1) unit[0]=0;
+	fclose(fff);
+
+	if ((scale<=0.0) || (strcmp(unit,"MiB"))) return 64.0;
+
+	return scale*1048576.0;
+}
+
+void rapl_imc_close(void) {
+
+	int i,e,j;
+
+	for(j=0;j<RAPL_MAX_PACKAGES;j++) {
+		for(i=0;i<rapl_imc_count;i++) {
+			for(e=0;e<RAPL_IMC_NUM;e++) {
+				if (imc_fd[j][i][e]>=0) close(imc_fd[j][i][e]);
+				imc_fd[j][i][e]=-1;
+			}
+		}
+	}
+	rapl_imc_count=0;
+}
+
+int rapl_imc_open(void) {
+
+	char pmu[RAPL_MAX_IMCS][64];
+	char filename[BUFSIZ];
+	struct perf_event_attr attr;
+	uint64_t config[RAPL_MAX_IMCS][RAPL_IMC_NUM];
+	FILE *fff;
+	int type[RAPL_MAX_IMCS];
+	int num_pmus=0;
+	int i,e,j,n,s,fd;
+
+	rapl_imc_close();
+	memset(rapl_imc_raw,0,sizeof(rapl_imc_raw));
+	memset(imc_last,0,sizeof(imc_last));
+
+	/* uncore_imc, then uncore_imc_0, uncore_imc_1, ... */
+	for(n=-1;(n<RAPL_MAX_IMCS*2) && (num_pmus<RAPL_MAX_IMCS);n++) {
+		if (n<0) snprintf(pmu[num_pmus],sizeof(pmu[0]),"uncore_imc");
+		else snprintf(pmu[num_pmus],sizeof(pmu[0]),"uncore_imc_%d",n);
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/bus/event_source/devices/%s/type",pmu[num_pmus]);
+		fff=fopen(filename,"r");
+		if (fff==NULL) continue;
+		if (fscanf(fff,"%d",&type[num_pmus])!=1) type[num_pmus]=-1;
+		fclose(fff);
+		if (type[num_pmus]<0) continue;
+
+		/* The first PMU picks the set; the counts are summed	*/
+		/* with one set of units so the rest have to match.	*/
+		for(s=(num_pmus>0)?imc_set:0;s<IMC_EVENT_SETS;s++) {
+			for(e=0;e<RAPL_IMC_NUM;e++) {
+				if (pmu_event_config(pmu[num_pmus],
+						imc_event_names[s][e],
+						&config[num_pmus][e])<0) break;
+			}
+			if (e==RAPL_IMC_NUM) break;
+			if (num_pmus>0) break;
+		}
+		if (e<RAPL_IMC_NUM) continue;
+
+		if (num_pmus==0) {
+			imc_set=s;
+			for(e=0;e<RAPL_IMC_NUM;e++) {
+				rapl_imc_units[e]=pmu_event_bytes(pmu[0],
+					imc_event_names[s][e]);
+			}
+		}
+		num_pmus++;
+	}
+
+	if (num_pmus==0) {
+		fprintf(stderr,"No uncore IMC PMU with CAS or data counts "
+			"found\n");
+		return -1;
+	}
+
+	for(j=0;j<RAPL_MAX_PACKAGES;j++) {
+		for(i=0;i<num_pmus;i++) {
+			for(e=0;e<RAPL_IMC_NUM;e++) imc_fd[j][i][e]=-1;
+		}
+	}
+	rapl_imc_count=num_pmus;
+
+	for(j=0;j<rapl_total_packages;j++) {
+		for(i=0;i<num_pmus;i++) {
+			for(e=0;e<RAPL_IMC_NUM;e++) {
+				memset(&attr,0,sizeof(attr));
+				attr.type=type[i];
+				attr.config=config[i][e];
+				attr.read_format=PERF_FORMAT_GROUP|
+					PERF_FORMAT_TOTAL_TIME_ENABLED|
+					PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+				fd=rapl_perf_event_open(&attr,-1,
+					rapl_package_map[j],
+					(e==0)?-1:imc_fd[j][i][0],0);
+				if (fd<0) {
+					fprintf(stderr,"Cannot open %s/%s on "
+						"CPU %d: %s\n",pmu[i],
+						imc_event_names[imc_set][e],
+						rapl_package_map[j],
+						strerror(errno));
+					rapl_imc_close();
+					return -1;
+				}
+				imc_fd[j][i][e]=fd;
+			}
+		}
+	}
+
+	rapl_imc_read();
+
+	return 0;
+}
+
+int rapl_imc_read(void) {
+
+	/* nr, time_enabled, time_running, then read and write */
+	uint64_t buffer[3+RAPL_IMC_NUM];
+	uint64_t enabled,running;
+	double scale;
+	ssize_t size;
+	int i,e,j;
+
+	if (rapl_imc_count==0) return -1;
+
+	for(j=0;j<rapl_total_packages;j++) {
+		for(i=0;i<rapl_imc_count;i++) {
+			rapl_syscalls++;
+			size=read(imc_fd[j][i][0],buffer,sizeof(buffer));
+			if (size<(ssize_t)sizeof(buffer)) continue;
+
+			enabled=buffer[1]-imc_last[j][i][1];
+			running=buffer[2]-imc_last[j][i][2];
+			scale=1.0;
+			if ((running) && (running<enabled)) {
+				scale=(double)enabled/(double)running;
+			}
+
+			for(e=0;e<RAPL_IMC_NUM;e++) {
+				rapl_imc_raw[j][e]+=(uint64_t)((double)
+					(buffer[3+e]-imc_last[j][i][3+e])*
+					scale);
+			}
+
+			memcpy(imc_last[j][i],buffer,sizeof(buffer));
+		}
+	}
+
+	return 0;
+}
+
+
+/*******************************/
+/* Throttled time              */
+/*******************************/
+
+/* The *_PERF_STATUS MSRs count time spent throttled by RAPL in	*/
+/* time units.  Which of them exist varies a lot by model, so just	*/
+/* try reading each one.					*/
+uint64_t rapl_throttle_raw[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+double rapl_throttle_units[RAPL_MAX_PACKAGES];
+int rapl_throttle_available=0;
+
+static int throttle_fd[RAPL_MAX_PACKAGES];
+static int throttle_open=0;
+static uint32_t throttle_last[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+static unsigned int throttle_reg(int domain) {
+
+	switch(domain) {
+		case RAPL_DOMAIN_PKG:	return MSR_PKG_PERF_STATUS;
+		case RAPL_DOMAIN_PP0:	return MSR_PP0_PERF_STATUS;
+		case RAPL_DOMAIN_DRAM:	return MSR_DRAM_PERF_STATUS;
+	}
+
+	return 0;
+}
+
+void rapl_throttle_close(void) {
+
+	int j;
+
+	if (!throttle_open) return;
+
+	/* the fds are shared, just forget them */
+	for(j=0;j<rapl_total_packages;j++) throttle_fd[j]=-1;
+	throttle_open=0;
+	rapl_throttle_available=0;
+}
+
+int rapl_throttle_open(void) {
+
+	uint64_t value,result;
+	int d,j,fd;
+
+	rapl_throttle_close();
+
+	if (rapl_msr_units_reg==MSR_AMD_RAPL_POWER_UNIT) return -1;
+
+	for(j=0;j<rapl_total_packages;j++) {
+		fd=rapl_msr_fd(rapl_package_map[j]);
+		if (fd<0) return -1;
+		throttle_fd[j]=fd;
+
+		if (rapl_read_msr(fd,MSR_INTEL_RAPL_POWER_UNIT,&result)<0) {
+			return -1;
+		}
+		rapl_throttle_units[j]=pow(0.5,(double)((result>>16)&0xf));
+	}
+	throttle_open=1;
+
+	/* Only count a domain if every package has it */
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (!throttle_reg(d)) continue;
+		for(j=0;j<rapl_total_packages;j++) {
+			if (rapl_probe_msr(throttle_fd[j],throttle_reg(d),
+					&value)<0) break;
+			throttle_last[j][d]=(uint32_t)value;
+			rapl_throttle_raw[j][d]=(uint32_t)value;
+		}
+		if (j==rapl_total_packages) rapl_throttle_available|=(1<<d);
+	}
+
+	if (!rapl_throttle_available) {
+		rapl_throttle_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+int rapl_throttle_read_package(int j) {
+
+	uint64_t value;
+	int d;
+
+	if (!throttle_open) return -1;
+
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (!(rapl_throttle_available&(1<<d))) continue;
+		if (rapl_probe_msr(throttle_fd[j],throttle_reg(d),&value)<0) {
+			return -1;
+		}
+		/* only the low 32 bits count, extend like the energy */
+		rapl_throttle_raw[j][d]+=(uint32_t)((uint32_t)value-
+						throttle_last[j][d]);
+		throttle_last[j][d]=(uint32_t)value;
+	}
+
+	return 0;
+}
+
+
+/*******************************/
+/* Frequency and temperature   */
+/*******************************/
+
+/* APERF counts at the actual clock and MPERF at a fixed reference	*/
+/* clock, both only while the CPU is in C0, so against the TSC they	*/
+/* give the effective frequency and how busy each CPU was.  They	*/
+/* are per logical CPU; the core thermal status is per core but	*/
+/* every sibling can read it.  All of it goes through the same	*/
+/* rapl_msr_fd() fds as the energy MSRs.			*/
+int rapl_cpu_count=0;
+int rapl_cpu_id[RAPL_MAX_CPUS];
+int rapl_cpu_package[RAPL_MAX_CPUS];
+uint64_t rapl_cpu_aperf[RAPL_MAX_CPUS];
+uint64_t rapl_cpu_mperf[RAPL_MAX_CPUS];
+int rapl_cpu_temp[RAPL_MAX_CPUS];
+int rapl_package_temp[RAPL_MAX_PACKAGES];
+uint64_t rapl_cpu_tsc=0;
+int rapl_freq_available=0;
+
+static int freq_fd[RAPL_MAX_CPUS];
+static int freq_tjmax[RAPL_MAX_PACKAGES];
+
+/* Thermal status has the distance below TjMax in bits 22:16,	*/
+/* valid only while bit 31 is set.  Keeps the old value if not.	*/
+static void therm_decode(uint64_t value, int tjmax, int *temp) {
+
+	if (!(value&(1ULL<<31))) return;
+
+	*temp=tjmax-(int)((value>>16)&0x7f);
+}
+
+void rapl_freq_close(void) {
+
+	/* freq_fd[] are shared, rapl_msr_fds_close() closes them */
+	rapl_cpu_count=0;
+	rapl_freq_available=0;
+}
+
+int rapl_freq_open(void) {
+
+	char filename[BUFSIZ];
+	uint64_t value;
+	int cpu,online,package;
+	int i,j,fd,tjmax;
+
+	rapl_freq_close();
+
+	for(cpu=0;cpu<rapl_total_cores;cpu++) {
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/online",cpu);
+		if ((read_sysfs_int(filename,&online)==0) && (!online)) continue;
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/topology/"
+			"physical_package_id",cpu);
+		if (read_sysfs_int(filename,&package)<0) package=0;
+		if ((package<0) || (package>=RAPL_MAX_PACKAGES)) continue;
+
+		fd=rapl_msr_fd(cpu);
+		if (fd<0) {
+			rapl_freq_close();
+			return -1;
+		}
+
+		i=rapl_cpu_count++;
+		freq_fd[i]=fd;
+		rapl_cpu_id[i]=cpu;
+		rapl_cpu_package[i]=package;
+		rapl_cpu_temp[i]=0;
+	}
+
+	if (rapl_cpu_count==0) return -1;
+
+	/* Probe on the first CPU, it's all or nothing in practice */
+	fd=freq_fd[0];
+	if ((rapl_probe_msr(fd,MSR_IA32_APERF,&value)==0) &&
+		(rapl_probe_msr(fd,MSR_IA32_MPERF,&value)==0)) {
+		rapl_freq_available|=RAPL_FREQ_APERF;
+	}
+	if (rapl_probe_msr(fd,MSR_IA32_THERM_STATUS,&value)==0) {
+		rapl_freq_available|=RAPL_FREQ_CORE_TEMP;
+	}
+	if (rapl_probe_msr(fd,MSR_IA32_PACKAGE_THERM_STATUS,&value)==0) {
+		rapl_freq_available|=RAPL_FREQ_PKG_TEMP;
+	}
+
+	if (!rapl_freq_available) {
+		rapl_freq_close();
+		return -1;
+	}
+
+	/* TjMax is in bits 23:16 of the temperature target.  Not	*/
+	/* every part has it; 100C is what the older ones used.	*/
+	for(j=0;j<rapl_total_packages;j++) {
+		tjmax=0;
+		fd=rapl_msr_fd(rapl_package_map[j]);
+		if ((fd>=0) &&
+			(rapl_probe_msr(fd,MSR_IA32_TEMPERATURE_TARGET,
+				&value)==0)) {
+			tjmax=(value>>16)&0xff;
+		}
+		freq_tjmax[j]=tjmax?tjmax:100;
+		rapl_package_temp[j]=0;
+	}
+
+	rapl_freq_read();
+
+	return 0;
+}
+
+/* Reading another CPU's MSR sends it an IPI, which wakes it if it	*/
+/* was idle, so a very short interval slightly inflates busy.	*/
+int rapl_freq_read(void) {
+
+	uint64_t value;
+	int i,j,fd;
+
+	if (!rapl_freq_available) return -1;
+
+	rapl_cpu_tsc=rapl_rdtsc();
+
+	for(i=0;i<rapl_cpu_count;i++) {
+		if (rapl_freq_available&RAPL_FREQ_APERF) {
+			if (rapl_probe_msr(freq_fd[i],MSR_IA32_APERF,&value)==0) {
+				rapl_cpu_aperf[i]=value;
+			}
+			if (rapl_probe_msr(freq_fd[i],MSR_IA32_MPERF,&value)==0) {
+				rapl_cpu_mperf[i]=value;
+			}
+		}
+		if (rapl_freq_available&RAPL_FREQ_CORE_TEMP) {
+			if (rapl_probe_msr(freq_fd[i],MSR_IA32_THERM_STATUS,
+					&value)==0) {
+				therm_decode(value,
+					freq_tjmax[rapl_cpu_package[i]],
+					&rapl_cpu_temp[i]);
+			}
+		}
+	}
+
+	if (rapl_freq_available&RAPL_FREQ_PKG_TEMP) {
+		for(j=0;j<rapl_total_packages;j++) {
+			fd=rapl_msr_fd(rapl_package_map[j]);
+			if (fd<0) continue;
+			if (rapl_probe_msr(fd,MSR_IA32_PACKAGE_THERM_STATUS,
+					&value)==0) {
+				therm_decode(value,freq_tjmax[j],
+					&rapl_package_temp[j]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/*******************************/
+/* C-state residency           */
+/*******************************/
+
+/* Idle power is mostly decided by how deep the packages get, and	*/
+/* how long they stay there.  Intel has a residency counter per	*/
+/* state, but which states, and sometimes at which address, varies	*/
+/* by model, so go by the same model numbers as the RAPL domains	*/
+/* (the same lists turbostat uses) and probe what that leaves.	*/
+/* AMD has no residency MSRs.					*/
+uint64_t rapl_pkg_cstate_raw[RAPL_MAX_PACKAGES][RAPL_NUM_PKG_CSTATES];
+uint64_t rapl_core_cstate_raw[RAPL_MAX_CPUS][RAPL_NUM_CORE_CSTATES];
+int rapl_cstate_cpu_count=0;
+int rapl_cstate_cpu_id[RAPL_MAX_CPUS];
+int rapl_cstate_cpu_package[RAPL_MAX_CPUS];
+uint64_t rapl_cstate_tsc=0;
+int rapl_pkg_cstate_available=0,rapl_core_cstate_available=0;
+
+static const char *pkg_cstate_names[RAPL_NUM_PKG_CSTATES]={
+	"PC2","PC3","PC6","PC7","PC8","PC9","PC10",
+};
+
+static const char *core_cstate_names[RAPL_NUM_CORE_CSTATES]={
+	"CC3","CC6","CC7",
+};
+
+static unsigned int pkg_cstate_reg[RAPL_NUM_PKG_CSTATES];
+
+static const unsigned int core_cstate_reg[RAPL_NUM_CORE_CSTATES]={
+	MSR_CORE_C3_RESIDENCY,
+	MSR_CORE_C6_RESIDENCY,
+	MSR_CORE_C7_RESIDENCY,
+};
+
+static int cstate_fd[RAPL_MAX_CPUS];
+
+const char *rapl_pkg_cstate_name(int state) {
+
+	if ((state<0) || (state>=RAPL_NUM_PKG_CSTATES)) return "???";
+
+	return pkg_cstate_names[state];
+}
+
+const char *rapl_core_cstate_name(int state) {
+
+	if ((state<0) || (state>=RAPL_NUM_CORE_CSTATES)) return "???";
+
+	return core_cstate_names[state];
+}
+
+#define PC(x)	(1<<RAPL_PKG_C##x)
+#define CC(x)	(1<<RAPL_CORE_C##x)
+
+/* Which states a model has, 0 if we don't know it */
+static void cstate_model(int cpu_model, int *pkg, int *core) {
+
+	*pkg=0;
+	*core=0;
+
+	switch(cpu_model) {
+		case CPU_SANDYBRIDGE:
+		case CPU_SANDYBRIDGE_EP:
+		case CPU_IVYBRIDGE:
+		case CPU_IVYBRIDGE_EP:
+		case CPU_HASWELL:
+		case CPU_HASWELL_GT3E:
+		case CPU_BROADWELL_GT3E:
+			*pkg=PC(2)|PC(3)|PC(6)|PC(7);
+			*core=CC(3)|CC(6)|CC(7);
+			break;
+		case CPU_HASWELL_ULT:
+		case CPU_BROADWELL:
+		case CPU_SKYLAKE:
+		case CPU_SKYLAKE_HS:
+		case CPU_KABYLAKE_MOBILE:
+		case CPU_KABYLAKE:
+			*pkg=PC(2)|PC(3)|PC(6)|PC(7)|PC(8)|PC(9)|PC(10);
+			*core=CC(3)|CC(6)|CC(7);
+			break;
+		case CPU_HASWELL_EP:
+		case CPU_BROADWELL_EP:
+			*pkg=PC(2)|PC(3)|PC(6);
+			*core=CC(3)|CC(6);
+			break;
+		case CPU_SKYLAKE_X:
+			*pkg=PC(2)|PC(6);
+			*core=CC(6);
+			break;
+		case CPU_KNIGHTS_LANDING:
+		case CPU_KNIGHTS_MILL:
+			*pkg=PC(2)|PC(3)|PC(6);
+			*core=CC(6);
+			break;
+		case CPU_ATOM_GOLDMONT:
+		case CPU_ATOM_GEMINI_LAKE:
+			*pkg=PC(2)|PC(3)|PC(6)|PC(10);
+			*core=CC(3)|CC(6);
+			break;
+		case CPU_ATOM_DENVERTON:
+			*pkg=PC(6);
+			*core=CC(6);
+			break;
+	}
+}
+
+#undef PC
+#undef CC
+
+void rapl_cstate_close(void) {
+
+	/* cstate_fd[] are shared, rapl_msr_fds_close() closes them */
+	rapl_cstate_cpu_count=0;
+	rapl_pkg_cstate_available=0;
+	rapl_core_cstate_available=0;
+}
+
+int rapl_cstate_open(int cpu_model) {
+
+	char filename[BUFSIZ];
+	uint64_t value;
+	int cpu,online,package;
+	int pkg_states,core_states;
+	int i,j,s,fd;
+
+	rapl_cstate_close();
+
+	cstate_model(cpu_model,&pkg_states,&core_states);
+	if ((!pkg_states) && (!core_states)) return -1;
+
+	pkg_cstate_reg[RAPL_PKG_C2]=MSR_PKG_C2_RESIDENCY;
+	pkg_cstate_reg[RAPL_PKG_C3]=MSR_PKG_C3_RESIDENCY;
+	pkg_cstate_reg[RAPL_PKG_C6]=MSR_PKG_C6_RESIDENCY;
+	pkg_cstate_reg[RAPL_PKG_C7]=MSR_PKG_C7_RESIDENCY;
+	pkg_cstate_reg[RAPL_PKG_C8]=MSR_PKG_C8_RESIDENCY;
+	pkg_cstate_reg[RAPL_PKG_C9]=MSR_PKG_C9_RESIDENCY;
+	pkg_cstate_reg[RAPL_PKG_C10]=MSR_PKG_C10_RESIDENCY;
+
+	for(cpu=0;cpu<rapl_total_cores;cpu++) {
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/online",cpu);
+		if ((read_sysfs_int(filename,&online)==0) && (!online)) continue;
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/topology/"
+			"physical_package_id",cpu);
+		if (read_sysfs_int(filename,&package)<0) package=0;
+		if ((package<0) || (package>=RAPL_MAX_PACKAGES)) continue;
+
+		fd=rapl_msr_fd(cpu);
+		if (fd<0) {
+			rapl_cstate_close();
+			return -1;
+		}
+
+		i=rapl_cstate_cpu_count++;
+		cstate_fd[i]=fd;
+		rapl_cstate_cpu_id[i]=cpu;
+		rapl_cstate_cpu_package[i]=package;
+	}
+
+	if (rapl_cstate_cpu_count==0) return -1;
+
+	/* A state missing on one CPU is missing on all of them */
+	fd=cstate_fd[0];
+	for(s=0;s<RAPL_NUM_PKG_CSTATES;s++) {
+		if (!(pkg_states&(1<<s))) continue;
+		if (rapl_probe_msr(fd,pkg_cstate_reg[s],&value)==0) {
+			rapl_pkg_cstate_available|=(1<<s);
+		}
+	}
+	for(s=0;s<RAPL_NUM_CORE_CSTATES;s++) {
+		if (!(core_states&(1<<s))) continue;
+		if (rapl_probe_msr(fd,core_cstate_reg[s],&value)==0) {
+			rapl_core_cstate_available|=(1<<s);
+		}
+	}
+
+	if ((!rapl_pkg_cstate_available) && (!rapl_core_cstate_available)) {
+		rapl_cstate_close();
+		return -1;
+	}
+
+	for(j=0;j<RAPL_MAX_PACKAGES;j++) {
+		for(s=0;s<RAPL_NUM_PKG_CSTATES;s++) rapl_pkg_cstate_raw[j][s]=0;
+	}
+
+	rapl_cstate_read();
+
+	return 0;
+}
+
+/* The counters are 64 bits wide at the TSC rate, they don't wrap */
+int rapl_cstate_read(void) {
+
+	uint64_t value;
+	int i,j,s,fd;
+
+	if ((!rapl_pkg_cstate_available) && (!rapl_core_cstate_available)) {
+		return -1;
+	}
+
+	rapl_cstate_tsc=rapl_rdtsc();
+
+	for(j=0;j<rapl_total_packages;j++) {
+		if (!rapl_pkg_cstate_available) break;
+		fd=rapl_msr_fd(rapl_package_map[j]);
+		if (fd<0) continue;
+		for(s=0;s<RAPL_NUM_PKG_CSTATES;s++) {
+			if (!(rapl_pkg_cstate_available&(1<<s))) continue;
+			if (rapl_probe_msr(fd,pkg_cstate_reg[s],&value)==0) {
+				rapl_pkg_cstate_raw[j][s]=value;
+			}
+		}
+	}
+
+	for(i=0;i<rapl_cstate_cpu_count;i++) {
+		for(s=0;s<RAPL_NUM_CORE_CSTATES;s++) {
+			if (!(rapl_core_cstate_available&(1<<s))) continue;
+			if (rapl_probe_msr(cstate_fd[i],core_cstate_reg[s],
+					&value)==0) {
+				rapl_core_cstate_raw[i][s]=value;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/*******************************/
+/* Power limits                */
+/*******************************/
+
+/* Limits are always written through the MSRs, on their own O_RDWR	*/
+/* fd per package, whichever backend is used for sampling.  The	*/
+/* first write to a domain saves the original register so that	*/
+/* rapl_limit_restore() can put it back.				*/
+static int limit_fd[RAPL_MAX_PACKAGES];
+static int limit_fd_valid[RAPL_MAX_PACKAGES];
+static double limit_power_units[RAPL_MAX_PACKAGES];
+static double limit_time_units[RAPL_MAX_PACKAGES];
+static uint64_t limit_saved[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+static int limit_saved_valid[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+/* Each limit is a 24-bit field: power, enable, clamp, time window */
+#define LIMIT_POWER_MASK	0x7FFFULL
+#define LIMIT_ENABLE		(1ULL<<15)
+#define LIMIT_CLAMP		(1ULL<<16)
+#define LIMIT_WINDOW_SHIFT	17
+#define LIMIT_WINDOW_MASK	(0x7FULL<<LIMIT_WINDOW_SHIFT)
+
+static unsigned int limit_reg(int domain) {
+
+	switch(domain) {
+		case RAPL_DOMAIN_PKG:	return MSR_PKG_RAPL_POWER_LIMIT;
+		case RAPL_DOMAIN_PP0:	return MSR_PP0_POWER_LIMIT;
+		case RAPL_DOMAIN_PP1:	return MSR_PP1_POWER_LIMIT;
+		case RAPL_DOMAIN_DRAM:	return MSR_DRAM_POWER_LIMIT;
+	}
+
+	return 0;
+}
+
+/* The package register holds PL1 and PL2 so its lock is the top bit */
+static uint64_t limit_lock_bit(int domain) {
+
+	if (domain==RAPL_DOMAIN_PKG) return 1ULL<<63;
+
+	return 1ULL<<31;
+}
+
+static int limit_shift(int domain, int limit) {
+
+	if ((limit==1) && (limit_reg(domain))) return 0;
+	if ((limit==2) && (domain==RAPL_DOMAIN_PKG)) return 32;
+
+	return -1;
+}
+
+static int limit_open(int package) {
+
+	uint64_t result;
+	int fd;
+
+	if (limit_fd_valid[package]) return limit_fd[package];
+
+	if (rapl_msr_units_reg==MSR_AMD_RAPL_POWER_UNIT) {
+		fprintf(stderr,"Power limits are not supported on AMD\n");
+		return -1;
+	}
+
+	fd=rapl_open_msr_rw(rapl_package_map[package]);
+	if (fd<0) return -1;
+
+	if (rapl_read_msr(fd,MSR_INTEL_RAPL_POWER_UNIT,&result)<0) {
+		close(fd);
+		return -1;
+	}
+	limit_power_units[package]=pow(0.5,(double)(result&0xf));
+	limit_time_units[package]=pow(0.5,(double)((result>>16)&0xf));
+
+	limit_fd[package]=fd;
+	limit_fd_valid[package]=1;
+
+	return fd;
+}
+
+/* The window is 2^Y*(1+Z/4) time units, Y in bits 17-21 and Z in	*/
+/* bits 22-23.  Pick whichever encoding comes closest.		*/
+static uint64_t limit_encode_window(double seconds, double time_units) {
+
+	double window,error,best_error=-1.0;
+	uint64_t best=0;
+	int y,z;
+
+	for(y=0;y<32;y++) {
+		for(z=0;z<4;z++) {
+			window=pow(2.0,y)*(1.0+z/4.0)*time_units;
+			error=fabs(window-seconds);
+			if ((best_error<0.0) || (error<best_error)) {
+				best_error=error;
+				best=((uint64_t)z<<5)|y;
+			}
+		}
+	}
+
+	return best<<LIMIT_WINDOW_SHIFT;
+}
+
+static double limit_decode_window(uint64_t field, double time_units) {
+
+	int y,z;
+
+	y=(field>>LIMIT_WINDOW_SHIFT)&0x1f;
+	z=(field>>(LIMIT_WINDOW_SHIFT+5))&0x3;
+
+	return pow(2.0,y)*(1.0+z/4.0)*time_units;
+}
+
+int rapl_limit_get(int package, int domain, int limit,
+		double *watts, double *seconds, int *enabled, int *locked) {
+
+	uint64_t value,field;
+	int fd,shift;
+
+	shift=limit_shift(domain,limit);
+	if (shift<0) return -1;
+
+	fd=limit_open(package);
+	if (fd<0) return -1;
+
+	if (rapl_read_msr(fd,limit_reg(domain),&value)<0) return -1;
+	field=value>>shift;
+
+	*watts=(double)(field&LIMIT_POWER_MASK)*limit_power_units[package];
+	*seconds=limit_decode_window(field,limit_time_units[package]);
+	*enabled=!!(field&LIMIT_ENABLE);
+	*locked=!!(value&limit_lock_bit(domain));
+
+	return 0;
+}
+
+int rapl_limit_set(int package, int domain, int limit,
+		double watts, double seconds) {
+
+	uint64_t value,field,wanted,mask,check;
+	unsigned int reg;
+	int fd,shift;
+
+	shift=limit_shift(domain,limit);
+	if (shift<0) {
+		fprintf(stderr,"%s has no power limit #%d\n",
+			rapl_domain_name(domain),limit);
+		return -1;
+	}
+
+	fd=limit_open(package);
+	if (fd<0) return -1;
+
+	reg=limit_reg(domain);
+	if (rapl_read_msr(fd,reg,&value)<0) return -1;
+
+	if (value&limit_lock_bit(domain)) {
+		fprintf(stderr,"Package %d %s power limits are locked\n",
+			package,rapl_domain_name(domain));
+		return -1;
+	}
+
+	/* range check in double, the cast is undefined outside it */
+	if (!(watts>0.0) ||
+		(watts/limit_power_units[package]+0.5>=LIMIT_POWER_MASK+1.0)) {
+		fprintf(stderr,"Power limit %.3fW out of range\n",watts);
+		return -1;
+	}
+	field=(uint64_t)(watts/limit_power_units[package]+0.5);
+
+	mask=LIMIT_POWER_MASK|LIMIT_ENABLE;
+	wanted=field|LIMIT_ENABLE;
+	if (seconds>0.0) {
+		mask|=LIMIT_WINDOW_MASK;
+		wanted|=limit_encode_window(seconds,limit_time_units[package]);
+	}
+
+	if (!limit_saved_valid[package][domain]) {
+		limit_saved[package][domain]=value;
+		limit_saved_valid[package][domain]=1;
+	}
+
+	value=(value&~(mask<<shift))|(wanted<<shift);
+	if (rapl_write_msr(fd,reg,value)<0) return -1;
+
+	/* Some parts silently ignore or clip what they don't support */
+	if (rapl_read_msr(fd,reg,&check)<0) return -1;
+	if ((check&(mask<<shift))!=(wanted<<shift)) {
+		fprintf(stderr,"Package %d %s power limit #%d did not stick: "
+			"wrote %llx read back %llx\n",
+			package,rapl_domain_name(domain),limit,
+			(unsigned long long)value,(unsigned long long)check);
+		return -1;
+	}
+
+	return 0;
+}
+
+void rapl_limit_restore(void) {
+
+	uint64_t check;
+	int d,j;
+
+	for(j=0;j<RAPL_MAX_PACKAGES;j++) {
+		if (!limit_fd_valid[j]) continue;
+
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!limit_saved_valid[j][d]) continue;
+
+			if ((rapl_write_msr(limit_fd[j],limit_reg(d),
+					limit_saved[j][d])<0) ||
+				(rapl_read_msr(limit_fd[j],limit_reg(d),
+					&check)<0)) {
+				fprintf(stderr,"Could not restore package %d "
+					"%s power limit\n",
+					j,rapl_domain_name(d));
+			}
+			else if (check!=limit_saved[j][d]) {
+				fprintf(stderr,"Could not restore package %d "
+					"%s power limit, left at %llx\n",
+					j,rapl_domain_name(d),
+					(unsigned long long)check);
+			}
+			limit_saved_valid[j][d]=0;
+		}
+
+		close(limit_fd[j]);
+		limit_fd_valid[j]=0;
+	}
+}
+
+
+/*******************************/
+/* Frequency control           */
+/*******************************/
+
+/* Frequency sweeps pin every online CPU to one frequency through	*/
+/* cpufreq.  With the userspace governor that's scaling_setspeed;	*/
+/* intel_pstate in active mode has no userspace governor, so there	*/
+/* scaling_min_freq and scaling_max_freq are both set to it.  The	*/
+/* first rapl_cpufreq_set() saves each CPU's governor and limits so	*/
+/* that rapl_cpufreq_restore() can put them back.			*/
+static int cpufreq_num_cpus=0;
+static int cpufreq_cpu[RAPL_MAX_CPUS];
+static char cpufreq_saved_governor[RAPL_MAX_CPUS][64];
+static int cpufreq_saved_min[RAPL_MAX_CPUS];
+static int cpufreq_saved_max[RAPL_MAX_CPUS];
+static int cpufreq_userspace=0;
+
+static int cpufreq_read(int cpu, const char *name, char *value, int size) {
+
+	char filename[BUFSIZ];
+	FILE *fff;
+	int result;
+
+	rapl_path(filename,sizeof(filename),
+		"/sys/devices/system/cpu/cpu%d/cpufreq/%s",cpu,name);
+	fff=fopen(filename,"r");
+	if (fff==NULL) return -1;
+	result=(fgets(value,size,fff)!=NULL);
+	fclose(fff);
+	if (!result) return -1;
+
+	value[strcspn(value,"\n")]=0;
+
+	return 0;
+}
+
+static int cpufreq_read_int(int cpu, const char *name, int *value) {
+
+	char buffer[64];
+
+	if (cpufreq_read(cpu,name,buffer,sizeof(buffer))<0) return -1;
+
+	return (sscanf(buffer,"%d",value)==1)?0:-1;
+}
+
+static int cpufreq_write(int cpu, const char *name, const char *value) {
+
+	char filename[BUFSIZ];
+	FILE *fff;
+	int result;
+
+	rapl_path(filename,sizeof(filename),
+		"/sys/devices/system/cpu/cpu%d/cpufreq/%s",cpu,name);
+	fff=fopen(filename,"w");
+	if (fff==NULL) return -1;
+	result=fprintf(fff,"%s\n",value);
+	if (fclose(fff)!=0) result=-1;
+
+	return (result<0)?-1:0;
+}
+
+/* Whichever order min and max are in now, max, min, max gets both	*/
+/* to the new values: a write that would cross the other fails, and	*/
+/* the next one makes room for it.					*/
+static int cpufreq_write_limits(int cpu, int min_khz, int max_khz) {
+
+	char min_buffer[32],max_buffer[32];
+	int min_now,max_now;
+
+	snprintf(min_buffer,sizeof(min_buffer),"%d",min_khz);
+	snprintf(max_buffer,sizeof(max_buffer),"%d",max_khz);
+
+	cpufreq_write(cpu,"scaling_max_freq",max_buffer);
+	cpufreq_write(cpu,"scaling_min_freq",min_buffer);
+	cpufreq_write(cpu,"scaling_max_freq",max_buffer);
+
+	if ((cpufreq_read_int(cpu,"scaling_min_freq",&min_now)<0) ||
+		(cpufreq_read_int(cpu,"scaling_max_freq",&max_now)<0) ||
+		(min_now!=min_khz) || (max_now!=max_khz)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int compare_int(const void *a, const void *b) {
+
+	return *(const int *)a-*(const int *)b;
+}
+
+int rapl_cpufreq_list(int *khz, int max) {
+
+	char buffer[BUFSIZ];
+	char *token,*saveptr;
+	int min_khz,max_khz,f;
+	int cpu,i,n=0;
+
+	/* The first CPU with cpufreq speaks for all of them */
+	for(cpu=0;cpu<rapl_total_cores;cpu++) {
+		if (cpufreq_read(cpu,"scaling_governor",buffer,
+				sizeof(buffer))==0) break;
+	}
+	if (cpu==rapl_total_cores) return -1;
+
+	if (cpufreq_read(cpu,"scaling_available_frequencies",buffer,
+			sizeof(buffer))==0) {
+		for(token=strtok_r(buffer," ",&saveptr);
+			(token!=NULL) && (n<max);
+			token=strtok_r(NULL," ",&saveptr)) {
+			if (sscanf(token,"%d",&f)==1) khz[n++]=f;
+		}
+	}
+
+	/* intel_pstate doesn't list them, go in 100MHz steps */
+	if (n==0) {
+		if ((cpufreq_read_int(cpu,"cpuinfo_min_freq",&min_khz)<0) ||
+			(cpufreq_read_int(cpu,"cpuinfo_max_freq",&max_khz)<0)) {
+			return -1;
+		}
+		for(f=min_khz;(f<max_khz) && (n<max);f+=100000) khz[n++]=f;
+		if (n<max) khz[n++]=max_khz;
+	}
+
+	qsort(khz,n,sizeof(int),compare_int);
+
+	/* and drop any repeats */
+	for(i=1,f=(n>0);i<n;i++) {
+		if (khz[i]!=khz[f-1]) khz[f++]=khz[i];
+	}
+
+	return f;
+}
+
+static int cpufreq_save(void) {
+
+	char filename[BUFSIZ],buffer[BUFSIZ];
+	int cpu,online,i;
+
+	for(cpu=0;cpu<rapl_total_cores;cpu++) {
+
+		rapl_path(filename,sizeof(filename),
+			"/sys/devices/system/cpu/cpu%d/online",cpu);
+		if ((read_sysfs_int(filename,&online)==0) && (!online)) continue;
+
+		i=cpufreq_num_cpus;
+		if ((cpufreq_read(cpu,"scaling_governor",
+				cpufreq_saved_governor[i],
+				sizeof(cpufreq_saved_governor[i]))<0) ||
+			(cpufreq_read_int(cpu,"scaling_min_freq",
+				&cpufreq_saved_min[i])<0) ||
+			(cpufreq_read_int(cpu,"scaling_max_freq",
+				&cpufreq_saved_max[i])<0)) {
+			continue;
+		}
+		cpufreq_cpu[i]=cpu;
+		cpufreq_num_cpus++;
+	}
+
+	if (cpufreq_num_cpus==0) {
+		fprintf(stderr,"No cpufreq support found\n");
+		return -1;
+	}
+
+	cpufreq_userspace=0;
+	if ((cpufreq_read(cpufreq_cpu[0],"scaling_available_governors",
+			buffer,sizeof(buffer))==0) &&
+		(strstr(buffer,"userspace")!=NULL)) {
+		cpufreq_userspace=1;
+	}
+
+	return 0;
+}
+
+int rapl_cpufreq_set(int khz) {
+
+	char buffer[32];
+	int i,cpu,khz_now;
+
+	if ((cpufreq_num_cpus==0) && (cpufreq_save()<0)) return -1;
+
+	snprintf(buffer,sizeof(buffer),"%d",khz);
+
+	for(i=0;i<cpufreq_num_cpus;i++) {
+		cpu=cpufreq_cpu[i];
+		if (cpufreq_userspace) {
+			if ((cpufreq_write(cpu,"scaling_governor","userspace")<0) ||
+				(cpufreq_write(cpu,"scaling_setspeed",buffer)<0)) {
+				fprintf(stderr,"Could not set CPU %d to %dkHz "
+					"with the userspace governor: %s\n",
+					cpu,khz,strerror(errno));
+				return -1;
+			}
+			/* the write can succeed and still be clamped */
+			khz_now=-1;
+			cpufreq_read_int(cpu,"scaling_setspeed",&khz_now);
+			if (khz_now!=khz) {
+				fprintf(stderr,"CPU %d did not take %dkHz, "
+					"scaling_setspeed reads back %d\n",
+					cpu,khz,khz_now);
+				return -1;
+			}
+		}
+		else if (cpufreq_write_limits(cpu,khz,khz)<0) {
+			fprintf(stderr,"Could not pin CPU %d to %dkHz "
+				"with scaling_min/max_freq\n",cpu,khz);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void rapl_cpufreq_restore(void) {
+
+	char governor[64];
+	int i,cpu;
+
+	for(i=0;i<cpufreq_num_cpus;i++) {
+		cpu=cpufreq_cpu[i];
+
+		cpufreq_write(cpu,"scaling_governor",cpufreq_saved_governor[i]);
+		if ((cpufreq_write_limits(cpu,cpufreq_saved_min[i],
+				cpufreq_saved_max[i])<0) ||
+			(cpufreq_read(cpu,"scaling_governor",governor,
+				sizeof(governor))<0) ||
+			(strcmp(governor,cpufreq_saved_governor[i]))) {
+			fprintf(stderr,"Could not restore CPU %d to %s "
+				"%d-%dkHz\n",cpu,cpufreq_saved_governor[i],
+				cpufreq_saved_min[i],cpufreq_saved_max[i]);
+		}
+	}
+
+	cpufreq_num_cpus=0;
+}
+
+
+/*******************************/
+/* Backend cost                */
+/*******************************/
+
+static int compare_ll(const void *a, const void *b) {
+
+	long long x=*(const long long *)a;
+	long long y=*(const long long *)b;
+
+	return (x>y)-(x<y);
+}
+
+int rapl_bench_backend(int backend, int cpu_model, int samples,
+		struct rapl_backend_cost *cost) {
+
+	long long *latency;
+	long long before,after;
+	unsigned long long syscalls;
+	double total=0.0,variance=0.0;
+	int i;
+
+	memset(cost,0,sizeof(*cost));
+	cost->backend=backend;
+
+	if (samples<=0) return -1;
+
+	latency=calloc(samples,sizeof(long long));
+	if (latency==NULL) return -1;
+
+	if (rapl_open(backend,cpu_model)!=backend) {
+		free(latency);
+		return -1;
+	}
+
+	/* warm up */
+	rapl_read();
+
+	syscalls=rapl_syscalls;
+	for(i=0;i<samples;i++) {
+		before=rapl_monotonic_ns();
+		rapl_read();
+		after=rapl_monotonic_ns();
+		latency[i]=after-before;
+		total+=latency[i];
+	}
+	syscalls=rapl_syscalls-syscalls;
+
+	rapl_close();
+
+	cost->samples=samples;
+	cost->avg_ns=total/samples;
+	cost->syscalls=(double)syscalls/samples;
+	for(i=0;i<samples;i++) {
+		variance+=(latency[i]-cost->avg_ns)*(latency[i]-cost->avg_ns);
+	}
+	cost->stddev_ns=sqrt(variance/samples);
+
+	qsort(latency,samples,sizeof(long long),compare_ll);
+	cost->min_ns=latency[0];
+	cost->p99_ns=latency[(samples*99)/100];
+	cost->max_ns=latency[samples-1];
+
+	free(latency);
+
+	return 0;
+}
+
+int rapl_bench_backends(int cpu_model, int samples, int verbose) {
+
+	static const int backends[]={
+		RAPL_BACKEND_MSR,
+		RAPL_BACKEND_PERF,
+		RAPL_BACKEND_SYSFS,
+	};
+	struct rapl_backend_cost cost[3];
+	int valid[3];
+	int i,best=-1;
+
+	for(i=0;i<3;i++) {
+		valid[i]=(rapl_bench_backend(backends[i],cpu_model,
+					samples,&cost[i])==0);
+		if (!valid[i]) continue;
+		if ((best<0) || (cost[i].avg_ns<cost[best].avg_ns)) best=i;
+	}
+
+	if (verbose) {
+		printf("\nPer-sample cost over %d samples, in microseconds\n\n",
+			samples);
+		printf("%-12s %9s %9s %9s %9s %9s %9s\n","backend",
+			"avg","min","p99","max","stddev","syscalls");
+		for(i=0;i<3;i++) {
+			if (!valid[i]) {
+				printf("%-12s not available\n",
+					rapl_backend_name(backends[i]));
+				continue;
+			}
+			printf("%-12s %9.3f %9.3f %9.3f %9.3f %9.3f %9.1f%s\n",
+				rapl_backend_name(backends[i]),
+				cost[i].avg_ns/1000.0,cost[i].min_ns/1000.0,
+				cost[i].p99_ns/1000.0,cost[i].max_ns/1000.0,
+				cost[i].stddev_ns/1000.0,cost[i].syscalls,
+				(i==best)?"  *":"");
+		}
+		printf("\n");
+	}
+
+	if (best<0) return -1;
+
+	return backends[best];
+}
+
+
+/*******************************/
+/* Region of interest          */
+/*******************************/
+
+int rapl_region_start(struct rapl_region *region) {
+
+	int result;
+
+	region->start_ns=rapl_monotonic_ns();
+	result=rapl_read();
+	memcpy(region->start,rapl_raw,
+		rapl_total_packages*sizeof(rapl_raw[0]));
+
+	return result;
+}
+
+int rapl_region_stop(struct rapl_region *region) {
+
+	int result;
+
+	result=rapl_read();
+	region->stop_ns=rapl_monotonic_ns();
+	memcpy(region->stop,rapl_raw,
+		rapl_total_packages*sizeof(rapl_raw[0]));
+
+	return result;
+}
+
+double rapl_region_seconds(struct rapl_region *region) {
+
+	return (double)(region->stop_ns-region->start_ns)/1000000000.0;
+}
+
+double rapl_region_joules(struct rapl_region *region, int package, int domain) {
+
+	return (double)(region->stop[package][domain]-
+			region->start[package][domain])*
+			rapl_units[package][domain];
+}
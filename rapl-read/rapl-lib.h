@@ -0,0 +1,409 @@
+/* Shared RAPL detection and sampling code, used by rapl-read,	*/
+/*	rapl-plot and anything else that links librapl.a		*/
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/perf_event.h>
+
+/* AMD Support */
+#define MSR_AMD_RAPL_POWER_UNIT			0xc0010299
+
+#define MSR_AMD_PKG_ENERGY_STATUS		0xc001029B
+#define MSR_AMD_PP0_ENERGY_STATUS		0xc001029A
+
+
+/* Intel support */
+
+#define MSR_INTEL_RAPL_POWER_UNIT		0x606
+/*
+ * Platform specific RAPL Domains.
+ * Note that PP1 RAPL Domain is supported on 062A only
+ * And DRAM RAPL Domain is supported on 062D only
+ */
+/* Package RAPL Domain */
+#define MSR_PKG_RAPL_POWER_LIMIT	0x610
+#define MSR_INTEL_PKG_ENERGY_STATUS	0x611
+#define MSR_PKG_PERF_STATUS		0x613
+#define MSR_PKG_POWER_INFO		0x614
+
+/* PP0 RAPL Domain */
+#define MSR_PP0_POWER_LIMIT		0x638
+#define MSR_INTEL_PP0_ENERGY_STATUS	0x639
+#define MSR_PP0_POLICY			0x63A
+#define MSR_PP0_PERF_STATUS		0x63B
+
+/* PP1 RAPL Domain, may reflect to uncore devices */
+#define MSR_PP1_POWER_LIMIT		0x640
+#define MSR_PP1_ENERGY_STATUS		0x641
+#define MSR_PP1_POLICY			0x642
+
+/* DRAM RAPL Domain */
+#define MSR_DRAM_POWER_LIMIT		0x618
+#define MSR_DRAM_ENERGY_STATUS		0x619
+#define MSR_DRAM_PERF_STATUS		0x61B
+#define MSR_DRAM_POWER_INFO		0x61C
+
+/* PSYS RAPL Domain */
+#define MSR_PLATFORM_ENERGY_STATUS	0x64d
+
+/* Frequency and thermal, architectural on Intel */
+#define MSR_IA32_MPERF			0xE7
+#define MSR_IA32_APERF			0xE8
+#define MSR_IA32_THERM_STATUS		0x19C
+#define MSR_IA32_TEMPERATURE_TARGET	0x1A2
+#define MSR_IA32_PACKAGE_THERM_STATUS	0x1B1
+
+/* C-state residency, model specific, count at the TSC rate */
+#define MSR_PKG_C2_RESIDENCY		0x60D
+#define MSR_PKG_C3_RESIDENCY		0x3F8
+#define MSR_PKG_C6_RESIDENCY		0x3F9
+#define MSR_PKG_C7_RESIDENCY		0x3FA
+#define MSR_PKG_C8_RESIDENCY		0x630
+#define MSR_PKG_C9_RESIDENCY		0x631
+#define MSR_PKG_C10_RESIDENCY		0x632
+#define MSR_CORE_C3_RESIDENCY		0x3FC
+#define MSR_CORE_C6_RESIDENCY		0x3FD
+#define MSR_CORE_C7_RESIDENCY		0x3FE
+
+/* RAPL UNIT BITMASK */
+#define POWER_UNIT_OFFSET	0
+#define POWER_UNIT_MASK		0x0F
+
+#define ENERGY_UNIT_OFFSET	0x08
+#define ENERGY_UNIT_MASK	0x1F00
+
+#define TIME_UNIT_OFFSET	0x10
+#define TIME_UNIT_MASK		0xF000
+
+
+#define CPU_VENDOR_INTEL	1
+#define CPU_VENDOR_AMD		2
+
+#define CPU_SANDYBRIDGE		42
+#define CPU_SANDYBRIDGE_EP	45
+#define CPU_IVYBRIDGE		58
+#define CPU_IVYBRIDGE_EP	62
+#define CPU_HASWELL		60
+#define CPU_HASWELL_ULT		69
+#define CPU_HASWELL_GT3E	70
+#define CPU_HASWELL_EP		63
+#define CPU_BROADWELL		61
+#define CPU_BROADWELL_GT3E	71
+#define CPU_BROADWELL_EP	79
+#define CPU_BROADWELL_DE	86
+#define CPU_SKYLAKE		78
+#define CPU_SKYLAKE_HS		94
+#define CPU_SKYLAKE_X		85
+#define CPU_KNIGHTS_LANDING	87
+#define CPU_KNIGHTS_MILL	133
+#define CPU_KABYLAKE_MOBILE	142
+#define CPU_KABYLAKE		158
+#define CPU_ATOM_SILVERMONT	55
+#define CPU_ATOM_AIRMONT	76
+#define CPU_ATOM_MERRIFIELD	74
+#define CPU_ATOM_MOOREFIELD	90
+#define CPU_ATOM_GOLDMONT	92
+#define CPU_ATOM_GEMINI_LAKE	122
+#define CPU_ATOM_DENVERTON	95
+
+#define CPU_AMD_FAM17H		0xc000
+
+
+#define RAPL_MAX_CPUS		1024
+#define RAPL_MAX_PACKAGES	16
+
+/* Domains, used as the second index of rapl_raw[][] and friends */
+#define RAPL_DOMAIN_PKG		0
+#define RAPL_DOMAIN_PP0		1
+#define RAPL_DOMAIN_PP1		2
+#define RAPL_DOMAIN_DRAM	3
+#define RAPL_DOMAIN_PSYS	4
+#define RAPL_NUM_DOMAINS	5
+
+#define RAPL_BACKEND_AUTO	0
+#define RAPL_BACKEND_MSR	1
+#define RAPL_BACKEND_PERF	2
+#define RAPL_BACKEND_SYSFS	3
+/* Only for rapl_open(): benchmark the others, open the cheapest */
+#define RAPL_BACKEND_CHEAPEST	4
+
+
+/* Topology, filled in by rapl_detect_packages() */
+extern int rapl_total_cores,rapl_total_packages;
+extern int rapl_package_map[RAPL_MAX_PACKAGES];
+
+/* MSR numbers differ between Intel and AMD, set by rapl_detect_cpu() */
+extern unsigned int rapl_msr_units_reg,rapl_msr_pkg_energy_reg;
+extern unsigned int rapl_msr_pp0_energy_reg;
+
+/* Per-package units decoded from the RAPL power unit MSR */
+extern double rapl_power_units[RAPL_MAX_PACKAGES];
+extern double rapl_time_units[RAPL_MAX_PACKAGES];
+/* The power unit MSR itself, only filled in by the MSR backend */
+extern uint64_t rapl_units_raw[RAPL_MAX_PACKAGES];
+
+/* Latest counter values.  Energy in Joules is raw*units.		*/
+/* Raw values are extended to 64 bits so they never go backwards.	*/
+extern uint64_t rapl_raw[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+extern double rapl_units[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+/* Bitmask of (1<<RAPL_DOMAIN_*) the open backend can read */
+extern int rapl_available;
+
+/* Which RAPL_BACKEND_* is open, 0 if none */
+extern int rapl_backend;
+
+/* MSR backend only: poll at least this often to never miss a wrap */
+extern long long rapl_msr_wrap_poll_ns;
+
+/* read()/pread() calls made by the backends so far.  Only	*/
+/* counted, not locked, so only exact from a single thread.	*/
+extern unsigned long long rapl_syscalls;
+
+
+/* Prefix for every /dev, /sys and /proc path the library opens,	*/
+/* so it can run against a fake tree such as rapl-fixture builds.	*/
+/* Defaults to $HW_ROOT, or "" for the real machine.  rapl_path()	*/
+/* is snprintf() with the root prepended.			*/
+void rapl_set_root(const char *root);
+const char *rapl_root(void);
+char *rapl_path(char *buffer, size_t size, const char *format, ...)
+	__attribute__((format(printf,3,4)));
+
+int rapl_open_msr(int core);
+int rapl_open_msr_rw(int core);
+/* 0 on success, -1 with errno set (and a message) if the read fails */
+int rapl_read_msr(int fd, unsigned int which, uint64_t *value);
+int rapl_probe_msr(int fd, unsigned int which, uint64_t *value);
+int rapl_write_msr(int fd, unsigned int which, uint64_t value);
+
+/* Read-only msr fd for a CPU, opened on first use and then shared	*/
+/* by every MSR reader here.  rapl_msr_fds_close() closes them.	*/
+int rapl_msr_fd(int cpu);
+void rapl_msr_fds_close(void);
+int rapl_perf_event_open(struct perf_event_attr *hw_event_uptr,
+		pid_t pid, int cpu, int group_fd, unsigned long flags);
+int rapl_check_paranoid(void);
+
+int rapl_detect_cpu(void);
+int rapl_detect_packages(void);
+
+const char *rapl_domain_name(int domain);
+const char *rapl_backend_name(int backend);
+
+/* Open the backend once, keep the fds around until rapl_close().	*/
+/* RAPL_BACKEND_AUTO tries sysfs then MSR, RAPL_BACKEND_CHEAPEST	*/
+/* runs rapl_bench_backends() first.  Returns the backend opened	*/
+/* or -1.								*/
+int rapl_open(int backend, int cpu_model);
+void rapl_close(void);
+
+/* Refresh rapl_raw[][], all packages or just one.		*/
+/* With the MSR backend this is also what keeps the 64-bit	*/
+/* totals ahead of the 32-bit wrap.				*/
+int rapl_read(void);
+int rapl_read_package(int package);
+
+long long rapl_monotonic_ns(void);
+
+/* TSC helpers, rapl_tsc_hz() calibrates against CLOCK_MONOTONIC	*/
+/* the first time it is called.					*/
+uint64_t rapl_rdtsc(void);
+double rapl_tsc_hz(void);
+
+/* The energy counters only update about once a millisecond.	*/
+/* Spin re-reading one package until its energy counter changes;	*/
+/* on return rapl_raw[package][] holds the fresh values and the	*/
+/* update happened between *tsc_lo and *tsc_hi.  Returns -1 if the	*/
+/* counter didn't move within RAPL_EDGE_TIMEOUT_NS.		*/
+#define RAPL_EDGE_TIMEOUT_NS	100000000LL
+
+int rapl_wait_edge(int package, uint64_t *tsc_lo, uint64_t *tsc_hi);
+
+
+/* Per-core energy on AMD Family 17h+, one entry per online physical	*/
+/* core.  rapl_cores_read() sweeps them in parallel batches on	*/
+/* pinned threads.  Energy in Joules is raw*units.		*/
+#define RAPL_CORE_BATCH		16
+
+extern int rapl_core_count;
+extern int rapl_core_cpu[RAPL_MAX_CPUS];
+extern int rapl_core_package[RAPL_MAX_CPUS];
+extern uint64_t rapl_core_raw[RAPL_MAX_CPUS];
+extern double rapl_core_units[RAPL_MAX_CPUS];
+
+int rapl_cores_open(void);
+int rapl_cores_read(void);
+void rapl_cores_close(void);
+
+
+/* System-wide hardware counters, read as one perf group per CPU	*/
+/* and summed per package into rapl_hw_raw[package][RAPL_HW_*].	*/
+/* rapl_hw_available has a bit for each event the machine has;	*/
+/* instructions is required.					*/
+#define RAPL_HW_INSTRUCTIONS	0
+#define RAPL_HW_CYCLES		1
+#define RAPL_HW_LLC_MISSES	2
+#define RAPL_HW_NUM		3
+
+extern uint64_t rapl_hw_raw[RAPL_MAX_PACKAGES][RAPL_HW_NUM];
+extern int rapl_hw_available;
+
+int rapl_hw_open(void);
+int rapl_hw_read(void);
+void rapl_hw_close(void);
+
+
+/* Memory traffic from the uncore IMC CAS counters, or data_reads	*/
+/* and data_writes on client parts, summed over a package's memory	*/
+/* controllers into rapl_imc_raw[package][RAPL_IMC_*].		*/
+/* Bytes moved is raw*rapl_imc_units[event].  rapl_imc_count is the	*/
+/* number of controllers found per package.				*/
+#define RAPL_IMC_READ		0
+#define RAPL_IMC_WRITE		1
+#define RAPL_IMC_NUM		2
+
+#define RAPL_MAX_IMCS		16
+
+extern uint64_t rapl_imc_raw[RAPL_MAX_PACKAGES][RAPL_IMC_NUM];
+extern double rapl_imc_units[RAPL_IMC_NUM];
+extern int rapl_imc_count;
+
+int rapl_imc_open(void);
+int rapl_imc_read(void);
+void rapl_imc_close(void);
+
+
+/* Time spent throttled by RAPL from the *_PERF_STATUS MSRs, Intel	*/
+/* only and independent of the sampling backend.  Not every model	*/
+/* has every domain, rapl_throttle_open() probes for them.  Seconds	*/
+/* throttled is raw*rapl_throttle_units[package].			*/
+extern uint64_t rapl_throttle_raw[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+extern double rapl_throttle_units[RAPL_MAX_PACKAGES];
+extern int rapl_throttle_available;
+
+int rapl_throttle_open(void);
+int rapl_throttle_read_package(int package);
+void rapl_throttle_close(void);
+
+
+/* Effective frequency and temperatures from APERF/MPERF and the	*/
+/* thermal status MSRs, one entry per online logical CPU.		*/
+/* Between two reads a CPU was busy dMPERF/dTSC of the time and ran	*/
+/* at rapl_tsc_hz()*dAPERF/dMPERF while busy.  Temperatures are in	*/
+/* degrees C.  rapl_freq_available says which of them work.	*/
+#define RAPL_FREQ_APERF		1
+#define RAPL_FREQ_CORE_TEMP	2
+#define RAPL_FREQ_PKG_TEMP	4
+
+extern int rapl_cpu_count;
+extern int rapl_cpu_id[RAPL_MAX_CPUS];
+extern int rapl_cpu_package[RAPL_MAX_CPUS];
+extern uint64_t rapl_cpu_aperf[RAPL_MAX_CPUS];
+extern uint64_t rapl_cpu_mperf[RAPL_MAX_CPUS];
+extern int rapl_cpu_temp[RAPL_MAX_CPUS];
+extern int rapl_package_temp[RAPL_MAX_PACKAGES];
+extern uint64_t rapl_cpu_tsc;
+extern int rapl_freq_available;
+
+int rapl_freq_open(void);
+int rapl_freq_read(void);
+void rapl_freq_close(void);
+
+
+/* Package and core C-state residency.  The counters only tick	*/
+/* while in the state, at the TSC rate, so between two reads the	*/
+/* package was in PCn dRaw/dTSC of the time.  Which MSRs exist is	*/
+/* picked from the rapl_detect_cpu() model and then probed;	*/
+/* rapl_pkg_cstate_available and rapl_core_cstate_available have	*/
+/* a bit per state that could be read.  Core residency is per core	*/
+/* but read once per online logical CPU, like rapl_freq.		*/
+#define RAPL_PKG_C2		0
+#define RAPL_PKG_C3		1
+#define RAPL_PKG_C6		2
+#define RAPL_PKG_C7		3
+#define RAPL_PKG_C8		4
+#define RAPL_PKG_C9		5
+#define RAPL_PKG_C10		6
+#define RAPL_NUM_PKG_CSTATES	7
+
+#define RAPL_CORE_C3		0
+#define RAPL_CORE_C6		1
+#define RAPL_CORE_C7		2
+#define RAPL_NUM_CORE_CSTATES	3
+
+extern uint64_t rapl_pkg_cstate_raw[RAPL_MAX_PACKAGES][RAPL_NUM_PKG_CSTATES];
+extern uint64_t rapl_core_cstate_raw[RAPL_MAX_CPUS][RAPL_NUM_CORE_CSTATES];
+extern int rapl_cstate_cpu_count;
+extern int rapl_cstate_cpu_id[RAPL_MAX_CPUS];
+extern int rapl_cstate_cpu_package[RAPL_MAX_CPUS];
+extern uint64_t rapl_cstate_tsc;
+extern int rapl_pkg_cstate_available,rapl_core_cstate_available;
+
+const char *rapl_pkg_cstate_name(int state);
+const char *rapl_core_cstate_name(int state);
+int rapl_cstate_open(int cpu_model);
+int rapl_cstate_read(void);
+void rapl_cstate_close(void);
+
+
+/* Power limits, Intel only, always through the MSRs.  limit is 1	*/
+/* for PL1 or 2 for PL2, which only the package domain has.	*/
+/* Watts and seconds are encoded with the package's units; a	*/
+/* window of 0 keeps the current one.  Setting a limit enables it,	*/
+/* fails if the register is locked, and reads it back to check.	*/
+/* The original values are saved on the first write and put back	*/
+/* by rapl_limit_restore().					*/
+int rapl_limit_get(int package, int domain, int limit,
+		double *watts, double *seconds, int *enabled, int *locked);
+int rapl_limit_set(int package, int domain, int limit,
+		double watts, double seconds);
+void rapl_limit_restore(void);
+
+
+/* CPU frequency for sweeps, through cpufreq, in kHz.		*/
+/* rapl_cpufreq_list() fills khz with the frequencies available,	*/
+/* lowest first, and returns how many.  rapl_cpufreq_set() pins	*/
+/* every online CPU to one and reads it back, failing if any CPU	*/
+/* didn't take it; the governor and limits are saved on the first	*/
+/* call and put back by rapl_cpufreq_restore().			*/
+#define RAPL_MAX_FREQS		64
+
+int rapl_cpufreq_list(int *khz, int max);
+int rapl_cpufreq_set(int khz);
+void rapl_cpufreq_restore(void);
+
+
+/* Cost of one rapl_read() of all packages on a backend */
+#define RAPL_BENCH_SAMPLES	2000
+
+struct rapl_backend_cost {
+	int backend;
+	int samples;
+	double avg_ns,min_ns,p99_ns,max_ns;
+	double stddev_ns;		/* jitter */
+	double syscalls;		/* per sample */
+};
+
+/* Open the backend, time samples reads and close it again.	*/
+/* Returns -1 if the backend isn't available.			*/
+int rapl_bench_backend(int backend, int cpu_model, int samples,
+		struct rapl_backend_cost *cost);
+
+/* Bench msr, perf_event and sysfs, print a table if verbose,	*/
+/* and return the available one with the lowest average, or -1.	*/
+int rapl_bench_backends(int cpu_model, int samples, int verbose);
+
+
+/* Region of interest.  The caller owns the struct, so start and	*/
+/* stop only read the counters and copy them; nothing is allocated.	*/
+struct rapl_region {
+	long long start_ns,stop_ns;
+	uint64_t start[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	uint64_t stop[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+};
+
+int rapl_region_start(struct rapl_region *region);
+int rapl_region_stop(struct rapl_region *region);
+double rapl_region_seconds(struct rapl_region *region);
+double rapl_region_joules(struct rapl_region *region, int package, int domain);
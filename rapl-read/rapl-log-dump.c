@@ -0,0 +1,385 @@
+/* Convert a binary log from rapl-plot -o back into the same	*/
+/*	tab-separated text rapl-plot prints.				*/
+/*									*/
+/* The log only has raw counter snapshots, so it can also be	*/
+/* replayed at a different window: with -w the counters are	*/
+/* interpolated to each window boundary and power recomputed from	*/
+/* those.  Capture once at a short period, pick the resolution	*/
+/* afterwards.							*/
+/*									*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <sys/stat.h>
+
+#include "rapl-lib.h"
+#include "rapl-log.h"
+#include "rapl-stats.h"
+
+static const char *column_names[RAPL_NUM_DOMAINS]={
+	"Package%d(W)\t",
+	"Cores(W)\t",
+	"GPU(W)\t\t",
+	"DRAM(W)\t\t",
+	"Psys(W)|\t",
+};
+
+#define NUM_COUNTERS	(RAPL_MAX_PACKAGES*RAPL_NUM_DOMAINS)
+
+static struct rapl_log_header header;
+static char *records;
+static uint64_t first,count;
+
+static int quiet=0;
+static struct rapl_stats *power_stats[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+/* Record i of the count still in the log, oldest first */
+static uint64_t *log_record(uint64_t i) {
+
+	i+=first;
+	if (header.capacity) i%=header.capacity;
+
+	return (uint64_t *)(records+i*header.record_size);
+}
+
+/* When package j was sampled; package 0 gives the time column */
+static double record_seconds(uint64_t *record, int j) {
+
+	return (double)((int64_t)record[j]-header.start_ns)/1000000000.0;
+}
+
+static uint64_t *record_raw(uint64_t *record) {
+
+	return record+header.packages;
+}
+
+/* Print one line of power and feed the statistics.  seconds[j] is	*/
+/* package j's window.						*/
+static void window_output(double end, double *seconds,
+		double *before, double *after) {
+
+	double watts;
+	int d,j,c;
+
+	for(j=0;j<header.packages;j++) {
+		if (seconds[j]<=0.0) return;
+	}
+
+	if (!quiet) printf("%lf\t",end);
+	for(j=0;j<header.packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!(header.available&(1<<d))) continue;
+			c=j*RAPL_NUM_DOMAINS+d;
+			watts=(after[c]-before[c])*header.units[j][d]/
+				seconds[j];
+			if (!quiet) printf("%lf\t",watts);
+			if (power_stats[j][d]) {
+				rapl_stats_add(power_stats[j][d],watts);
+			}
+		}
+	}
+	if (!quiet) printf("\n");
+}
+
+static void record_counters(uint64_t *record, double *values) {
+
+	int c;
+
+	for(c=0;c<header.packages*RAPL_NUM_DOMAINS;c++) {
+		values[c]=(double)record_raw(record)[c];
+	}
+}
+
+/* One window per record, exactly what rapl-plot printed */
+static void replay_records(void) {
+
+	double before[NUM_COUNTERS],after[NUM_COUNTERS];
+	double seconds[RAPL_MAX_PACKAGES];
+	uint64_t *cur,*prev;
+	uint64_t i;
+	int j;
+
+	for(i=1;i<count;i++) {
+		prev=log_record(i-1);
+		cur=log_record(i);
+		record_counters(prev,before);
+		record_counters(cur,after);
+		for(j=0;j<header.packages;j++) {
+			seconds[j]=record_seconds(cur,j)-record_seconds(prev,j);
+		}
+		window_output(record_seconds(cur,0),seconds,before,after);
+	}
+}
+
+/* Counters at time t, each package interpolated between its own	*/
+/* times in the records either side.  k[] are cursors into the	*/
+/* records that only move forward, so a whole replay is one pass.	*/
+static void counters_at(double t, uint64_t *k, double *values) {
+
+	uint64_t *a,*b;
+	double ta,tb,f;
+	int c,d,j;
+
+	for(j=0;j<header.packages;j++) {
+		while((k[j]+2<count) &&
+			(record_seconds(log_record(k[j]+1),j)<=t)) k[j]++;
+
+		a=log_record(k[j]);
+		b=log_record(k[j]+1);
+		ta=record_seconds(a,j);
+		tb=record_seconds(b,j);
+		f=(tb>ta)?(t-ta)/(tb-ta):0.0;
+
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			c=j*RAPL_NUM_DOMAINS+d;
+			/* the raw counters never go backwards, b-a is the delta */
+			values[c]=(double)record_raw(a)[c]+
+				(double)(record_raw(b)[c]-record_raw(a)[c])*f;
+		}
+	}
+}
+
+/* Windows of window seconds, with boundaries at align plus a	*/
+/* multiple of window, counting from the start of the log.	*/
+static void replay_windows(double window, double align) {
+
+	double before[NUM_COUNTERS],after[NUM_COUNTERS];
+	double seconds[RAPL_MAX_PACKAGES];
+	double t,t_first,t_last;
+	uint64_t k[RAPL_MAX_PACKAGES];
+	int j;
+
+	t_first=record_seconds(log_record(0),0);
+	t_last=record_seconds(log_record(count-1),0);
+
+	for(j=0;j<header.packages;j++) {
+		k[j]=0;
+		seconds[j]=window;
+	}
+
+	/* First boundary at or after the first record */
+	t=align+window*ceil((t_first-align)/window);
+
+	counters_at(t,k,before);
+	for(;t+window<=t_last;t+=window) {
+		counters_at(t+window,k,after);
+		window_output(t+window,seconds,before,after);
+		memcpy(before,after,sizeof(before));
+	}
+}
+
+static void stats_report(void) {
+
+	struct rapl_stats *stats;
+	uint64_t *a,*b;
+	int d,j,c;
+
+	a=log_record(0);
+	b=log_record(count-1);
+
+	fprintf(stderr,"\n%.3fs from %llu records\n",
+		record_seconds(b,0)-record_seconds(a,0),
+		(unsigned long long)count);
+
+	for(j=0;j<header.packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			stats=power_stats[j][d];
+			if (stats==NULL) continue;
+			c=j*RAPL_NUM_DOMAINS+d;
+			fprintf(stderr,"Package %d %-4s %.6fJ, %llu windows: "
+				"mean %.3fW, min %.3fW, p50 %.3fW, p90 %.3fW, "
+				"p99 %.3fW, p99.9 %.3fW, max %.3fW\n",
+				j,rapl_domain_name(d),
+				(double)(record_raw(b)[c]-record_raw(a)[c])*
+					header.units[j][d],
+				(unsigned long long)stats->count,
+				rapl_stats_mean(stats),stats->min,
+				rapl_stats_quantile(stats,0.50),
+				rapl_stats_quantile(stats,0.90),
+				rapl_stats_quantile(stats,0.99),
+				rapl_stats_quantile(stats,0.999),
+				stats->max);
+		}
+	}
+}
+
+static void print_info(char *filename) {
+
+	uint64_t *a,*b;
+	int j;
+
+	a=log_record(0);
+	b=log_record(count-1);
+
+	printf("%s: version %u, %s backend, %u packages\n",
+		filename,header.version,rapl_backend_name(header.backend),
+		header.packages);
+	printf("\t%llu records over %.3fs",(unsigned long long)count,
+		record_seconds(b,0)-record_seconds(a,0));
+	if (header.period_ns) {
+		printf(", period %.3fms",(double)header.period_ns/1000000.0);
+	}
+	if (header.capacity) {
+		printf(", ring of %llu",(unsigned long long)header.capacity);
+	}
+	printf("\n");
+	for(j=0;j<header.packages;j++) {
+		printf("\tPackage %d: energy units %.8fJ",j,
+			header.units[j][RAPL_DOMAIN_PKG]);
+		if (header.units_raw[j]) {
+			printf(", power unit MSR 0x%llx",
+				(unsigned long long)header.units_raw[j]);
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv) {
+
+	FILE *fff;
+	struct stat st;
+	size_t records_size;
+	uint64_t available_records;
+	double window=0.0,align=0.0;
+	int show_stats=0,info=0;
+	int c,d,j;
+
+	while ((c = getopt (argc, argv, "a:Dhiqw:")) != -1) {
+		switch (c) {
+		case 'a':
+			align = atof(optarg);
+			break;
+		case 'D':
+			show_stats = 1;
+			break;
+		case 'h':
+			printf("Usage: %s [-a sec] [-D] [-h] [-i] [-q] [-w sec] logfile\n\n",argv[0]);
+			printf("\t-a sec  : with -w, start windows sec into the log\n");
+			printf("\t-D      : print energy and power percentiles to stderr\n");
+			printf("\t-h      : displays this help\n");
+			printf("\t-i      : just describe the log\n");
+			printf("\t-q      : don't print the windows, e.g. with -D\n");
+			printf("\t-w sec  : recompute power over windows of sec seconds\n");
+			exit(0);
+		case 'i':
+			info = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'w':
+			window = atof(optarg);
+			break;
+		default:
+			fprintf(stderr,"Unknown option %c\n",c);
+			exit(-1);
+		}
+	}
+
+	if (optind>=argc) {
+		printf("Usage: %s [-a sec] [-D] [-h] [-i] [-q] [-w sec] logfile\n\n",argv[0]);
+		return -1;
+	}
+
+	fff=fopen(argv[optind],"r");
+	if (fff==NULL) {
+		fprintf(stderr,"Error opening %s: %s\n",argv[optind],strerror(errno));
+		return -1;
+	}
+
+	if (fread(&header,sizeof(header),1,fff)!=1) {
+		fprintf(stderr,"Error reading header of %s\n",argv[optind]);
+		return -1;
+	}
+
+	if ((memcmp(header.magic,RAPL_LOG_MAGIC,sizeof(header.magic))) ||
+		(header.version!=RAPL_LOG_VERSION) ||
+		(header.packages>RAPL_MAX_PACKAGES) ||
+		(header.record_size!=RAPL_LOG_RECORD_SIZE(header.packages))) {
+		fprintf(stderr,"%s is not a rapl-plot log\n",argv[optind]);
+		return -1;
+	}
+
+	fstat(fileno(fff),&st);
+	records_size=st.st_size-sizeof(header);
+	records=malloc(records_size);
+	if (records==NULL) {
+		fprintf(stderr,"Out of memory\n");
+		return -1;
+	}
+	if (fread(records,1,records_size,fff)!=records_size) {
+		fprintf(stderr,"Error reading %s\n",argv[optind]);
+		return -1;
+	}
+	fclose(fff);
+
+	/* For an append log trust the file size, in case we never got	*/
+	/* to write the final count.  For a ring, only the last		*/
+	/* capacity records are still there.				*/
+	available_records=records_size/header.record_size;
+	if (header.capacity==0) {
+		count=available_records;
+		first=0;
+	}
+	else {
+		if (header.capacity>available_records) {
+			fprintf(stderr,"%s is truncated\n",argv[optind]);
+			return -1;
+		}
+		count=header.head;
+		if (count>header.capacity) count=header.capacity;
+		first=header.head-count;
+	}
+
+	if (count<2) {
+		fprintf(stderr,"%s has fewer than two records\n",argv[optind]);
+		return -1;
+	}
+
+	if (info) {
+		print_info(argv[optind]);
+		return 0;
+	}
+
+	if (show_stats) {
+		for(j=0;j<header.packages;j++) {
+			for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+				if (!(header.available&(1<<d))) continue;
+				power_stats[j][d]=malloc(sizeof(struct rapl_stats));
+				if (power_stats[j][d]==NULL) {
+					fprintf(stderr,"Out of memory\n");
+					return -1;
+				}
+				rapl_stats_init(power_stats[j][d]);
+			}
+		}
+	}
+
+	if (!quiet) {
+		printf("Time (s)\t");
+		for(j=0;j<header.packages;j++) {
+			for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+				if (header.available&(1<<d)) printf(column_names[d],j);
+			}
+		}
+		printf("\n");
+	}
+
+	if (window>0.0) replay_windows(window,align);
+	else replay_records();
+
+	if (show_stats) stats_report();
+
+	for(j=0;j<header.packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) free(power_stats[j][d]);
+	}
+	free(records);
+
+	return 0;
+}
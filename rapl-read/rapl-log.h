@@ -0,0 +1,34 @@
+/* Binary sample log written by rapl-plot -o, read by rapl-log-dump	*/
+/*									*/
+/* A header followed by fixed-size records.  Each record is the	*/
+/* CLOCK_MONOTONIC time in ns of every package's sample (with -e,	*/
+/* when its counter updated), then the raw 64-bit counters for	*/
+/* every package and domain, raw[package*RAPL_NUM_DOMAINS+domain].	*/
+/* Energy in Joules is raw*units[package][domain] from the header.	*/
+/* This is everything needed to recompute power at any window later,	*/
+/* which is what rapl-log-dump -w does.				*/
+/*									*/
+/* If capacity is 0 the records are simply appended.  Otherwise the	*/
+/* file is a memory-mapped ring of capacity records and record i	*/
+/* lives in slot i%capacity; head is the total number ever written.	*/
+
+#define RAPL_LOG_MAGIC		"RAPLLOG1"
+#define RAPL_LOG_VERSION	1
+
+struct rapl_log_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t packages;
+	uint32_t available;
+	uint32_t backend;
+	uint64_t record_size;
+	uint64_t capacity;
+	uint64_t head;
+	int64_t start_ns;
+	double units[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	uint64_t units_raw[RAPL_MAX_PACKAGES];	/* power unit MSR, or 0 */
+	int64_t period_ns;			/* sample period asked for */
+};
+
+#define RAPL_LOG_RECORD_SIZE(packages) \
+	((packages)*(1+RAPL_NUM_DOMAINS)*sizeof(uint64_t))
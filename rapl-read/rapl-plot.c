@@ -2,751 +2,1158 @@
 /*									*/
 /* Vince Weaver -- vincent.weaver @ maine.edu -- 13 April 2017		*/
 /*									*/
+/* The detection and sampling code now lives in rapl-lib.c		*/
+/*									*/
+
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <unistd.h>
-#include <math.h>
+#include <getopt.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
 
-#include <sys/time.h>
-#include <sys/syscall.h>
-#include <linux/perf_event.h>
+#include <sys/mman.h>
 
-#define MSR_RAPL_POWER_UNIT		0x606
+#include "rapl-lib.h"
+#include "rapl-log.h"
+#include "rapl-shm.h"
+#include "rapl-stats.h"
 
-/*
- * Platform specific RAPL Domains.
- * Note that PP1 RAPL Domain is supported on 062A only
- * And DRAM RAPL Domain is supported on 062D only
- */
-/* Package RAPL Domain */
-#define MSR_PKG_RAPL_POWER_LIMIT	0x610
-#define MSR_PKG_ENERGY_STATUS		0x611
-#define MSR_PKG_PERF_STATUS		0x613
-#define MSR_PKG_POWER_INFO		0x614
+static uint64_t first_raw[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+static uint64_t last_raw[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
 
-/* PP0 RAPL Domain */
-#define MSR_PP0_POWER_LIMIT		0x638
-#define MSR_PP0_ENERGY_STATUS		0x639
-#define MSR_PP0_POLICY			0x63A
-#define MSR_PP0_PERF_STATUS		0x63B
+static const char *column_names[RAPL_NUM_DOMAINS]={
+	"Package%d(W)\t",
+	"Cores(W)\t",
+	"GPU(W)\t\t",
+	"DRAM(W)\t\t",
+	"Psys(W)|\t",
+};
 
-/* PP1 RAPL Domain, may reflect to uncore devices */
-#define MSR_PP1_POWER_LIMIT		0x640
-#define MSR_PP1_ENERGY_STATUS		0x641
-#define MSR_PP1_POLICY			0x642
+/* Track how long each backend read takes, so we know how much	*/
+/* the sampler itself is perturbing the measurement.		*/
+static long long sample_count=0;
+static double sample_cost_total=0.0,sample_cost_min=0.0,sample_cost_max=0.0;
 
-/* DRAM RAPL Domain */
-#define MSR_DRAM_POWER_LIMIT		0x618
-#define MSR_DRAM_ENERGY_STATUS		0x619
-#define MSR_DRAM_PERF_STATUS		0x61B
-#define MSR_DRAM_POWER_INFO		0x61C
+static void sample_cost_update(double cost) {
 
-/* PSYS RAPL Domain */
-#define MSR_PLATFORM_ENERGY_STATUS	0x64d
+	if ((sample_count==0) || (cost<sample_cost_min)) sample_cost_min=cost;
+	if ((sample_count==0) || (cost>sample_cost_max)) sample_cost_max=cost;
+	sample_cost_total+=cost;
+	sample_count++;
+}
 
-/* RAPL UNIT BITMASK */
-#define POWER_UNIT_OFFSET	0
-#define POWER_UNIT_MASK		0x0F
+static void sample_cost_report(void) {
 
-#define ENERGY_UNIT_OFFSET	0x08
-#define ENERGY_UNIT_MASK	0x1F00
+	if (sample_count==0) return;
 
-#define TIME_UNIT_OFFSET	0x10
-#define TIME_UNIT_MASK		0xF000
+	fprintf(stderr,"\nSample cost over %lld samples: "
+		"avg %.3fus, min %.3fus, max %.3fus\n",
+		sample_count,sample_cost_total/sample_count,
+		sample_cost_min,sample_cost_max);
+}
 
+/* Jitter is how late we woke up relative to the absolute deadline.	*/
+/* Keep a 1us resolution histogram so we can get p99 at exit without	*/
+/* storing every sample; anything past the last bucket is lumped.	*/
+#define JITTER_BUCKETS	10000
 
-#define MAX_CPUS	1024
-#define MAX_PACKAGES	16
+static long long jitter_hist[JITTER_BUCKETS+1];
+static long long jitter_count=0,missed_deadlines=0;
+static double jitter_total=0.0,jitter_min=0.0,jitter_max=0.0;
 
-double package_energy[MAX_PACKAGES],last_package[MAX_PACKAGES];
-double cores_energy[MAX_PACKAGES],last_cores[MAX_PACKAGES];
-double uncore_energy[MAX_PACKAGES],last_uncore[MAX_PACKAGES];
-double dram_energy[MAX_PACKAGES],last_dram[MAX_PACKAGES];
-double psys_energy[MAX_PACKAGES],last_psys[MAX_PACKAGES];
+static void jitter_update(long long late_ns) {
 
-#define PACKAGE 1
-#define CORES	2
-#define UNCORE	4
-#define DRAM	8
-#define PSYS	16
+	double late_us=(double)late_ns/1000.0;
+	long long bucket;
 
-static int available=PACKAGE|CORES|UNCORE|DRAM|PSYS;
+	if ((jitter_count==0) || (late_us<jitter_min)) jitter_min=late_us;
+	if ((jitter_count==0) || (late_us>jitter_max)) jitter_max=late_us;
+	jitter_total+=late_us;
+	jitter_count++;
 
-static int open_msr(int core) {
+	bucket=late_ns/1000;
+	if (bucket<0) bucket=0;
+	if (bucket>JITTER_BUCKETS) bucket=JITTER_BUCKETS;
+	jitter_hist[bucket]++;
+}
 
-	char msr_filename[BUFSIZ];
-	int fd;
+static void jitter_report(long long period_ns) {
 
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
-	fd = open(msr_filename, O_RDONLY);
-	if ( fd < 0 ) {
-		if ( errno == ENXIO ) {
-			fprintf(stderr, "rdmsr: No CPU %d\n", core);
-			exit(2);
-		} else if ( errno == EIO ) {
-			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n",
-					core);
-			exit(3);
-		} else {
-			perror("rdmsr:open");
-			fprintf(stderr,"Trying to open %s\n",msr_filename);
-			exit(127);
-		}
+	long long target,seen=0;
+	int i;
+
+	fprintf(stderr,"Deadline period %.3fms: %lld missed deadlines\n",
+		(double)period_ns/1000000.0,missed_deadlines);
+
+	if (jitter_count==0) return;
+
+	/* p99 is the first bucket where we've seen 99% of samples */
+	target=(jitter_count*99+99)/100;
+	for(i=0;i<=JITTER_BUCKETS;i++) {
+		seen+=jitter_hist[i];
+		if (seen>=target) break;
 	}
 
-	return fd;
+	fprintf(stderr,"Wakeup jitter over %lld samples: "
+		"min %.3fus, mean %.3fus, max %.3fus, p99 %s%dus\n",
+		jitter_count,jitter_min,jitter_total/jitter_count,jitter_max,
+		(i==JITTER_BUCKETS)?">":"",i);
 }
 
-static long long read_msr(int fd, int which) {
+static void energy_report(void) {
 
-	uint64_t data;
+	int d,j;
 
-	if ( pread(fd, &data, sizeof data, which) != sizeof data ) {
-		perror("rdmsr:pread");
-		exit(127);
+	for(j=0;j<rapl_total_packages;j++) {
+		fprintf(stderr,"Package %d total energy:",j);
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!(rapl_available&(1<<d))) continue;
+			fprintf(stderr," %s %.6fJ",rapl_domain_name(d),
+				(double)(rapl_raw[j][d]-first_raw[j][d])*
+				rapl_units[j][d]);
+		}
+		fprintf(stderr,"\n");
 	}
+}
+
+/* With -o the samples go to a binary log instead of stdout, so	*/
+/* there is no text formatting or write() per sample.  With -r the	*/
+/* log is a fixed-size memory-mapped ring, otherwise records are	*/
+/* appended through a big stdio buffer.  rapl-log-dump turns the	*/
+/* log back into the usual text.					*/
+#define LOG_BUFFER_SIZE	(1024*1024)
 
-	return (long long)data;
+static FILE *log_file=NULL;
+static struct rapl_log_header log_header;
+static struct rapl_log_header *log_ring=NULL;
+static size_t log_ring_size;
+static uint64_t log_record[RAPL_MAX_PACKAGES*(1+RAPL_NUM_DOMAINS)];
+
+static int log_open(char *filename, uint64_t capacity, long long start_ns,
+		long long period_ns) {
+
+	int fd;
+
+	memset(&log_header,0,sizeof(log_header));
+	memcpy(log_header.magic,RAPL_LOG_MAGIC,sizeof(log_header.magic));
+	log_header.version=RAPL_LOG_VERSION;
+	log_header.packages=rapl_total_packages;
+	log_header.available=rapl_available;
+	log_header.backend=rapl_backend;
+	log_header.record_size=RAPL_LOG_RECORD_SIZE(rapl_total_packages);
+	log_header.capacity=capacity;
+	log_header.head=0;
+	log_header.start_ns=start_ns;
+	memcpy(log_header.units,rapl_units,sizeof(log_header.units));
+	memcpy(log_header.units_raw,rapl_units_raw,
+		sizeof(log_header.units_raw));
+	log_header.period_ns=period_ns;
+
+	if (capacity==0) {
+		log_file=fopen(filename,"w");
+		if (log_file==NULL) {
+			fprintf(stderr,"Error opening %s: %s\n",
+				filename,strerror(errno));
+			return -1;
+		}
+		setvbuf(log_file,NULL,_IOFBF,LOG_BUFFER_SIZE);
+		fwrite(&log_header,sizeof(log_header),1,log_file);
+		return 0;
+	}
+
+	fd=open(filename,O_RDWR|O_CREAT|O_TRUNC,0644);
+	if (fd<0) {
+		fprintf(stderr,"Error opening %s: %s\n",
+			filename,strerror(errno));
+		return -1;
+	}
+
+	log_ring_size=sizeof(log_header)+capacity*log_header.record_size;
+	if (ftruncate(fd,log_ring_size)<0) {
+		fprintf(stderr,"Error sizing %s: %s\n",
+			filename,strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	log_ring=mmap(NULL,log_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (log_ring==MAP_FAILED) {
+		fprintf(stderr,"Error mapping %s: %s\n",
+			filename,strerror(errno));
+		log_ring=NULL;
+		return -1;
+	}
+
+	memcpy(log_ring,&log_header,sizeof(log_header));
+
+	return 0;
 }
 
-#define CPU_SANDYBRIDGE		42
-#define CPU_SANDYBRIDGE_EP	45
-#define CPU_IVYBRIDGE		58
-#define CPU_IVYBRIDGE_EP	62
-#define CPU_HASWELL		60	// 69,70 too?
-#define CPU_HASWELL_EP		63
-#define CPU_BROADWELL		61	// 71 too?
-#define CPU_BROADWELL_EP	79
-#define CPU_BROADWELL_DE	86
-#define CPU_SKYLAKE		78
-#define CPU_SKYLAKE_HS		94
-#define CPU_SKYLAKE_X		85
-#define CPU_KNIGHTS_LANDING	87
-#define CPU_KABYLAKE		142
-#define CPU_KABYLAKE_2		158
+/* time_ns[j] is when package j was sampled */
+static void log_sample(long long *time_ns) {
 
+	char *slot;
+	int j;
 
-/* TODO: on Skylake, also may support  PSys "platform" domain,	*/
-/* the whole SoC not just the package.				*/
-/* see dcee75b3b7f025cc6765e6c92ba0a4e59a4d25f4			*/
+	for(j=0;j<rapl_total_packages;j++) {
+		log_record[j]=(uint64_t)time_ns[j];
+		memcpy(&log_record[rapl_total_packages+j*RAPL_NUM_DOMAINS],
+			rapl_raw[j],sizeof(rapl_raw[j]));
+	}
 
-static int detect_cpu(void) {
+	if (log_ring) {
+		slot=(char *)(log_ring+1)+
+			(log_ring->head%log_ring->capacity)*
+			log_ring->record_size;
+		memcpy(slot,log_record,log_ring->record_size);
+		log_ring->head++;
+	}
+	else {
+		fwrite(log_record,log_header.record_size,1,log_file);
+		log_header.head++;
+	}
+}
 
-	FILE *fff;
+static void log_close(void) {
 
-	int family,model=-1;
-	char buffer[BUFSIZ],*result;
-	char vendor[BUFSIZ];
+	if (log_ring) {
+		msync(log_ring,log_ring_size,MS_SYNC);
+		munmap(log_ring,log_ring_size);
+		log_ring=NULL;
+	}
 
-	fff=fopen("/proc/cpuinfo","r");
-	if (fff==NULL) return -1;
+	if (log_file) {
+		/* Fill in the final record count */
+		fseek(log_file,0,SEEK_SET);
+		fwrite(&log_header,sizeof(log_header),1,log_file);
+		fclose(log_file);
+		log_file=NULL;
+	}
+}
 
-	while(1) {
-		result=fgets(buffer,BUFSIZ,fff);
-		if (result==NULL) break;
+/* With -S every sample is published to POSIX shared memory under a	*/
+/* seqlock, see rapl-shm.h, instead of being printed.  One sampler	*/
+/* can then feed any number of readers.				*/
+#if (RAPL_SHM_MAX_PACKAGES!=RAPL_MAX_PACKAGES) || \
+	(RAPL_SHM_NUM_DOMAINS!=RAPL_NUM_DOMAINS)
+#error rapl-shm.h does not match rapl-lib.h
+#endif
 
-		if (!strncmp(result,"vendor_id",8)) {
-			sscanf(result,"%*s%*s%s",vendor);
+static struct rapl_shm *shm=NULL;
+static char *shm_name=NULL;
 
-			if (strncmp(vendor,"GenuineIntel",12)) {
-				printf("%s not an Intel chip\n",vendor);
-				return -1;
-			}
-		}
+static int shm_publish_open(char *name, long long period_ns,
+				long long start_ns) {
 
-		if (!strncmp(result,"cpu family",10)) {
-			sscanf(result,"%*s%*s%*s%d",&family);
-			if (family!=6) {
-				printf("Wrong CPU family %d\n",family);
-				return -1;
-			}
-		}
+	int fd;
 
-		if (!strncmp(result,"model",5)) {
-			sscanf(result,"%*s%*s%d",&model);
-		}
+	fd=shm_open(name,O_RDWR|O_CREAT|O_TRUNC,0644);
+	if (fd<0) {
+		fprintf(stderr,"Error creating shared memory %s: %s\n",
+			name,strerror(errno));
+		return -1;
+	}
 
+	if (ftruncate(fd,sizeof(struct rapl_shm))<0) {
+		fprintf(stderr,"Error sizing shared memory %s: %s\n",
+			name,strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return -1;
 	}
 
-	fclose(fff);
+	shm=mmap(NULL,sizeof(struct rapl_shm),PROT_READ|PROT_WRITE,
+		MAP_SHARED,fd,0);
+	close(fd);
+	if (shm==MAP_FAILED) {
+		fprintf(stderr,"Error mapping shared memory %s: %s\n",
+			name,strerror(errno));
+		shm=NULL;
+		shm_unlink(name);
+		return -1;
+	}
 
-	printf("Found ");
+	shm->version=RAPL_SHM_VERSION;
+	shm->packages=rapl_total_packages;
+	shm->available=rapl_available;
+	shm->backend=rapl_backend;
+	shm->period_ns=period_ns;
+	shm->start_ns=start_ns;
+	memcpy(shm->units,rapl_units,sizeof(shm->units));
+	shm->seq=0;
 
-	switch(model) {
-		case CPU_SANDYBRIDGE:
-			printf("Sandybridge");
-			break;
-		case CPU_SANDYBRIDGE_EP:
-			printf("Sandybridge-EP");
-			break;
-		case CPU_IVYBRIDGE:
-			printf("Ivybridge");
-			available=PACKAGE|CORES|UNCORE;
-			break;
-		case CPU_IVYBRIDGE_EP:
-			printf("Ivybridge-EP");
-			break;
-		case CPU_HASWELL:
-			printf("Haswell");
-			break;
-		case CPU_HASWELL_EP:
-			printf("Haswell-EP");
-			available=PACKAGE|DRAM;
-			break;
-		case CPU_BROADWELL_EP:
-			printf("Broadwell-EP");
-			break;
-		case CPU_BROADWELL:
-			printf("Broadwell");
-			break;
-		case CPU_SKYLAKE:
-		case CPU_SKYLAKE_HS:
-			printf("Skylake");
-			break;
-		case CPU_SKYLAKE_X:
-			printf("Skylake-X");
-			break;
-		case CPU_KABYLAKE:
-		case CPU_KABYLAKE_2:
-			printf("Kaby Lake");
-			break;
-		case CPU_KNIGHTS_LANDING:
-			printf("Knight's Landing");
-			break;
-		default:
-			printf("Unsupported model %d\n",model);
-			model=-1;
-			break;
+	/* readers check the magic, so set it last */
+	__atomic_store_n(&shm->magic,RAPL_SHM_MAGIC,__ATOMIC_RELEASE);
+
+	shm_name=name;
+
+	return 0;
+}
+
+static void shm_publish(long long time_ns, long long interval_ns) {
+
+	struct rapl_shm_data *data=&shm->data;
+	uint64_t seq;
+	int d,j;
+
+	seq=shm->seq;
+	__atomic_store_n(&shm->seq,seq+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	data->sample++;
+	data->time_ns=time_ns;
+	data->interval_ns=interval_ns;
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			data->raw[j][d]=rapl_raw[j][d];
+			data->joules[j][d]=(double)(rapl_raw[j][d]-
+				first_raw[j][d])*rapl_units[j][d];
+			data->watts[j][d]=0.0;
+			if (interval_ns>0) {
+				data->watts[j][d]=(double)(rapl_raw[j][d]-
+					last_raw[j][d])*rapl_units[j][d]*
+					1000000000.0/interval_ns;
+			}
+		}
 	}
 
-	printf(" Processor type\n");
+	__atomic_store_n(&shm->seq,seq+2,__ATOMIC_RELEASE);
+}
 
-	return model;
+static void shm_publish_close(void) {
+
+	if (shm==NULL) return;
+
+	munmap(shm,sizeof(struct rapl_shm));
+	shm_unlink(shm_name);
+	shm=NULL;
 }
 
+/* With -e each sample waits for the package's energy counter to	*/
+/* tick and the window is measured edge to edge with the TSC.	*/
+/* The counters only update about once a millisecond, so at short	*/
+/* periods a window that doesn't start on an update is badly off.	*/
+static int edge_align=0;
+static int edge_timeouts=0;
+static double tsc_hz;
+static uint64_t edge_tsc[RAPL_MAX_PACKAGES],last_edge_tsc[RAPL_MAX_PACKAGES];
 
-static int total_cores=0,total_packages=0;
-static int package_map[MAX_PACKAGES];
+/* One TSC/CLOCK_MONOTONIC pair to put the edges on the log's clock */
+static uint64_t edge_tsc_ref;
+static long long edge_ns_ref;
 
-static int detect_packages(void) {
+static void read_package_edge(int j) {
 
-	char filename[BUFSIZ];
-	FILE *fff;
-	int package;
-	int i;
+	uint64_t lo,hi;
 
-	for(i=0;i<MAX_PACKAGES;i++) package_map[i]=-1;
+	if (rapl_wait_edge(j,&lo,&hi)<0) {
+		/* counter isn't moving, best we can do is now */
+		edge_timeouts++;
+		edge_tsc[j]=rapl_rdtsc();
+		return;
+	}
 
-	printf("\t");
-	for(i=0;i<MAX_CPUS;i++) {
-		sprintf(filename,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",i);
-		fff=fopen(filename,"r");
-		if (fff==NULL) break;
-		fscanf(fff,"%d",&package);
-		printf("%d (%d)",i,package);
-		if (i%8==7) printf("\n\t"); else printf(", ");
-		fclose(fff);
+	edge_tsc[j]=lo+(hi-lo)/2;
+}
 
-		if (package_map[package]==-1) {
-			total_packages++;
-			package_map[package]=i;
-		}
+/* When package j was sampled, on the same clock as now */
+static long long package_time_ns(int j, long long now) {
 
+	if (edge_align) {
+		return edge_ns_ref+(long long)((double)(int64_t)
+			(edge_tsc[j]-edge_tsc_ref)*1000000000.0/tsc_hz);
 	}
 
-	printf("\n");
+	return now;
+}
 
-	total_cores=i;
+/* Length of package j's last window in seconds */
+static double package_interval(int j, double ct, double lt) {
 
-	printf("\tDetected %d cores in %d packages\n\n",
-		total_cores,total_packages);
+	if (edge_align) {
+		return (double)(edge_tsc[j]-last_edge_tsc[j])/tsc_hz;
+	}
 
-	return 0;
+	return ct-lt;
 }
 
+/* With -T also show what percentage of each interval RAPL spent	*/
+/* throttling, from the *_PERF_STATUS MSRs.  These don't exist on	*/
+/* every model, so the columns are whatever the library found.	*/
+static int show_throttle=0;
+static uint64_t last_throttle[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+static const char *throttle_names[RAPL_NUM_DOMAINS]={
+	"PkgThr(%)\t",
+	"CoresThr(%)\t",
+	NULL,
+	"DRAMThr(%)\t",
+	NULL,
+};
 
-static double cpu_energy_units[MAX_PACKAGES],dram_energy_units[MAX_PACKAGES];
+/* With -P (AMD Family 17h+) also show the power of every physical	*/
+/* core, and the sum of them for each package.			*/
+static int per_core=0;
+static uint64_t last_core_raw[RAPL_MAX_CPUS];
 
-/*******************************/
-/* MSR code                    */
-/*******************************/
-static int rapl_detect_msr(int core, int cpu_model) {
+/* With -H also read instructions, cycles and LLC misses on every	*/
+/* CPU, and show package energy per instruction and per miss.	*/
+static int show_hw=0;
+static uint64_t last_hw[RAPL_MAX_PACKAGES][RAPL_HW_NUM];
 
-	int fd;
-	long long result;
-	double power_units,time_units;
+static const char *hw_names[RAPL_HW_NUM]={
+	"nJ/inst\t\t",
+	"IPC\t\t",
+	"nJ/miss\t\t",
+};
 
+/* Package energy if we have it, otherwise whatever is there */
+static int hw_energy_domain(void) {
 
-	double thermal_spec_power,minimum_power,maximum_power,time_window;
-	int j;
+	int d;
 
-	if (cpu_model<0) {
-		printf("\tUnsupported CPU model %d\n",cpu_model);
-		return -1;
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (rapl_available&(1<<d)) return d;
 	}
 
-	for(j=0;j<total_packages;j++) {
+	return RAPL_DOMAIN_PKG;
+}
+
+static double hw_ratio(double a, uint64_t b) {
 
-		fd=open_msr(package_map[j]);
+	if (b==0) return 0.0;
 
-		/* Calculate the units used */
-		result=read_msr(fd,MSR_RAPL_POWER_UNIT);
+	return a/(double)b;
+}
 
-		power_units=pow(0.5,(double)(result&0xf));
-		cpu_energy_units[j]=pow(0.5,(double)((result>>8)&0x1f));
-		time_units=pow(0.5,(double)((result>>16)&0xf));
+static void print_hw(int j) {
 
-		/* On Haswell EP and Knights Landing */
-		/* The DRAM units differ from the CPU ones */
-		if ((cpu_model==CPU_HASWELL_EP) ||
-				(cpu_model==CPU_BROADWELL_EP) ||
-				(cpu_model==CPU_SKYLAKE_X) ||
-				(cpu_model==CPU_KNIGHTS_LANDING)) {
-			dram_energy_units[j]=pow(0.5,(double)16);
-			printf("DRAM: Using %lf instead of %lf\n",
-				dram_energy_units[j],cpu_energy_units[j]);
-		}
-		else {
-			dram_energy_units[j]=cpu_energy_units[j];
-		}
+	uint64_t delta[RAPL_HW_NUM];
+	double nj;
+	int d,i;
 
+	d=hw_energy_domain();
+	nj=(double)(rapl_raw[j][d]-last_raw[j][d])*rapl_units[j][d]*1e9;
 
+	for(i=0;i<RAPL_HW_NUM;i++) delta[i]=rapl_hw_raw[j][i]-last_hw[j][i];
 
+	printf("%.4lf\t\t",hw_ratio(nj,delta[RAPL_HW_INSTRUCTIONS]));
+	if (rapl_hw_available&(1<<RAPL_HW_CYCLES)) {
+		printf("%.3lf\t\t",hw_ratio((double)delta[RAPL_HW_INSTRUCTIONS],
+				delta[RAPL_HW_CYCLES]));
+	}
+	if (rapl_hw_available&(1<<RAPL_HW_LLC_MISSES)) {
+		printf("%.3lf\t\t",hw_ratio(nj,delta[RAPL_HW_LLC_MISSES]));
+	}
+}
 
-		printf("\t\tPower units = %.3fW\n",power_units);
-		printf("\t\tCPU Energy units = %.8fJ\n",cpu_energy_units[j]);
-		printf("\t\tDRAM Energy units = %.8fJ\n",dram_energy_units[j]);
-		printf("\t\tTime units = %.8fs\n",time_units);
-		printf("\n");
+/* With -M also show each package's memory read and write traffic	*/
+/* from the IMC CAS counters, and DRAM energy per byte moved, for	*/
+/* comparing data layouts and NUMA placement.			*/
+static int show_imc=0;
+static uint64_t last_imc[RAPL_MAX_PACKAGES][RAPL_IMC_NUM];
 
-		/* Show package power info */
-		result=read_msr(fd,MSR_PKG_POWER_INFO);
-		thermal_spec_power=power_units*(double)(result&0x7fff);
-		printf("\t\tPackage thermal spec: %.3fW\n",thermal_spec_power);
-		minimum_power=power_units*(double)((result>>16)&0x7fff);
-		printf("\t\tPackage minimum power: %.3fW\n",minimum_power);
-		maximum_power=power_units*(double)((result>>32)&0x7fff);
-		printf("\t\tPackage maximum power: %.3fW\n",maximum_power);
-		time_window=time_units*(double)((result>>48)&0x7fff);
-		printf("\t\tPackage maximum time window: %.6fs\n",time_window);
-
-		/* Show package power limit */
-		result=read_msr(fd,MSR_PKG_RAPL_POWER_LIMIT);
-		printf("\t\tPackage power limits are %s\n", (result >> 63) ? "locked" : "unlocked");
-		double pkg_power_limit_1 = power_units*(double)((result>>0)&0x7FFF);
-		double pkg_time_window_1 = time_units*(double)((result>>17)&0x007F);
-		printf("\t\tPackage power limit #1: %.3fW for %.6fs (%s, %s)\n",
-			pkg_power_limit_1, pkg_time_window_1,
-			(result & (1LL<<15)) ? "enabled" : "disabled",
-			(result & (1LL<<16)) ? "clamped" : "not_clamped");
-		double pkg_power_limit_2 = power_units*(double)((result>>32)&0x7FFF);
-		double pkg_time_window_2 = time_units*(double)((result>>49)&0x007F);
-		printf("\t\tPackage power limit #2: %.3fW for %.6fs (%s, %s)\n", 
-			pkg_power_limit_2, pkg_time_window_2,
-			(result & (1LL<<47)) ? "enabled" : "disabled",
-			(result & (1LL<<48)) ? "clamped" : "not_clamped");
-
-		/* only available on *Bridge-EP */
-		if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP)) {
-			result=read_msr(fd,MSR_PKG_PERF_STATUS);
-			double acc_pkg_throttled_time=(double)result*time_units;
-			printf("\tAccumulated Package Throttled Time : %.6fs\n",
-				acc_pkg_throttled_time);
-		}
-
-		/* only available on *Bridge-EP */
-		if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP)) {
-			result=read_msr(fd,MSR_PP0_PERF_STATUS);
-			double acc_pp0_throttled_time=(double)result*time_units;
-			printf("\tPowerPlane0 (core) Accumulated Throttled Time "
-				": %.6fs\n",acc_pp0_throttled_time);
-
-			result=read_msr(fd,MSR_PP0_POLICY);
-			int pp0_policy=(int)result&0x001f;
-			printf("\tPowerPlane0 (core) for core %d policy: %d\n",core,pp0_policy);
-
-		}
-
-
-		if ((cpu_model==CPU_SANDYBRIDGE) || (cpu_model==CPU_IVYBRIDGE) ||
-			(cpu_model==CPU_HASWELL) || (cpu_model==CPU_BROADWELL)) {
-
-			result=read_msr(fd,MSR_PP1_POLICY);
-			int pp1_policy=(int)result&0x001f;
-			printf("\tPowerPlane1 (on-core GPU if avail) %d policy: %d\n",
-				core,pp1_policy);
-		}
-		close(fd);
+static void print_imc(int j, double interval) {
 
+	double bytes[RAPL_IMC_NUM],total=0.0;
+	int e;
+
+	for(e=0;e<RAPL_IMC_NUM;e++) {
+		bytes[e]=(double)(rapl_imc_raw[j][e]-last_imc[j][e])*
+			rapl_imc_units[e];
+		total+=bytes[e];
+		printf("%.3lf\t\t",bytes[e]/interval/1e9);
 	}
-	printf("\n");
 
-	return 0;
+	if (rapl_available&(1<<RAPL_DOMAIN_DRAM)) {
+		printf("%.4lf\t\t",hw_ratio((double)(rapl_raw[j][RAPL_DOMAIN_DRAM]-
+			last_raw[j][RAPL_DOMAIN_DRAM])*
+			rapl_units[j][RAPL_DOMAIN_DRAM]*1e9,(uint64_t)total));
+	}
 }
 
+/* With -F also show each package's effective frequency, how busy	*/
+/* its CPUs were and the temperatures; -f adds the same for every	*/
+/* CPU.  Frequency is averaged over busy time only.		*/
+static int show_freq=0,per_cpu_freq=0;
+static uint64_t last_aperf[RAPL_MAX_CPUS],last_mperf[RAPL_MAX_CPUS];
+static uint64_t last_freq_tsc;
 
-static int rapl_msr(int core, int cpu_model) {
+static void print_freq_columns(double aperf, double mperf, int cpus) {
 
-	int fd;
-	long long result;
+	double tsc=(double)(rapl_cpu_tsc-last_freq_tsc);
 
-	int j;
+	if (!(rapl_freq_available&RAPL_FREQ_APERF)) return;
 
-	for(j=0;j<total_packages;j++) {
+	if (mperf>0.0) printf("%.0lf\t\t",tsc_hz*aperf/mperf/1000000.0);
+	else printf("0\t\t");
+	if ((tsc>0.0) && (cpus>0)) printf("%.1lf\t\t",mperf*100.0/(tsc*cpus));
+	else printf("0.0\t\t");
+}
 
-		fd=open_msr(package_map[j]);
+static void print_freq(int j) {
 
-		/* Package Energy */
-		result=read_msr(fd,MSR_PKG_ENERGY_STATUS);
-		package_energy[j]=(double)result*cpu_energy_units[j];
+	double aperf=0.0,mperf=0.0;
+	int i,cpus=0,max_temp=0;
 
-		/* PP0 energy */
-		/* Not available on Haswell-EP? */
-		result=read_msr(fd,MSR_PP0_ENERGY_STATUS);
-		cores_energy[j]=(double)result*cpu_energy_units[j];
+	for(i=0;i<rapl_cpu_count;i++) {
+		if (rapl_cpu_package[i]!=j) continue;
+		aperf+=(double)(rapl_cpu_aperf[i]-last_aperf[i]);
+		mperf+=(double)(rapl_cpu_mperf[i]-last_mperf[i]);
+		if (rapl_cpu_temp[i]>max_temp) max_temp=rapl_cpu_temp[i];
+		cpus++;
+	}
 
-		/* PP1 energy */
-		/* not available on *Bridge-EP */
-		if ((cpu_model==CPU_SANDYBRIDGE) || (cpu_model==CPU_IVYBRIDGE) ||
-			(cpu_model==CPU_HASWELL) || (cpu_model==CPU_BROADWELL) ||
-			(cpu_model==CPU_SKYLAKE) || (cpu_model==CPU_SKYLAKE_HS) ||
-			(cpu_model==CPU_KABYLAKE) || (cpu_model==CPU_KABYLAKE_2)) {
+	print_freq_columns(aperf,mperf,cpus);
+	if (rapl_freq_available&RAPL_FREQ_PKG_TEMP) {
+		printf("%d\t\t",rapl_package_temp[j]);
+	}
+	if (rapl_freq_available&RAPL_FREQ_CORE_TEMP) {
+		printf("%d\t\t",max_temp);
+	}
+}
+
+static void print_cpu_freq(void) {
+
+	int i;
 
-	 		result=read_msr(fd,MSR_PP1_ENERGY_STATUS);
-			uncore_energy[j]=(double)result*cpu_energy_units[j];
+	for(i=0;i<rapl_cpu_count;i++) {
+		print_freq_columns((double)(rapl_cpu_aperf[i]-last_aperf[i]),
+			(double)(rapl_cpu_mperf[i]-last_mperf[i]),1);
+		if (rapl_freq_available&RAPL_FREQ_CORE_TEMP) {
+			printf("%d\t\t",rapl_cpu_temp[i]);
 		}
+	}
+}
 
+static void freq_save(void) {
 
-		/* Updated documentation (but not the Vol3B) says Haswell and	*/
-		/* Broadwell have DRAM support too				*/
-		if ((cpu_model==CPU_SANDYBRIDGE_EP) ||
-			(cpu_model==CPU_IVYBRIDGE_EP) ||
-			(cpu_model==CPU_HASWELL_EP) ||
-			(cpu_model==CPU_BROADWELL_EP) ||
-			(cpu_model==CPU_SKYLAKE_X) ||
-			(cpu_model==CPU_HASWELL) ||
-			(cpu_model==CPU_BROADWELL) ||
-			(cpu_model==CPU_SKYLAKE) ||
-			(cpu_model==CPU_SKYLAKE_HS) ||
-			(cpu_model==CPU_KABYLAKE) ||
-			(cpu_model==CPU_KABYLAKE_2)) {
+	memcpy(last_aperf,rapl_cpu_aperf,rapl_cpu_count*sizeof(uint64_t));
+	memcpy(last_mperf,rapl_cpu_mperf,rapl_cpu_count*sizeof(uint64_t));
+	last_freq_tsc=rapl_cpu_tsc;
+}
+
+/* With -I also show how much of each interval every package spent	*/
+/* in each of its C-states, and its CPUs' cores on average, next	*/
+/* to its power, to tell apart idle that's deep from idle that	*/
+/* isn't.								*/
+static int show_cstate=0;
+static uint64_t last_pkg_cstate[RAPL_MAX_PACKAGES][RAPL_NUM_PKG_CSTATES];
+static uint64_t last_core_cstate[RAPL_MAX_CPUS][RAPL_NUM_CORE_CSTATES];
+static uint64_t last_cstate_tsc;
+
+static void print_cstate_columns(int j) {
+
+	int s;
 
-			result=read_msr(fd,MSR_DRAM_ENERGY_STATUS);
-			dram_energy[j]=(double)result*dram_energy_units[j];
+	for(s=0;s<RAPL_NUM_PKG_CSTATES;s++) {
+		if (rapl_pkg_cstate_available&(1<<s)) {
+			printf("%s_%d(%%)\t",rapl_pkg_cstate_name(s),j);
 		}
+	}
+	for(s=0;s<RAPL_NUM_CORE_CSTATES;s++) {
+		if (rapl_core_cstate_available&(1<<s)) {
+			printf("%s_%d(%%)\t",rapl_core_cstate_name(s),j);
+		}
+	}
+}
+
+static void print_cstate(int j) {
+
+	double tsc=(double)(rapl_cstate_tsc-last_cstate_tsc);
+	double residency;
+	int i,s,cpus;
 
-		/* PSys is Skylake+ */
-		if ((cpu_model==CPU_SKYLAKE) || (cpu_model==CPU_SKYLAKE_HS) ||
-			(cpu_model==CPU_KABYLAKE) || (cpu_model==CPU_KABYLAKE_2)) {
+	if (tsc<=0.0) tsc=1.0;
 
-			result=read_msr(fd,MSR_PLATFORM_ENERGY_STATUS);
-			psys_energy[j]=(double)result*cpu_energy_units[j];
+	for(s=0;s<RAPL_NUM_PKG_CSTATES;s++) {
+		if (!(rapl_pkg_cstate_available&(1<<s))) continue;
+		printf("%.2lf\t\t",(double)(rapl_pkg_cstate_raw[j][s]-
+			last_pkg_cstate[j][s])*100.0/tsc);
+	}
+
+	for(s=0;s<RAPL_NUM_CORE_CSTATES;s++) {
+		if (!(rapl_core_cstate_available&(1<<s))) continue;
+		residency=0.0;
+		cpus=0;
+		for(i=0;i<rapl_cstate_cpu_count;i++) {
+			if (rapl_cstate_cpu_package[i]!=j) continue;
+			residency+=(double)(rapl_core_cstate_raw[i][s]-
+				last_core_cstate[i][s]);
+			cpus++;
 		}
+		if (cpus) residency/=cpus;
+		printf("%.2lf\t\t",residency*100.0/tsc);
+	}
+}
 
+static void cstate_save(void) {
 
-		close(fd);
+	memcpy(last_pkg_cstate,rapl_pkg_cstate_raw,sizeof(rapl_pkg_cstate_raw));
+	memcpy(last_core_cstate,rapl_core_cstate_raw,
+		rapl_cstate_cpu_count*sizeof(rapl_core_cstate_raw[0]));
+	last_cstate_tsc=rapl_cstate_tsc;
+}
+
+/* With -D sec keep the distribution of every domain's power in	*/
+/* fixed memory for the whole run, plus the last 1s, 10s and 60s,	*/
+/* and print them to stderr every sec seconds and at exit.  Long	*/
+/* runs then don't need their text output post-processed.		*/
+#define NUM_WINDOWS	3
+
+static const long long window_ns[NUM_WINDOWS]={
+	1000000000LL,10000000000LL,60000000000LL,
+};
+static const char *window_names[NUM_WINDOWS]={"1s","10s","60s"};
+
+static int show_stats=0;
+static long long stats_period_ns=0,stats_next_ns=0,stats_start_ns;
+static struct rapl_stats *power_stats[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+static struct rapl_window power_windows[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS]
+					[NUM_WINDOWS];
+
+static int stats_open(long long now) {
+
+	int d,j,w;
+
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!(rapl_available&(1<<d))) continue;
+			power_stats[j][d]=malloc(sizeof(struct rapl_stats));
+			if (power_stats[j][d]==NULL) {
+				fprintf(stderr,"Out of memory\n");
+				return -1;
+			}
+			rapl_stats_init(power_stats[j][d]);
+			for(w=0;w<NUM_WINDOWS;w++) {
+				rapl_window_init(&power_windows[j][d][w],
+					window_ns[w]);
+			}
+		}
 	}
 
+	stats_start_ns=now;
+	stats_next_ns=now+stats_period_ns;
 
 	return 0;
 }
 
-static int perf_event_open(struct perf_event_attr *hw_event_uptr,
-                    pid_t pid, int cpu, int group_fd, unsigned long flags) {
+static void stats_update(long long now, int j, int d, double watts) {
 
-        return syscall(__NR_perf_event_open,hw_event_uptr, pid, cpu,
-                        group_fd, flags);
+	int w;
+
+	rapl_stats_add(power_stats[j][d],watts);
+	for(w=0;w<NUM_WINDOWS;w++) {
+		rapl_window_add(&power_windows[j][d][w],now,watts);
+	}
 }
 
-#define NUM_RAPL_DOMAINS	5
+static void stats_report(long long now) {
+
+	struct rapl_stats *stats;
+	double mean,min,max;
+	int d,j,w;
+
+	fprintf(stderr,"\nPower at %.3fs\n",
+		(double)(now-stats_start_ns)/1000000000.0);
+
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			stats=power_stats[j][d];
+			if (stats==NULL) continue;
+			fprintf(stderr,"Package %d %-4s %llu samples: mean %.3fW, "
+				"min %.3fW, p50 %.3fW, p90 %.3fW, p99 %.3fW, "
+				"p99.9 %.3fW, max %.3fW\n",
+				j,rapl_domain_name(d),
+				(unsigned long long)stats->count,
+				rapl_stats_mean(stats),stats->min,
+				rapl_stats_quantile(stats,0.50),
+				rapl_stats_quantile(stats,0.90),
+				rapl_stats_quantile(stats,0.99),
+				rapl_stats_quantile(stats,0.999),
+				stats->max);
+			fprintf(stderr,"\t\t");
+			for(w=0;w<NUM_WINDOWS;w++) {
+				rapl_window_get(&power_windows[j][d][w],now,
+					&mean,&min,&max);
+				fprintf(stderr,"%s%s %.3f/%.3f/%.3fW",
+					w?", ":"last ",window_names[w],
+					mean,min,max);
+			}
+			fprintf(stderr," (mean/min/max)\n");
+		}
+	}
+}
+
+static void stats_close(void) {
+
+	int d,j;
 
-char rapl_domain_names[NUM_RAPL_DOMAINS][30]= {
-	"energy-cores",
-	"energy-gpu",
-	"energy-pkg",
-	"energy-ram",
-	"energy-psys",
+	for(j=0;j<RAPL_MAX_PACKAGES;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			free(power_stats[j][d]);
+			power_stats[j][d]=NULL;
+		}
+	}
+}
+
+static void sample_package(int j) {
+
+	if (edge_align) read_package_edge(j);
+	else rapl_read_package(j);
+
+	if (show_throttle) rapl_throttle_read_package(j);
+}
+
+static volatile sig_atomic_t done=0;
+
+/* With -C we first measure what sampling costs in energy: idle,	*/
+/* then sampling at the real period, then idle again.  The extra	*/
+/* package and core power over the average idle is the sampler's,	*/
+/* and is subtracted in the compensated columns.  Do this on an	*/
+/* otherwise idle system or the difference is just noise.		*/
+static int calibrated=0;
+static double overhead_watts[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+
+static const char *compensated_names[RAPL_NUM_DOMAINS]={
+	"PkgComp(W)\t",
+	"CoresComp(W)\t",
+	NULL,
+	NULL,
+	NULL,
 };
 
+static int compensated_domain(int d) {
+
+	return ((calibrated) && (compensated_names[d]) &&
+		(rapl_available&(1<<d)));
+}
 
-static int check_paranoid(void) {
+/* Sample every period_ns for duration_ns and return average power */
+static void calibrate_phase(long long duration_ns, long long period_ns,
+		double watts[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS]) {
 
-	int paranoid_value;
-	FILE *fff;
+	uint64_t start_raw[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	struct timespec deadline_ts;
+	long long start,deadline,end;
+	double seconds;
+	int d,j;
 
-	fff=fopen("/proc/sys/kernel/perf_event_paranoid","r");
-	if (fff==NULL) {
-		fprintf(stderr,"Error! could not open /proc/sys/kernel/perf_event_paranoid %s\n",
-			strerror(errno));
+	/* MSR still has to be polled often enough to not miss a wrap */
+	if ((rapl_backend==RAPL_BACKEND_MSR) &&
+		(period_ns>rapl_msr_wrap_poll_ns)) {
+		period_ns=rapl_msr_wrap_poll_ns;
+	}
 
-		/* We can't return a negative value as that implies no paranoia */
-		return 500;
+	start=rapl_monotonic_ns();
+	for(j=0;j<rapl_total_packages;j++) sample_package(j);
+	memcpy(start_raw,rapl_raw,sizeof(rapl_raw));
+
+	end=start+duration_ns;
+	deadline=start;
+	while(!done) {
+		deadline+=period_ns;
+		if (deadline>end) deadline=end;
+		deadline_ts.tv_sec=deadline/1000000000LL;
+		deadline_ts.tv_nsec=deadline%1000000000LL;
+		while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,
+				&deadline_ts,NULL)==EINTR) {
+			if (done) break;
+		}
+		for(j=0;j<rapl_total_packages;j++) sample_package(j);
+		if (deadline>=end) break;
 	}
 
-	fscanf(fff,"%d",&paranoid_value);
-	fclose(fff);
+	seconds=(double)(rapl_monotonic_ns()-start)/1000000000.0;
+	for(j=0;j<rapl_total_packages;j++) {
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			watts[j][d]=(double)(rapl_raw[j][d]-start_raw[j][d])*
+				rapl_units[j][d]/seconds;
+		}
+	}
+}
 
-	return paranoid_value;
+static void calibrate(long long duration_ns, long long period_ns) {
+
+	double idle_before[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	double sampling[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	double idle_after[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	double idle;
+	int d,j,found;
+
+	printf("Calibrating sampler overhead, %.1fs idle, %.1fs sampling, "
+		"%.1fs idle\n",(double)duration_ns/1000000000.0,
+		(double)duration_ns/1000000000.0,
+		(double)duration_ns/1000000000.0);
+
+	calibrate_phase(duration_ns,duration_ns,idle_before);
+	calibrate_phase(duration_ns,period_ns,sampling);
+	calibrate_phase(duration_ns,duration_ns,idle_after);
+
+	for(j=0;j<rapl_total_packages;j++) {
+		printf("\tPackage %d:",j);
+		found=0;
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!compensated_names[d]) continue;
+			if (!(rapl_available&(1<<d))) continue;
+			found++;
+			idle=(idle_before[j][d]+idle_after[j][d])/2.0;
+			overhead_watts[j][d]=sampling[j][d]-idle;
+			printf(" %s idle %.3fW sampling %.3fW overhead %.3fW",
+				rapl_domain_name(d),idle,sampling[j][d],
+				overhead_watts[j][d]);
+			/* Below the noise, don't make things worse */
+			if (overhead_watts[j][d]<0.0) overhead_watts[j][d]=0.0;
+		}
+		if (!found) printf(" no package or core energy to compensate");
+		printf("\n");
+	}
+	printf("\n");
 
+	calibrated=1;
 }
 
-static int type;
-static double scale[NUM_RAPL_DOMAINS];
-static char units[NUM_RAPL_DOMAINS][BUFSIZ];
-static int config[NUM_RAPL_DOMAINS];
-static int paranoid_value;
-static int fd[NUM_RAPL_DOMAINS][MAX_PACKAGES];
-static long long value;
+/* With -t each package gets its own sampler thread pinned to a CPU	*/
+/* in that package.  Reading another socket's MSR (or perf event)	*/
+/* costs a cross-socket IPI, so without this package 0 is sampled	*/
+/* noticeably earlier than the last package.				*/
+/* All threads sleep to the same absolute deadline; the two barriers	*/
+/* hand the deadline out and collect the results each sample.	*/
+struct package_thread {
+	pthread_t thread;
+	int package;
+	int cpu;
+	long long sample_ns;
+	long long cost_ns;
+};
 
-static int rapl_perf_detect(int core) {
+static struct package_thread package_threads[RAPL_MAX_PACKAGES];
+static pthread_barrier_t start_barrier,done_barrier;
+static long long thread_deadline;
+static int threads_exit=0;
 
-	FILE *fff;
+static long long skew_count=0;
+static double skew_total=0.0,skew_min=0.0,skew_max=0.0;
 
-	char filename[BUFSIZ];
-	struct perf_event_attr attr;
+static void *package_sampler(void *arg) {
 
-	int i,j;
+	struct package_thread *pt=arg;
+	struct timespec deadline_ts;
+	cpu_set_t mask;
+	long long before;
 
-	fff=fopen("/sys/bus/event_source/devices/power/type","r");
-	if (fff==NULL) {
-		printf("\tNo perf_event rapl support found (requires Linux 3.14)\n");
-		printf("\tFalling back to raw msr support\n\n");
-		return -1;
+	CPU_ZERO(&mask);
+	CPU_SET(pt->cpu,&mask);
+	if (pthread_setaffinity_np(pthread_self(),sizeof(mask),&mask)!=0) {
+		fprintf(stderr,"Could not pin package %d sampler to CPU %d\n",
+			pt->package,pt->cpu);
 	}
-	fscanf(fff,"%d",&type);
-	fclose(fff);
 
-	for(i=0;i<NUM_RAPL_DOMAINS;i++) {
+	while(1) {
+		pthread_barrier_wait(&start_barrier);
+		if (threads_exit) break;
 
-		sprintf(filename,"/sys/bus/event_source/devices/power/events/%s",
-			rapl_domain_names[i]);
+		deadline_ts.tv_sec=thread_deadline/1000000000LL;
+		deadline_ts.tv_nsec=thread_deadline%1000000000LL;
+		while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,
+				&deadline_ts,NULL)==EINTR);
 
-		fff=fopen(filename,"r");
+		before=rapl_monotonic_ns();
+		sample_package(pt->package);
+		pt->sample_ns=before;
+		pt->cost_ns=rapl_monotonic_ns()-before;
 
-		if (fff!=NULL) {
-			fscanf(fff,"event=%x",&config[i]);
-			printf("\tType=%d Event=%s Config=%d ",type,
-				rapl_domain_names[i],config[i]);
-			fclose(fff);
-		} else {
-			continue;
-		}
+		pthread_barrier_wait(&done_barrier);
+	}
 
-		sprintf(filename,"/sys/bus/event_source/devices/power/events/%s.scale",
-			rapl_domain_names[i]);
-		fff=fopen(filename,"r");
+	return NULL;
+}
 
-		if (fff!=NULL) {
-			fscanf(fff,"%lf",&scale[i]);
-			printf("scale=%g ",scale[i]);
-			fclose(fff);
-		}
+static int package_threads_start(void) {
 
-		sprintf(filename,"/sys/bus/event_source/devices/power/events/%s.unit",
-			rapl_domain_names[i]);
-		fff=fopen(filename,"r");
+	sigset_t block,old;
+	int j;
 
-		if (fff!=NULL) {
-			fscanf(fff,"%s",units[i]);
-			printf("units=%s ",units[i]);
-			fclose(fff);
+	pthread_barrier_init(&start_barrier,NULL,rapl_total_packages+1);
+	pthread_barrier_init(&done_barrier,NULL,rapl_total_packages+1);
+
+	/* Keep SIGINT going to the main thread */
+	sigemptyset(&block);
+	sigaddset(&block,SIGINT);
+	sigaddset(&block,SIGTERM);
+	pthread_sigmask(SIG_BLOCK,&block,&old);
+
+	for(j=0;j<rapl_total_packages;j++) {
+		package_threads[j].package=j;
+		package_threads[j].cpu=rapl_package_map[j];
+		if (pthread_create(&package_threads[j].thread,NULL,
+				package_sampler,&package_threads[j])!=0) {
+			fprintf(stderr,"Error creating sampler thread %d\n",j);
+			exit(-1);
 		}
-
-		printf("\n");
 	}
 
-	for(j=0;j<total_packages;j++) {
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
 
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
+	return 0;
+}
 
-			fd[i][j]=-1;
+/* Have every package sample at the deadline, returns the earliest	*/
+/* sample time and fills in the spread between packages.		*/
+static long long package_threads_sample(long long deadline,
+					long long *skew, long long *cost) {
 
-			memset(&attr,0x0,sizeof(attr));
-			attr.type=type;
-			attr.config=config[i];
-			if (config[i]==0) continue;
+	long long first,last;
+	int j;
 
-			fd[i][j]=perf_event_open(&attr,-1, package_map[j],-1,0);
-			if (fd[i][j]<0) {
-				if (errno==EACCES) {
-					paranoid_value=check_paranoid();
-					if (paranoid_value>0) {
-						printf("\t/proc/sys/kernel/perf_event_paranoid is %d\n",paranoid_value);
-						printf("\tThe value must be 0 or lower to read system-wide RAPL values\n");
-					}
+	thread_deadline=deadline;
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&done_barrier);
 
-					printf("\tPermission denied; run as root or adjust paranoid value\n\n");
-					return -1;
-				}
-				else {
-					printf("\terror opening core %d config %d: %s\n\n",
-						package_map[j], config[i], strerror(errno));
-					return -1;
-				}
-			}
+	first=last=package_threads[0].sample_ns;
+	*cost=package_threads[0].cost_ns;
+	for(j=1;j<rapl_total_packages;j++) {
+		if (package_threads[j].sample_ns<first) {
+			first=package_threads[j].sample_ns;
+		}
+		if (package_threads[j].sample_ns>last) {
+			last=package_threads[j].sample_ns;
+		}
+		if (package_threads[j].cost_ns>*cost) {
+			*cost=package_threads[j].cost_ns;
 		}
 	}
 
-	return 0;
+	*skew=last-first;
+
+	return first;
 }
 
+static void package_threads_stop(void) {
 
-static int rapl_perf(int core) {
+	int j;
 
-	int i,j;
+	threads_exit=1;
+	pthread_barrier_wait(&start_barrier);
 
+	for(j=0;j<rapl_total_packages;j++) {
+		pthread_join(package_threads[j].thread,NULL);
+	}
 
-	for(j=0;j<total_packages;j++) {
+	pthread_barrier_destroy(&start_barrier);
+	pthread_barrier_destroy(&done_barrier);
+}
 
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
+static void skew_update(long long skew_ns) {
 
-			if (fd[i][j]!=-1) {
-				lseek(fd[i][j],0,SEEK_SET);
-				read(fd[i][j],&value,8);
-//				close(fd[i][j]);
+	double skew_us=(double)skew_ns/1000.0;
 
-				if (!strcmp("energy-pkg",rapl_domain_names[i])) {
-					package_energy[j]=(double)value*scale[i];
-				}
-				else if (!strcmp("energy-cores",rapl_domain_names[i])) {
-					cores_energy[j]=(double)value*scale[i];
-				}
-				else if (!strcmp("energy-gpu",rapl_domain_names[i])) {
-					uncore_energy[j]=(double)value*scale[i];
-				}
-				else if (!strcmp("energy-ram",rapl_domain_names[i])) {
-					dram_energy[j]=(double)value*scale[i];
-				}
-				else if (!strcmp("energy-psys",rapl_domain_names[i])) {
-					psys_energy[j]=(double)value*scale[i];
-				}
-				else {
-					printf("Unknown %s\n",rapl_domain_names[i]);
-				}
+	if ((skew_count==0) || (skew_us<skew_min)) skew_min=skew_us;
+	if ((skew_count==0) || (skew_us>skew_max)) skew_max=skew_us;
+	skew_total+=skew_us;
+	skew_count++;
+}
 
-			}
+static void skew_report(void) {
 
-		}
+	if (skew_count==0) return;
+
+	fprintf(stderr,"Cross-package skew over %lld samples: "
+		"min %.3fus, mean %.3fus, max %.3fus\n",
+		skew_count,skew_min,skew_total/skew_count,skew_max);
+}
+
+/* -L package:domain:limit:watts[:seconds] sets a power limit for	*/
+/* the run; the originals are put back when we exit, including on	*/
+/* SIGINT/SIGTERM/SIGHUP.  package can be "all".			*/
+#define MAX_LIMITS	16
+
+struct limit_request {
+	int package;		/* -1 for all */
+	int domain;
+	int limit;
+	double watts;
+	double seconds;
+};
 
+static struct limit_request limits[MAX_LIMITS];
+static int num_limits=0;
+
+static int parse_limit(char *spec) {
+
+	struct limit_request *req;
+	char copy[BUFSIZ];
+	char *fields[6],*end;
+	int n=0,d;
+	long package;
+
+	if (num_limits>=MAX_LIMITS) {
+		fprintf(stderr,"Too many -L limits, max is %d\n",MAX_LIMITS);
+		return -1;
 	}
 
-	return 0;
-}
+	strncpy(copy,spec,sizeof(copy)-1);
+	copy[sizeof(copy)-1]=0;
 
-static int rapl_sysfs(int core) {
+	/* one spare slot so a sixth field shows up */
+	fields[n]=strtok(copy,":");
+	while((fields[n]) && (n<5)) fields[++n]=strtok(NULL,":");
+	if ((n<4) || ((n==5) && (fields[5]))) {
+		fprintf(stderr,"Invalid limit %s, "
+			"want package:domain:limit:watts[:seconds]\n",spec);
+		return -1;
+	}
 
-	char event_names[MAX_PACKAGES][NUM_RAPL_DOMAINS][256];
-	char filenames[MAX_PACKAGES][NUM_RAPL_DOMAINS][256];
-	char basename[MAX_PACKAGES][256];
-	char tempfile[256];
-	long long before[MAX_PACKAGES][NUM_RAPL_DOMAINS];
-	int valid[MAX_PACKAGES][NUM_RAPL_DOMAINS];
-	int i,j;
-	FILE *fff;
-
-	/* /sys/class/powercap/intel-rapl/intel-rapl:0/ */
-	/* name has name */
-	/* energy_uj has energy */
-	/* subdirectories intel-rapl:0:0 intel-rapl:0:1 intel-rapl:0:2 */
-
-	for(j=0;j<total_packages;j++) {
-		i=0;
-		sprintf(basename[j],"/sys/class/powercap/intel-rapl/intel-rapl:%d",
-			j);
-		sprintf(tempfile,"%s/name",basename[j]);
-		fff=fopen(tempfile,"r");
-		if (fff==NULL) {
-			fprintf(stderr,"\tCould not open %s\n",tempfile);
+	req=&limits[num_limits];
+
+	if (!strcmp(fields[0],"all")) req->package=-1;
+	else {
+		package=strtol(fields[0],&end,10);
+		if ((*end) || (package<0)) {
+			fprintf(stderr,"Invalid package %s, "
+				"want a number or all\n",fields[0]);
 			return -1;
 		}
-		fscanf(fff,"%s",event_names[j][i]);
-		valid[j][i]=1;
-		fclose(fff);
-		sprintf(filenames[j][i],"%s/energy_uj",basename[j]);
-
-		/* Handle subdomains */
-		for(i=1;i<NUM_RAPL_DOMAINS;i++) {
-			sprintf(tempfile,"%s/intel-rapl:%d:%d/name",
-				basename[j],j,i-1);
-			fff=fopen(tempfile,"r");
-			if (fff==NULL) {
-				//fprintf(stderr,"\tCould not open %s\n",tempfile);
-				valid[j][i]=0;
-				continue;
-			}
-			valid[j][i]=1;
-			fscanf(fff,"%s",event_names[j][i]);
-			fclose(fff);
-			sprintf(filenames[j][i],"%s/intel-rapl:%d:%d/energy_uj",
-				basename[j],j,i-1);
-
+		if (package>=rapl_total_packages) {
+			fprintf(stderr,"No package %ld\n",package);
+			return -1;
 		}
+		req->package=package;
 	}
 
-	/* Gather before values */
-	for(j=0;j<total_packages;j++) {
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-			if (valid[j][i]) {
-				fff=fopen(filenames[j][i],"r");
-				if (fff==NULL) {
-					fprintf(stderr,"\tError opening %s!\n",filenames[j][i]);
-				}
-				else {
-					fscanf(fff,"%lld",&before[j][i]);
-					fclose(fff);
-				}
-			}
+	req->domain=-1;
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (!strcasecmp(fields[1],rapl_domain_name(d))) req->domain=d;
+	}
+	if (req->domain<0) {
+		fprintf(stderr,"Unknown domain %s\n",fields[1]);
+		return -1;
+	}
+
+	/* PL1 on everything but PSys, PL2 only on the package */
+	if (req->domain==RAPL_DOMAIN_PSYS) {
+		fprintf(stderr,"PSYS has no power limit\n");
+		return -1;
+	}
+	req->limit=strtol(fields[2],&end,10);
+	if ((*end) || ((req->limit!=1) &&
+		((req->limit!=2) || (req->domain!=RAPL_DOMAIN_PKG)))) {
+		fprintf(stderr,"Invalid limit %s for %s, want 1%s\n",
+			fields[2],rapl_domain_name(req->domain),
+			(req->domain==RAPL_DOMAIN_PKG)?" or 2":"");
+		return -1;
+	}
+
+	req->watts=strtod(fields[3],&end);
+	if ((*end) || (req->watts<=0.0)) {
+		fprintf(stderr,"Invalid power %s\n",fields[3]);
+		return -1;
+	}
+
+	req->seconds=0.0;
+	if (fields[4]) {
+		req->seconds=strtod(fields[4],&end);
+		if ((*end) || (req->seconds<0.0)) {
+			fprintf(stderr,"Invalid time window %s\n",fields[4]);
+			return -1;
 		}
 	}
 
-	for(j=0;j<total_packages;j++) {
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-			if (valid[j][i]) {
-				if (!strncmp("package",event_names[j][i],7)) {
-					package_energy[j]=before[j][i]/1000000.0;
-				}
-				else if (!strcmp("core",event_names[j][i])) {
-					cores_energy[j]=before[j][i]/1000000.0;
-				}
-				else if (!strcmp("uncore",event_names[j][i])) {
-					uncore_energy[j]=before[j][i]/1000000.0;
-				}
-				else if (!strcmp("dram",event_names[j][i])) {
-					dram_energy[j]=before[j][i]/1000000.0;
-				}
-				else {
-					printf("Unknown %s\n",event_names[j][i]);
-				}
+	num_limits++;
+
+	return 0;
+}
+
+static int apply_limits(void) {
+
+	struct limit_request *req;
+	double old_watts,old_seconds,watts,seconds;
+	int enabled,locked;
+	int i,j;
+
+	for(i=0;i<num_limits;i++) {
+		req=&limits[i];
+		for(j=0;j<rapl_total_packages;j++) {
+			if ((req->package>=0) && (req->package!=j)) continue;
+
+			if (rapl_limit_get(j,req->domain,req->limit,
+				&old_watts,&old_seconds,&enabled,&locked)<0) {
+				fprintf(stderr,"Could not read package %d %s "
+					"power limit #%d\n",j,
+					rapl_domain_name(req->domain),req->limit);
+				return -1;
 			}
+			if (rapl_limit_set(j,req->domain,req->limit,
+					req->watts,req->seconds)<0) {
+				return -1;
+			}
+			rapl_limit_get(j,req->domain,req->limit,
+				&watts,&seconds,&enabled,&locked);
+
+			printf("Package %d %s power limit #%d: %.3fW for %.6fs "
+				"(was %.3fW for %.6fs)\n",
+				j,rapl_domain_name(req->domain),req->limit,
+				watts,seconds,old_watts,old_seconds);
 		}
 	}
+	printf("\n");
 
 	return 0;
-
 }
 
+static void sigint_handler(int signum) {
+
+	done=1;
+}
 
+static struct option long_options[]={
+	{"bench-backends",	no_argument,	NULL,	'B'},
+	{NULL,			0,		NULL,	0},
+};
 
 int main(int argc, char **argv) {
 
 	int c;
 	int force_msr=0,force_perf_event=0,force_sysfs=0;
-	int core=0;
+	int cheapest=0,bench_backends=0;
 	int result=-1;
 	int cpu_model;
-	int use_sysfs=0,use_perf_event=0,use_msr=0;
-	int j;
+	int d,i,j;
 	int first_time=1;
-
-	struct timeval current_time;
+	long long max_samples=0,samples=0;
+	int use_threads=0;
+	double interval;
+	char *log_filename=NULL;
+	char *publish_name=NULL;
+	int text_output;
+	long long last_ns;
+	uint64_t log_capacity=0;
+	long long skew=0,cost;
+	long long calibrate_ns=0;
+	double core_sum[RAPL_MAX_PACKAGES];
+	char *limit_specs[MAX_LIMITS+1];
+	int num_limit_specs=0;
+	double watts;
+
+	long long period_ns=500000000LL;
+	long long deadline,now;
+	long long sample_ns[RAPL_MAX_PACKAGES];
+	double seconds;
+	char *end;
+	struct timespec deadline_ts;
 	double ct,lt,ot;
+	long long sample_start;
 
 
 	printf("\n");
@@ -754,66 +1161,174 @@ int main(int argc, char **argv) {
 
 	opterr=0;
 
-	while ((c = getopt (argc, argv, "c:hmps")) != -1) {
+	while ((c = getopt_long (argc, argv, "aC:D:eFfHhIi:L:Mmn:o:PpR:r:S:sTt",
+				long_options, NULL)) != -1) {
 		switch (c) {
-		case 'c':
-			core = atoi(optarg);
+		case 'a':
+			cheapest = 1;
+			break;
+		case 'B':
+			bench_backends = 1;
+			break;
+		case 'C':
+			calibrate_ns = (long long)(atof(optarg)*1000000000.0);
+			if (calibrate_ns<=0) {
+				fprintf(stderr,"Invalid calibration time %s\n",optarg);
+				exit(-1);
+			}
+			break;
+		case 'D':
+			show_stats = 1;
+			seconds = strtod(optarg,&end);
+			/* 0 is allowed, it means only at exit */
+			if ((end==optarg) || (*end) || (!(seconds>=0.0)) ||
+				(seconds>1000000000.0)) {
+				fprintf(stderr,"Invalid stats period %s\n",optarg);
+				exit(-1);
+			}
+			stats_period_ns = (long long)(seconds*1000000000.0);
+			break;
+		case 'e':
+			edge_align = 1;
+			break;
+		case 'F':
+			show_freq = 1;
+			break;
+		case 'f':
+			show_freq = 1;
+			per_cpu_freq = 1;
+			break;
+		case 'H':
+			show_hw = 1;
 			break;
 		case 'h':
-			printf("Usage: %s [-c core] [-h] [-m]\n\n",argv[0]);
-			printf("\t-c core : specifies which core to measure\n");
+			printf("Usage: %s [-a] [-C sec] [-D sec] [-e] [-F] [-f] [-H] [-h] [-I] [-i ms] [-L limit] [-M] [-m]\n"
+				"\t\t[-n samples] [-o file] [-P] [-R dir] [-r records] [-S name] [-T] [-t]\n"
+				"\t\t[--bench-backends]\n\n",argv[0]);
+			printf("\t-a      : benchmark the backends and use the cheapest\n");
+			printf("\t-C sec  : measure the sampler's own power first, sec per phase,\n");
+			printf("\t          and also print compensated package and core power\n");
+			printf("\t-D sec  : keep p50/p90/p99/p99.9, min, max and mean power and the\n");
+			printf("\t          last 1s/10s/60s, print to stderr every sec (0 only at exit)\n");
+			printf("\t-e      : start each window on a counter update\n");
+			printf("\t-F      : also show per-package MHz, %% busy and temperatures\n");
+			printf("\t-f      : like -F, plus the same for every CPU\n");
+			printf("\t-H      : also show nJ/instruction, IPC and nJ/LLC miss\n");
 			printf("\t-h      : displays this help\n");
+			printf("\t-I      : also show %% of time in each package and core C-state\n");
+			printf("\t-i ms   : sample period in milliseconds (default 500)\n");
+			printf("\t-L lim  : set a power limit while running, restored on exit,\n");
+			printf("\t          as package:domain:1|2:watts[:seconds], e.g. all:pkg:1:45:1\n");
+			printf("\t-M      : also show memory GB/s read and written and DRAM nJ/byte\n");
 			printf("\t-m      : forces use of MSR mode\n");
+			printf("\t-n num  : exit after num samples\n");
+			printf("\t-o file : write samples to a binary log, see rapl-log-dump\n");
+			printf("\t-P      : also show per-core power (AMD Family 17h+)\n");
 			printf("\t-p      : forces use of perf_event mode\n");
+			printf("\t-R dir  : read /dev, /sys and /proc under dir (default $HW_ROOT)\n");
+			printf("\t-r num  : make the -o log a ring of num records\n");
+			printf("\t-S name : publish samples to POSIX shared memory name (e.g. %s)\n",
+				RAPL_SHM_DEFAULT_NAME);
+			printf("\t          instead of printing them, see rapl-shm.h\n");
 			printf("\t-s      : forces use of sysfs mode\n");
+			printf("\t-T      : also show %% of each interval spent RAPL throttled\n");
+			printf("\t-t      : one pinned sampler thread per package\n");
+			printf("\t--bench-backends : compare the cost of a sample on each backend\n");
 			exit(0);
+		case 'I':
+			show_cstate = 1;
+			break;
+		case 'i':
+			period_ns = (long long)(atof(optarg)*1000000.0);
+			if (period_ns<=0) {
+				fprintf(stderr,"Invalid period %s\n",optarg);
+				exit(-1);
+			}
+			break;
+		case 'n':
+			max_samples = atoll(optarg);
+			break;
+		case 'o':
+			log_filename = optarg;
+			break;
+		case 'R':
+			rapl_set_root(optarg);
+			break;
+		case 'r':
+			log_capacity = atoll(optarg);
+			break;
+		case 'L':
+			limit_specs[num_limit_specs++] = optarg;
+			if (num_limit_specs>MAX_LIMITS) {
+				fprintf(stderr,"Too many -L limits, max is %d\n",
+					MAX_LIMITS);
+				exit(-1);
+			}
+			break;
+		case 'M':
+			show_imc = 1;
+			break;
 		case 'm':
 			force_msr = 1;
 			break;
+		case 'P':
+			per_core = 1;
+			break;
 		case 'p':
 			force_perf_event = 1;
 			break;
+		case 'S':
+			publish_name = optarg;
+			break;
 		case 's':
 			force_sysfs = 1;
 			break;
+		case 'T':
+			show_throttle = 1;
+			break;
+		case 't':
+			use_threads = 1;
+			break;
 		default:
 			fprintf(stderr,"Unknown option %c\n",c);
 			exit(-1);
 		}
 	}
 
-	(void)force_sysfs;
-
-	cpu_model=detect_cpu();
-	detect_packages();
+	cpu_model=rapl_detect_cpu();
+	rapl_detect_packages();
 
-	if ((!force_msr) && (!force_perf_event)) {
-		result=rapl_sysfs(core);
-		if (result==0) {
-			printf("\nUsing sysfs powercap interface to gather results\n\n");
-			use_sysfs=1;
-			goto ready;
-		}
+	if (bench_backends) {
+		rapl_bench_backends(cpu_model,RAPL_BENCH_SAMPLES,1);
+		return 0;
 	}
 
-	if ((force_perf_event) && (!force_msr)) {
-		result=rapl_perf_detect(core);
-		rapl_perf(core);
-		if (result==0) {
-			printf("\nUsing perf_event interface to gather results\n\n");
-			use_perf_event=1;
-			goto ready;
-		}
+	if (cheapest) {
+		result=rapl_open(RAPL_BACKEND_CHEAPEST,cpu_model);
+	}
+	else if (force_msr) {
+		result=rapl_open(RAPL_BACKEND_MSR,cpu_model);
+	}
+	else if (force_perf_event) {
+		result=rapl_open(RAPL_BACKEND_PERF,cpu_model);
+		if (result<0) result=rapl_open(RAPL_BACKEND_MSR,cpu_model);
+	}
+	else if (force_sysfs) {
+		result=rapl_open(RAPL_BACKEND_SYSFS,cpu_model);
+	}
+	else {
+		result=rapl_open(RAPL_BACKEND_AUTO,cpu_model);
 	}
 
-	result=rapl_detect_msr(core,cpu_model);
-	rapl_msr(core,cpu_model);
-
-	if (result==0) {
+	if (result==RAPL_BACKEND_SYSFS) {
+		printf("\nUsing sysfs powercap interface to gather results\n\n");
+	}
+	else if (result==RAPL_BACKEND_PERF) {
+		printf("\nUsing perf_event interface to gather results\n\n");
+	}
+	else if (result==RAPL_BACKEND_MSR) {
 		printf("\nUsing /dev/msr interface to gather results\n\n");
-		use_msr=1;
 	}
-
 	else {
 		printf("Unable to read RAPL counters.\n");
 		printf("* Verify you have an Intel Sandybridge or newer processor\n");
@@ -824,74 +1339,384 @@ int main(int argc, char **argv) {
 		return -1;
 	}
 
-ready:
+	if (per_core) {
+		if (rapl_cores_open()<0) {
+			printf("No per-core energy counters, "
+				"-P needs AMD Family 17h+ and /dev/cpu/N/msr\n\n");
+			per_core=0;
+		}
+		else {
+			printf("Sampling %d cores\n\n",rapl_core_count);
+		}
+	}
+
+	if (show_hw) {
+		if (rapl_hw_open()<0) {
+			printf("No hardware counters, -H needs a PMU and "
+				"perf_event_paranoid 0 or root\n\n");
+			show_hw=0;
+		}
+	}
+
+	if (show_freq) {
+		if (rapl_freq_open()<0) {
+			printf("No APERF/MPERF or thermal MSRs, "
+				"-F needs /dev/cpu/N/msr\n\n");
+			show_freq=0;
+			per_cpu_freq=0;
+		}
+		else {
+			tsc_hz=rapl_tsc_hz();
+		}
+	}
+
+	if (show_imc) {
+		if (rapl_imc_open()<0) {
+			printf("No memory controller counters, -M needs the "
+				"uncore IMC PMU and perf_event_paranoid 0 or root\n\n");
+			show_imc=0;
+		}
+	}
+
+	if (show_cstate) {
+		if (rapl_cstate_open(cpu_model)<0) {
+			printf("No C-state residency MSRs known for this CPU, "
+				"-I needs Intel and /dev/cpu/N/msr\n\n");
+			show_cstate=0;
+		}
+	}
 
-	gettimeofday(&current_time, NULL);
-	lt=current_time.tv_sec+(current_time.tv_usec/1000000.0);
+	if (show_throttle) {
+		if (rapl_throttle_open()<0) {
+			printf("No RAPL throttling counters found, "
+				"-T needs Intel and /dev/cpu/N/msr\n\n");
+			show_throttle=0;
+		}
+	}
+
+	if (edge_align) {
+		tsc_hz=rapl_tsc_hz();
+		edge_tsc_ref=rapl_rdtsc();
+		edge_ns_ref=rapl_monotonic_ns();
+		printf("Aligning samples to counter updates, TSC %.3fMHz\n\n",
+			tsc_hz/1000000.0);
+	}
+
+	signal(SIGINT,sigint_handler);
+	signal(SIGTERM,sigint_handler);
+	signal(SIGHUP,sigint_handler);
+
+	/* Package topology is only known now, so parse -L here */
+	if (num_limit_specs) {
+		for(j=0;j<num_limit_specs;j++) {
+			if (parse_limit(limit_specs[j])<0) return -1;
+		}
+		atexit(rapl_limit_restore);
+		if (apply_limits()<0) return -1;
+	}
+
+	if (calibrate_ns) calibrate(calibrate_ns,period_ns);
+
+	/* Timestamps and deadlines are all CLOCK_MONOTONIC.  We sleep	*/
+	/* until an absolute deadline so the period doesn't drift by	*/
+	/* however long the read and the printf took.			*/
+	deadline=rapl_monotonic_ns();
+	lt=(double)deadline/1000000000.0;
 	ot=lt;
-	for(j=0;j<total_packages;j++) {
-		last_package[j]=package_energy[j];
-		last_cores[j]=cores_energy[j];
-		last_uncore[j]=uncore_energy[j];
-		last_dram[j]=dram_energy[j];
-		last_psys[j]=psys_energy[j];
+	memcpy(first_raw,rapl_raw,sizeof(rapl_raw));
+	memcpy(last_raw,rapl_raw,sizeof(rapl_raw));
+	memcpy(last_throttle,rapl_throttle_raw,sizeof(rapl_throttle_raw));
+	memcpy(last_core_raw,rapl_core_raw,sizeof(rapl_core_raw));
+	if (show_hw) rapl_hw_read();
+	memcpy(last_hw,rapl_hw_raw,sizeof(rapl_hw_raw));
+	if (show_imc) rapl_imc_read();
+	memcpy(last_imc,rapl_imc_raw,sizeof(rapl_imc_raw));
+	if (show_freq) {
+		rapl_freq_read();
+		freq_save();
+	}
+	if (show_cstate) {
+		rapl_cstate_read();
+		cstate_save();
+	}
+
+	if (log_filename) {
+		if (log_open(log_filename,log_capacity,deadline,period_ns)<0) return -1;
+		printf("Logging binary samples to %s\n",log_filename);
 	}
 
+	if (publish_name) {
+		if (shm_publish_open(publish_name,period_ns,deadline)<0) {
+			return -1;
+		}
+		printf("Publishing samples to shared memory %s\n",
+			publish_name);
+	}
+
+	if ((show_stats) && (stats_open(deadline)<0)) return -1;
+
+	text_output=((!log_filename) && (!publish_name));
+	last_ns=deadline;
+
 	/* PLOT LOOP */
-	printf("Time (s)\t");
-	for(j=0;j<total_packages;j++) {
-		if (available&PACKAGE) printf("Package%d(W)\t",j);
-		if (available&CORES) printf("Cores(W)\t");
-		if (available&UNCORE) printf("GPU(W)\t\t");
-		if (available&DRAM) printf("DRAM(W)\t\t");
-		if (available&PSYS) printf("Psys(W)|\t");
+	if (text_output) {
+		printf("Time (s)\t");
+		for(j=0;j<rapl_total_packages;j++) {
+			for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+				if (rapl_available&(1<<d)) {
+					printf(column_names[d],j);
+				}
+			}
+			for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+				if (compensated_domain(d)) {
+					printf("%s",compensated_names[d]);
+				}
+			}
+			for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+				if ((show_throttle) &&
+					(rapl_throttle_available&(1<<d))) {
+					printf("%s",throttle_names[d]);
+				}
+			}
+			for(i=0;i<RAPL_HW_NUM;i++) {
+				if ((show_hw) && (rapl_hw_available&(1<<i))) {
+					printf("%s",hw_names[i]);
+				}
+			}
+			if (show_imc) {
+				printf("Read%d(GB/s)\tWrite%d(GB/s)\t",j,j);
+				if (rapl_available&(1<<RAPL_DOMAIN_DRAM)) {
+					printf("nJ/B%d\t\t",j);
+				}
+			}
+			if (show_freq) {
+				if (rapl_freq_available&RAPL_FREQ_APERF) {
+					printf("MHz%d\t\tBusy%d(%%)\t",j,j);
+				}
+				if (rapl_freq_available&RAPL_FREQ_PKG_TEMP) {
+					printf("PkgTemp%d(C)\t",j);
+				}
+				if (rapl_freq_available&RAPL_FREQ_CORE_TEMP) {
+					printf("MaxCore%d(C)\t",j);
+				}
+			}
+			if (show_cstate) print_cstate_columns(j);
+		}
+		if (per_core) {
+			for(i=0;i<rapl_core_count;i++) {
+				printf("Core%d(W)\t",rapl_core_cpu[i]);
+			}
+			for(j=0;j<rapl_total_packages;j++) {
+				printf("CoreSum%d(W)\t",j);
+			}
+		}
+		if (per_cpu_freq) {
+			for(i=0;i<rapl_cpu_count;i++) {
+				if (rapl_freq_available&RAPL_FREQ_APERF) {
+					printf("CPU%dMHz\t\tCPU%dBusy(%%)\t",
+						rapl_cpu_id[i],rapl_cpu_id[i]);
+				}
+				if (rapl_freq_available&RAPL_FREQ_CORE_TEMP) {
+					printf("CPU%d(C)\t",rapl_cpu_id[i]);
+				}
+			}
+		}
+		if (use_threads) printf("Skew(us)\t");
+		printf("\n");
 	}
-	printf("\n");
-	while(1) {
 
-		gettimeofday(&current_time, NULL);
-		ct=current_time.tv_sec+(current_time.tv_usec/1000000.0);
+	if (use_threads) package_threads_start();
 
-		if (use_sysfs) {
-			result=rapl_sysfs(core);
+	while(!done) {
+
+		if (use_threads) {
+			now=package_threads_sample(deadline,&skew,&cost);
+			if (per_core) {
+				sample_start=rapl_monotonic_ns();
+				rapl_cores_read();
+				cost+=rapl_monotonic_ns()-sample_start;
+			}
+			sample_cost_update((double)cost/1000.0);
 		}
-		else if (use_perf_event) {
-			result=rapl_perf(core);
+		else {
+			now=rapl_monotonic_ns();
+			sample_start=now;
+			for(j=0;j<rapl_total_packages;j++) sample_package(j);
+			if (per_core) rapl_cores_read();
+			sample_cost_update((double)(rapl_monotonic_ns()-
+						sample_start)/1000.0);
 		}
-		else if (use_msr) {
-			result=rapl_msr(core,cpu_model);
+		if (show_hw) rapl_hw_read();
+		if (show_imc) rapl_imc_read();
+		if (show_freq) rapl_freq_read();
+		if (show_cstate) rapl_cstate_read();
+		ct=(double)now/1000000000.0;
+
+		/* The log keeps the first sample too, as the baseline.	*/
+		/* It gets the same per-package times the power uses.	*/
+		if (log_filename) {
+			for(j=0;j<rapl_total_packages;j++) {
+				sample_ns[j]=package_time_ns(j,now);
+			}
+			log_sample(sample_ns);
 		}
+		if (shm) shm_publish(now,first_time?0:now-last_ns);
+		last_ns=now;
 
 		if (first_time) {
 			first_time=0;
 		}
 		else {
-		printf("%lf\t",ct-ot);
-		for(j=0;j<total_packages;j++) {
-			if (available&PACKAGE) printf("%lf\t",
-					(package_energy[j]-last_package[j])/(ct-lt));
-			if (available&CORES) printf("%lf\t",
-					(cores_energy[j]-last_cores[j])/(ct-lt));
-			if (available&UNCORE) printf("%lf\t",
-					(uncore_energy[j]-last_uncore[j])/(ct-lt));
-			if (available&DRAM) printf("%lf\t",
-					(dram_energy[j]-last_dram[j])/(ct-lt));
-			if (available&PSYS) printf("%lf\t",
-					(psys_energy[j]-last_psys[j])/(ct-lt));
+		jitter_update(now-deadline);
+		if (use_threads) skew_update(skew);
+
+		if (show_stats) {
+			for(j=0;j<rapl_total_packages;j++) {
+				interval=package_interval(j,ct,lt);
+				for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+					if (power_stats[j][d]==NULL) continue;
+					stats_update(now,j,d,(double)
+						(rapl_raw[j][d]-last_raw[j][d])*
+						rapl_units[j][d]/interval);
+				}
+			}
+			if ((stats_period_ns) && (now>=stats_next_ns)) {
+				stats_report(now);
+				while(stats_next_ns<=now) {
+					stats_next_ns+=stats_period_ns;
+				}
+			}
 		}
-		printf("\n");
+
+		if (text_output) {
+			/* with -e, package 0's edge, as rapl-log-dump shows */
+			printf("%lf\t",(double)package_time_ns(0,now)/
+				1000000000.0-ot);
+			for(j=0;j<rapl_total_packages;j++) {
+				interval=package_interval(j,ct,lt);
+				for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+					if (!(rapl_available&(1<<d))) continue;
+					printf("%lf\t",(double)(rapl_raw[j][d]-
+						last_raw[j][d])*rapl_units[j][d]/
+						interval);
+				}
+				for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+					if (!compensated_domain(d)) continue;
+					watts=(double)(rapl_raw[j][d]-
+						last_raw[j][d])*rapl_units[j][d]/
+						interval;
+					printf("%lf\t",watts-overhead_watts[j][d]);
+				}
+				for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+					if (!show_throttle) break;
+					if (!(rapl_throttle_available&(1<<d))) continue;
+					printf("%.2lf\t",(double)(rapl_throttle_raw[j][d]-
+						last_throttle[j][d])*
+						rapl_throttle_units[j]*100.0/
+						interval);
+				}
+				if (show_hw) print_hw(j);
+				if (show_imc) print_imc(j,interval);
+				if (show_freq) print_freq(j);
+				if (show_cstate) print_cstate(j);
+			}
+			if (per_core) {
+				memset(core_sum,0,sizeof(core_sum));
+				for(i=0;i<rapl_core_count;i++) {
+					watts=(double)(rapl_core_raw[i]-
+						last_core_raw[i])*
+						rapl_core_units[i]/(ct-lt);
+					printf("%lf\t",watts);
+					if (rapl_core_package[i]<RAPL_MAX_PACKAGES) {
+						core_sum[rapl_core_package[i]]+=watts;
+					}
+				}
+				for(j=0;j<rapl_total_packages;j++) {
+					printf("%lf\t",core_sum[j]);
+				}
+			}
+			if (per_cpu_freq) print_cpu_freq();
+			if (use_threads) printf("%.3lf\t",(double)skew/1000.0);
+			printf("\n");
+		}
+		samples++;
+		if ((max_samples) && (samples>=max_samples)) break;
 		}
-		usleep(500000);
 		lt=ct;
-		for(j=0;j<total_packages;j++) {
-			last_package[j]=package_energy[j];
-			last_cores[j]=cores_energy[j];
-			last_uncore[j]=uncore_energy[j];
-			last_dram[j]=dram_energy[j];
-			last_psys[j]=psys_energy[j];
+		memcpy(last_raw,rapl_raw,sizeof(rapl_raw));
+		memcpy(last_throttle,rapl_throttle_raw,sizeof(rapl_throttle_raw));
+		memcpy(last_hw,rapl_hw_raw,sizeof(rapl_hw_raw));
+		memcpy(last_imc,rapl_imc_raw,sizeof(rapl_imc_raw));
+		if (show_freq) freq_save();
+		if (show_cstate) cstate_save();
+		if (per_core) {
+			memcpy(last_core_raw,rapl_core_raw,
+				rapl_core_count*sizeof(uint64_t));
 		}
-		fflush(stdout);
+		memcpy(last_edge_tsc,edge_tsc,sizeof(edge_tsc));
+		if (text_output) fflush(stdout);
+
+		/* If we overran, skip the deadlines we already missed	*/
+		/* rather than firing off a burst of back-to-back reads	*/
+		deadline+=period_ns;
+		now=rapl_monotonic_ns();
+		while(deadline<=now) {
+			missed_deadlines++;
+			deadline+=period_ns;
+		}
+
+		/* With a long period, wake up in between just to keep	*/
+		/* the MSR accumulators ahead of the 32-bit wrap.	*/
+		if (rapl_backend==RAPL_BACKEND_MSR) {
+			while((!done) && (deadline-now>rapl_msr_wrap_poll_ns)) {
+				now+=rapl_msr_wrap_poll_ns;
+				deadline_ts.tv_sec=now/1000000000LL;
+				deadline_ts.tv_nsec=now%1000000000LL;
+				clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,
+					&deadline_ts,NULL);
+				rapl_read();
+				if (per_core) rapl_cores_read();
+				now=rapl_monotonic_ns();
+			}
+		}
+
+		/* The sampler threads do their own sleeping */
+		if (use_threads) continue;
+
+		deadline_ts.tv_sec=deadline/1000000000LL;
+		deadline_ts.tv_nsec=deadline%1000000000LL;
+		while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,
+				&deadline_ts,NULL)==EINTR) {
+			if (done) break;
+		}
+	}
+
+	if (use_threads) package_threads_stop();
+	if (log_filename) log_close();
+	shm_publish_close();
+
+	jitter_report(period_ns);
+	skew_report();
+	if (edge_timeouts) {
+		fprintf(stderr,"Energy counter did not update %d times, "
+			"those windows are not edge aligned\n",edge_timeouts);
+	}
+	energy_report();
+	sample_cost_report();
+	if (show_stats) {
+		stats_report(last_ns);
+		stats_close();
 	}
 
+	rapl_limit_restore();
+	rapl_throttle_close();
+	rapl_cores_close();
+	rapl_hw_close();
+	rapl_imc_close();
+	rapl_freq_close();
+	rapl_cstate_close();
+	rapl_close();
+	rapl_msr_fds_close();
+
 	return 0;
 }
@@ -21,7 +21,9 @@
 /* the sysfs powercap interface got into the kernel in 			*/
 /*	2d281d8196e38dd (3.13)						*/
 /*									*/
-/* Compile with:   gcc -O2 -Wall -o rapl-read rapl-read.c -lm		*/
+/* Compile with:   make, or by hand with				*/
+/*	gcc -O2 -Wall -o rapl-read rapl-read.c rapl-lib.c		*/
+/*		-lm -pthread -lrt					*/
 /*									*/
 /* Vince Weaver -- vincent.weaver @ maine.edu -- 11 September 2015	*/
 /*									*/
@@ -34,920 +36,808 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
 
-#include <sys/syscall.h>
-#include <linux/perf_event.h>
-
-
-/* AMD Support */
-#define MSR_AMD_RAPL_POWER_UNIT			0xc0010299
-
-#define MSR_AMD_PKG_ENERGY_STATUS		0xc001029B
-#define MSR_AMD_PP0_ENERGY_STATUS		0xc001029A
-
-
-
-/* Intel support */
-
-#define MSR_INTEL_RAPL_POWER_UNIT		0x606
-/*
- * Platform specific RAPL Domains.
- * Note that PP1 RAPL Domain is supported on 062A only
- * And DRAM RAPL Domain is supported on 062D only
- */
-/* Package RAPL Domain */
-#define MSR_PKG_RAPL_POWER_LIMIT	0x610
-#define MSR_INTEL_PKG_ENERGY_STATUS	0x611
-#define MSR_PKG_PERF_STATUS		0x613
-#define MSR_PKG_POWER_INFO		0x614
-
-/* PP0 RAPL Domain */
-#define MSR_PP0_POWER_LIMIT		0x638
-#define MSR_INTEL_PP0_ENERGY_STATUS	0x639
-#define MSR_PP0_POLICY			0x63A
-#define MSR_PP0_PERF_STATUS		0x63B
-
-/* PP1 RAPL Domain, may reflect to uncore devices */
-#define MSR_PP1_POWER_LIMIT		0x640
-#define MSR_PP1_ENERGY_STATUS		0x641
-#define MSR_PP1_POLICY			0x642
-
-/* DRAM RAPL Domain */
-#define MSR_DRAM_POWER_LIMIT		0x618
-#define MSR_DRAM_ENERGY_STATUS		0x619
-#define MSR_DRAM_PERF_STATUS		0x61B
-#define MSR_DRAM_POWER_INFO		0x61C
-
-/* PSYS RAPL Domain */
-#define MSR_PLATFORM_ENERGY_STATUS	0x64d
-
-/* RAPL UNIT BITMASK */
-#define POWER_UNIT_OFFSET	0
-#define POWER_UNIT_MASK		0x0F
-
-#define ENERGY_UNIT_OFFSET	0x08
-#define ENERGY_UNIT_MASK	0x1F00
-
-#define TIME_UNIT_OFFSET	0x10
-#define TIME_UNIT_MASK		0xF000
-
-static int open_msr(int core) {
-
-	char msr_filename[BUFSIZ];
-	int fd;
-
-	sprintf(msr_filename, "/dev/cpu/%d/msr", core);
-	fd = open(msr_filename, O_RDONLY);
-	if ( fd < 0 ) {
-		if ( errno == ENXIO ) {
-			fprintf(stderr, "rdmsr: No CPU %d\n", core);
-			exit(2);
-		} else if ( errno == EIO ) {
-			fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n",
-					core);
-			exit(3);
-		} else {
-			perror("rdmsr:open");
-			fprintf(stderr,"Trying to open %s\n",msr_filename);
-			exit(127);
-		}
-	}
+#include "rapl-lib.h"
 
-	return fd;
-}
 
-static long long read_msr(int fd, unsigned int which) {
+/*******************************/
+/* One-second sample           */
+/*******************************/
 
-	uint64_t data;
+/* librapl does the reading; the MSR backend also lists the package	*/
+/* parameters as it opens.  On top of that we show the throttle	*/
+/* counters and PP0/PP1 policies only the MSRs have.		*/
 
-	if ( pread(fd, &data, sizeof data, which) != sizeof data ) {
-		perror("rdmsr:pread");
-		fprintf(stderr,"Error reading MSR %x\n",which);
-		exit(127);
-	}
+static void rapl_msr_extras(int core, int cpu_model) {
 
-	return (long long)data;
-}
+	uint64_t result;
+	int d,j,fd;
 
-#define CPU_VENDOR_INTEL	1
-#define CPU_VENDOR_AMD		2
-
-#define CPU_SANDYBRIDGE		42
-#define CPU_SANDYBRIDGE_EP	45
-#define CPU_IVYBRIDGE		58
-#define CPU_IVYBRIDGE_EP	62
-#define CPU_HASWELL		60
-#define CPU_HASWELL_ULT		69
-#define CPU_HASWELL_GT3E	70
-#define CPU_HASWELL_EP		63
-#define CPU_BROADWELL		61
-#define CPU_BROADWELL_GT3E	71
-#define CPU_BROADWELL_EP	79
-#define CPU_BROADWELL_DE	86
-#define CPU_SKYLAKE		78
-#define CPU_SKYLAKE_HS		94
-#define CPU_SKYLAKE_X		85
-#define CPU_KNIGHTS_LANDING	87
-#define CPU_KNIGHTS_MILL	133
-#define CPU_KABYLAKE_MOBILE	142
-#define CPU_KABYLAKE		158
-#define CPU_ATOM_SILVERMONT	55
-#define CPU_ATOM_AIRMONT	76
-#define CPU_ATOM_MERRIFIELD	74
-#define CPU_ATOM_MOOREFIELD	90
-#define CPU_ATOM_GOLDMONT	92
-#define CPU_ATOM_GEMINI_LAKE	122
-#define CPU_ATOM_DENVERTON	95
-
-#define CPU_AMD_FAM17H		0xc000
-
-static unsigned int msr_rapl_units,msr_pkg_energy_status,msr_pp0_energy_status;
-
-
-/* TODO: on Skylake, also may support  PSys "platform" domain,	*/
-/* the whole SoC not just the package.				*/
-/* see dcee75b3b7f025cc6765e6c92ba0a4e59a4d25f4			*/
-
-static int detect_cpu(void) {
-
-	FILE *fff;
-
-	int vendor=-1,family,model=-1;
-	char buffer[BUFSIZ],*result;
-	char vendor_string[BUFSIZ];
-
-	fff=fopen("/proc/cpuinfo","r");
-	if (fff==NULL) return -1;
+	if (rapl_throttle_open()<0) return;
 
-	while(1) {
-		result=fgets(buffer,BUFSIZ,fff);
-		if (result==NULL) break;
+	for(j=0;j<rapl_total_packages;j++) {
+		printf("\tPackage %d:\n",j);
+
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!(rapl_throttle_available&(1<<d))) continue;
+			printf("\t\t%s Accumulated Throttled Time : %.6fs\n",
+				rapl_domain_name(d),
+				(double)rapl_throttle_raw[j][d]*
+					rapl_throttle_units[j]);
+		}
 
-		if (!strncmp(result,"vendor_id",8)) {
-			sscanf(result,"%*s%*s%s",vendor_string);
+		fd=rapl_msr_fd(rapl_package_map[j]);
+		if (fd<0) continue;
 
-			if (!strncmp(vendor_string,"GenuineIntel",12)) {
-				vendor=CPU_VENDOR_INTEL;
-			}
-			if (!strncmp(vendor_string,"AuthenticAMD",12)) {
-				vendor=CPU_VENDOR_AMD;
+		/* only available on *Bridge-EP */
+		if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP)) {
+			if (rapl_read_msr(fd,MSR_PP0_POLICY,&result)==0) {
+				printf("\t\tPowerPlane0 (core) for core %d policy: %d\n",
+					core,(int)result&0x001f);
 			}
 		}
 
-		if (!strncmp(result,"cpu family",10)) {
-			sscanf(result,"%*s%*s%*s%d",&family);
+		if ((rapl_available&(1<<RAPL_DOMAIN_PP1)) &&
+			(rapl_read_msr(fd,MSR_PP1_POLICY,&result)==0)) {
+			printf("\t\tPowerPlane1 (on-core GPU if avail) %d policy: %d\n",
+				core,(int)result&0x001f);
 		}
+	}
+	printf("\n");
 
-		if (!strncmp(result,"model",5)) {
-			sscanf(result,"%*s%*s%d",&model);
-		}
+	rapl_throttle_close();
+}
 
-	}
+static int rapl_sample(int backend, int core, int cpu_model) {
 
-	if (vendor==CPU_VENDOR_INTEL) {
-		if (family!=6) {
-			printf("Wrong CPU family %d\n",family);
-			return -1;
-		}
+	uint64_t before[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	int d,j;
 
-		msr_rapl_units=MSR_INTEL_RAPL_POWER_UNIT;
-		msr_pkg_energy_status=MSR_INTEL_PKG_ENERGY_STATUS;
-		msr_pp0_energy_status=MSR_INTEL_PP0_ENERGY_STATUS;
-
-		printf("Found ");
-
-		switch(model) {
-			case CPU_SANDYBRIDGE:
-				printf("Sandybridge");
-				break;
-			case CPU_SANDYBRIDGE_EP:
-				printf("Sandybridge-EP");
-				break;
-			case CPU_IVYBRIDGE:
-				printf("Ivybridge");
-				break;
-			case CPU_IVYBRIDGE_EP:
-				printf("Ivybridge-EP");
-				break;
-			case CPU_HASWELL:
-			case CPU_HASWELL_ULT:
-			case CPU_HASWELL_GT3E:
-				printf("Haswell");
-				break;
-			case CPU_HASWELL_EP:
-				printf("Haswell-EP");
-				break;
-			case CPU_BROADWELL:
-			case CPU_BROADWELL_GT3E:
-				printf("Broadwell");
-				break;
-			case CPU_BROADWELL_EP:
-				printf("Broadwell-EP");
-				break;
-			case CPU_SKYLAKE:
-			case CPU_SKYLAKE_HS:
-				printf("Skylake");
-				break;
-			case CPU_SKYLAKE_X:
-				printf("Skylake-X");
-				break;
-			case CPU_KABYLAKE:
-			case CPU_KABYLAKE_MOBILE:
-				printf("Kaby Lake");
-				break;
-			case CPU_KNIGHTS_LANDING:
-				printf("Knight's Landing");
-				break;
-			case CPU_KNIGHTS_MILL:
-				printf("Knight's Mill");
-				break;
-			case CPU_ATOM_GOLDMONT:
-			case CPU_ATOM_GEMINI_LAKE:
-			case CPU_ATOM_DENVERTON:
-				printf("Atom");
-				break;
-			default:
-				printf("Unsupported model %d\n",model);
-				model=-1;
-				break;
-		}
+	switch(backend) {
+		case RAPL_BACKEND_MSR:
+			printf("\nTrying /dev/msr interface to gather results\n\n");
+			break;
+		case RAPL_BACKEND_PERF:
+			printf("\nTrying perf_event interface to gather results\n\n");
+			break;
+		case RAPL_BACKEND_SYSFS:
+			printf("\nTrying sysfs powercap interface to gather results\n\n");
+			break;
 	}
 
-	if (vendor==CPU_VENDOR_AMD) {
+	if (rapl_open(backend,cpu_model)<0) return -1;
 
-		msr_rapl_units=MSR_AMD_RAPL_POWER_UNIT;
-		msr_pkg_energy_status=MSR_AMD_PKG_ENERGY_STATUS;
-		msr_pp0_energy_status=MSR_AMD_PP0_ENERGY_STATUS;
+	if (backend==RAPL_BACKEND_MSR) rapl_msr_extras(core,cpu_model);
 
-		if (family!=23) {
-			printf("Wrong CPU family %d\n",family);
-			return -1;
+	rapl_read();
+	memcpy(before,rapl_raw,sizeof(before));
+
+	printf("\tSleeping 1 second\n\n");
+	sleep(1);
+
+	rapl_read();
+
+	for(j=0;j<rapl_total_packages;j++) {
+		printf("\tPackage %d\n",j);
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!(rapl_available&(1<<d))) continue;
+			printf("\t\t%s\t: %lfJ\n",rapl_domain_name(d),
+				(double)(rapl_raw[j][d]-before[j][d])*
+				rapl_units[j][d]);
 		}
-		model=CPU_AMD_FAM17H;
 	}
+	printf("\n");
 
-	fclose(fff);
+	rapl_close();
 
-	printf(" Processor type\n");
+	return 0;
 
-	return model;
 }
 
-#define MAX_CPUS	1024
-#define MAX_PACKAGES	16
+/*******************************/
+/* Edge-aligned measurement    */
+/*******************************/
+
+/* The energy counters only update about once a millisecond, so a	*/
+/* window that starts and stops at arbitrary times can be off by	*/
+/* up to a whole update.  Instead, spin until each package counter	*/
+/* ticks at the start and at the end, and time the window from edge	*/
+/* to edge with the TSC.						*/
 
-static int total_cores=0,total_packages=0;
-static int package_map[MAX_PACKAGES];
+static int rapl_edge(int backend, int cpu_model, long long interval_ns) {
 
-static int detect_packages(void) {
+	uint64_t start_lo[RAPL_MAX_PACKAGES],start_hi[RAPL_MAX_PACKAGES];
+	uint64_t end_lo,end_hi;
+	uint64_t before[RAPL_MAX_PACKAGES][RAPL_NUM_DOMAINS];
+	double tsc_hz,seconds,error,joules;
+	struct timespec interval;
+	int d,j;
 
-	char filename[BUFSIZ];
-	FILE *fff;
-	int package;
-	int i;
+	printf("\nTrying edge-aligned %s interface to gather results\n\n",
+		rapl_backend_name(backend==RAPL_BACKEND_AUTO?
+			RAPL_BACKEND_SYSFS:backend));
 
-	for(i=0;i<MAX_PACKAGES;i++) package_map[i]=-1;
-
-	printf("\t");
-	for(i=0;i<MAX_CPUS;i++) {
-		sprintf(filename,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",i);
-		fff=fopen(filename,"r");
-		if (fff==NULL) break;
-		fscanf(fff,"%d",&package);
-		printf("%d (%d)",i,package);
-		if (i%8==7) printf("\n\t"); else printf(", ");
-		fclose(fff);
-
-		if (package_map[package]==-1) {
-			total_packages++;
-			package_map[package]=i;
-		}
+	backend=rapl_open(backend,cpu_model);
+	if (backend<0) return -1;
 
+	tsc_hz=rapl_tsc_hz();
+	printf("\tUsing %s, TSC is %.3fMHz\n",
+		rapl_backend_name(backend),tsc_hz/1000000.0);
+
+	for(j=0;j<rapl_total_packages;j++) {
+		if (rapl_wait_edge(j,&start_lo[j],&start_hi[j])<0) {
+			printf("\tPackage %d energy counter is not updating\n\n",j);
+			rapl_close();
+			return -1;
+		}
+		memcpy(before[j],rapl_raw[j],sizeof(before[j]));
 	}
 
-	printf("\n");
+	printf("\n\tSleeping %.3f seconds\n\n",(double)interval_ns/1000000000.0);
+	interval.tv_sec=interval_ns/1000000000LL;
+	interval.tv_nsec=interval_ns%1000000000LL;
+	nanosleep(&interval,NULL);
+
+	for(j=0;j<rapl_total_packages;j++) {
+		if (rapl_wait_edge(j,&end_lo,&end_hi)<0) {
+			printf("\tPackage %d energy counter is not updating\n\n",j);
+			rapl_close();
+			return -1;
+		}
+
+		/* Use the middle of each edge, the error is half of each range */
+		seconds=((double)(end_lo+(end_hi-end_lo)/2)-
+			(double)(start_lo[j]+(start_hi[j]-start_lo[j])/2))/tsc_hz;
+		error=((double)(end_hi-end_lo)+
+			(double)(start_hi[j]-start_lo[j]))/2.0/tsc_hz;
+
+		printf("\tPackage %d: %.6fs window (+/- %.3fus)\n",
+			j,seconds,error*1000000.0);
 
-	total_cores=i;
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!(rapl_available&(1<<d))) continue;
+			joules=(double)(rapl_raw[j][d]-before[j][d])*
+				rapl_units[j][d];
+			printf("\t\t%s\t: %.6fJ\t%.6fW\n",
+				rapl_domain_name(d),joules,joules/seconds);
+		}
+	}
+	printf("\n");
 
-	printf("\tDetected %d cores in %d packages\n\n",
-		total_cores,total_packages);
+	rapl_close();
 
 	return 0;
 }
 
-
 /*******************************/
-/* MSR code                    */
+/* Command wrapper             */
 /*******************************/
 
-static int rapl_msr(int core, int cpu_model) {
+/* rapl-read -r N -- cmd args... forks and execs the command, reads	*/
+/* every domain immediately before the fork and immediately after	*/
+/* waitpid() reaps it, and repeats.  Warmup runs (-w) are measured	*/
+/* the same way but not counted.  Results go to stderr so the	*/
+/* command's own output is left alone.				*/
 
-	int fd;
-	long long result;
-	double power_units,time_units;
-	double cpu_energy_units[MAX_PACKAGES],dram_energy_units[MAX_PACKAGES];
-	double package_before[MAX_PACKAGES],package_after[MAX_PACKAGES];
-	double pp0_before[MAX_PACKAGES],pp0_after[MAX_PACKAGES];
-	double pp1_before[MAX_PACKAGES],pp1_after[MAX_PACKAGES];
-	double dram_before[MAX_PACKAGES],dram_after[MAX_PACKAGES];
-	double psys_before[MAX_PACKAGES],psys_after[MAX_PACKAGES];
-	double thermal_spec_power,minimum_power,maximum_power,time_window;
-	int j;
+/* Running mean and variance (Welford) plus min and max */
+struct run_stats {
+	int n;
+	double mean,m2,min,max;
+};
 
-	int dram_avail=0,pp0_avail=0,pp1_avail=0,psys_avail=0;
-	int different_units=0;
+static void stats_add(struct run_stats *stats, double value) {
 
-	printf("\nTrying /dev/msr interface to gather results\n\n");
+	double delta;
 
-	if (cpu_model<0) {
-		printf("\tUnsupported CPU model %d\n",cpu_model);
-		return -1;
-	}
+	if ((stats->n==0) || (value<stats->min)) stats->min=value;
+	if ((stats->n==0) || (value>stats->max)) stats->max=value;
 
-	switch(cpu_model) {
+	stats->n++;
+	delta=value-stats->mean;
+	stats->mean+=delta/stats->n;
+	stats->m2+=delta*(value-stats->mean);
+}
 
-		case CPU_SANDYBRIDGE_EP:
-		case CPU_IVYBRIDGE_EP:
-			pp0_avail=1;
-			pp1_avail=0;
-			dram_avail=1;
-			different_units=0;
-			psys_avail=0;
-			break;
+static double stats_stddev(struct run_stats *stats) {
 
-		case CPU_HASWELL_EP:
-		case CPU_BROADWELL_EP:
-		case CPU_SKYLAKE_X:
-			pp0_avail=1;
-			pp1_avail=0;
-			dram_avail=1;
-			different_units=1;
-			psys_avail=0;
-			break;
+	if (stats->n<2) return 0.0;
 
-		case CPU_KNIGHTS_LANDING:
-		case CPU_KNIGHTS_MILL:
-			pp0_avail=0;
-			pp1_avail=0;
-			dram_avail=1;
-			different_units=1;
-			psys_avail=0;
-			break;
+	return sqrt(stats->m2/(stats->n-1));
+}
 
-		case CPU_SANDYBRIDGE:
-		case CPU_IVYBRIDGE:
-			pp0_avail=1;
-			pp1_avail=1;
-			dram_avail=0;
-			different_units=0;
-			psys_avail=0;
-			break;
+/* Two-sided 95% Student t for n-1 degrees of freedom */
+static double t_95(int dof) {
 
-		case CPU_HASWELL:
-		case CPU_HASWELL_ULT:
-		case CPU_HASWELL_GT3E:
-		case CPU_BROADWELL:
-		case CPU_BROADWELL_GT3E:
-		case CPU_ATOM_GOLDMONT:
-		case CPU_ATOM_GEMINI_LAKE:
-		case CPU_ATOM_DENVERTON:
-			pp0_avail=1;
-			pp1_avail=1;
-			dram_avail=1;
-			different_units=0;
-			psys_avail=0;
-			break;
+	static const double table[]={
+		0.0,12.706,4.303,3.182,2.776,2.571,2.447,2.365,2.306,2.262,
+		2.228,2.201,2.179,2.160,2.145,2.131,2.120,2.110,2.101,2.093,
+		2.086,2.080,2.074,2.069,2.064,2.060,2.056,2.052,2.048,2.045,
+		2.042,
+	};
 
-		case CPU_SKYLAKE:
-		case CPU_SKYLAKE_HS:
-		case CPU_KABYLAKE:
-		case CPU_KABYLAKE_MOBILE:
-			pp0_avail=1;
-			pp1_avail=1;
-			dram_avail=1;
-			different_units=0;
-			psys_avail=1;
-			break;
+	if (dof<1) return 0.0;
+	if (dof<=30) return table[dof];
 
-		case CPU_AMD_FAM17H:
-			pp0_avail=1;		// maybe
-			pp1_avail=0;
-			dram_avail=0;
-			different_units=0;
-			psys_avail=0;
-			break;
-	}
+	return 1.96;
+}
 
-	for(j=0;j<total_packages;j++) {
-		printf("\tListing paramaters for package #%d\n",j);
+static void stats_print(const char *name, const char *units,
+			struct run_stats *stats) {
 
-		fd=open_msr(package_map[j]);
+	double stddev,ci;
 
-		/* Calculate the units used */
-		result=read_msr(fd,msr_rapl_units);
+	stddev=stats_stddev(stats);
+	ci=t_95(stats->n-1)*stddev/sqrt(stats->n);
 
-		power_units=pow(0.5,(double)(result&0xf));
-		cpu_energy_units[j]=pow(0.5,(double)((result>>8)&0x1f));
-		time_units=pow(0.5,(double)((result>>16)&0xf));
+	fprintf(stderr,"\t%-12s %14.6f %s +- %12.6f (%5.2f%%)  "
+		"stddev %12.6f  min %14.6f  max %14.6f\n",
+		name,stats->mean,units,ci,
+		(stats->mean!=0.0)?ci*100.0/fabs(stats->mean):0.0,
+		stddev,stats->min,stats->max);
+}
 
-		/* On Haswell EP and Knights Landing */
-		/* The DRAM units differ from the CPU ones */
-		if (different_units) {
-			dram_energy_units[j]=pow(0.5,(double)16);
-			printf("DRAM: Using %lf instead of %lf\n",
-				dram_energy_units[j],cpu_energy_units[j]);
-		}
-		else {
-			dram_energy_units[j]=cpu_energy_units[j];
-		}
+/* Run the command once, -1 if it couldn't be run.  We wait in	*/
+/* sigtimedwait() so that we wake the moment it exits but still	*/
+/* poll often enough to keep the MSR counters ahead of a wrap.	*/
+static int run_command(char **command, struct rapl_region *region) {
+
+	struct timespec timeout;
+	sigset_t set,old;
+	long long poll_ns;
+	pid_t pid;
+	int status,exec_errno;
+	int exec_pipe[2];
+	ssize_t size;
+
+	poll_ns=(rapl_backend==RAPL_BACKEND_MSR)?
+		rapl_msr_wrap_poll_ns:3600000000000LL;
+	timeout.tv_sec=poll_ns/1000000000LL;
+	timeout.tv_nsec=poll_ns%1000000000LL;
+
+	/* A failed exec sends errno back up this pipe; a successful	*/
+	/* one closes it, so the command can exit with anything.	*/
+	if (pipe(exec_pipe)<0) {
+		fprintf(stderr,"Error creating pipe: %s\n",strerror(errno));
+		return -1;
+	}
+	fcntl(exec_pipe[0],F_SETFD,FD_CLOEXEC);
+	fcntl(exec_pipe[1],F_SETFD,FD_CLOEXEC);
 
-		printf("\t\tPower units = %.3fW\n",power_units);
-		printf("\t\tCPU Energy units = %.8fJ\n",cpu_energy_units[j]);
-		printf("\t\tDRAM Energy units = %.8fJ\n",dram_energy_units[j]);
-		printf("\t\tTime units = %.8fs\n",time_units);
-		printf("\n");
+	sigemptyset(&set);
+	sigaddset(&set,SIGCHLD);
+	sigprocmask(SIG_BLOCK,&set,&old);
 
-		if (cpu_model!=CPU_AMD_FAM17H) {
-			/* Show package power info */
-			result=read_msr(fd,MSR_PKG_POWER_INFO);
-			thermal_spec_power=power_units*(double)(result&0x7fff);
-			printf("\t\tPackage thermal spec: %.3fW\n",thermal_spec_power);
-			minimum_power=power_units*(double)((result>>16)&0x7fff);
-			printf("\t\tPackage minimum power: %.3fW\n",minimum_power);
-			maximum_power=power_units*(double)((result>>32)&0x7fff);
-			printf("\t\tPackage maximum power: %.3fW\n",maximum_power);
-			time_window=time_units*(double)((result>>48)&0x7fff);
-			printf("\t\tPackage maximum time window: %.6fs\n",time_window);
-
-			/* Show package power limit */
-			result=read_msr(fd,MSR_PKG_RAPL_POWER_LIMIT);
-			printf("\t\tPackage power limits are %s\n", (result >> 63) ? "locked" : "unlocked");
-			double pkg_power_limit_1 = power_units*(double)((result>>0)&0x7FFF);
-			double pkg_time_window_1 = time_units*(double)((result>>17)&0x007F);
-			printf("\t\tPackage power limit #1: %.3fW for %.6fs (%s, %s)\n",
-				pkg_power_limit_1, pkg_time_window_1,
-				(result & (1LL<<15)) ? "enabled" : "disabled",
-				(result & (1LL<<16)) ? "clamped" : "not_clamped");
-			double pkg_power_limit_2 = power_units*(double)((result>>32)&0x7FFF);
-			double pkg_time_window_2 = time_units*(double)((result>>49)&0x007F);
-			printf("\t\tPackage power limit #2: %.3fW for %.6fs (%s, %s)\n", 
-				pkg_power_limit_2, pkg_time_window_2,
-				(result & (1LL<<47)) ? "enabled" : "disabled",
-				(result & (1LL<<48)) ? "clamped" : "not_clamped");
-		}
+	rapl_region_start(region);
+
+	pid=fork();
+	if (pid<0) {
+		fprintf(stderr,"Error forking: %s\n",strerror(errno));
+		sigprocmask(SIG_SETMASK,&old,NULL);
+		close(exec_pipe[0]);
+		close(exec_pipe[1]);
+		return -1;
+	}
 
+	if (pid==0) {
+		sigprocmask(SIG_SETMASK,&old,NULL);
+		close(exec_pipe[0]);
+		execvp(command[0],command);
+		exec_errno=errno;
+		fprintf(stderr,"Error running %s: %s\n",
+			command[0],strerror(exec_errno));
+		write(exec_pipe[1],&exec_errno,sizeof(exec_errno));
+		_exit(127);
+	}
+	close(exec_pipe[1]);
 
-		/* only available on *Bridge-EP */
-		if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP)) {
-			result=read_msr(fd,MSR_PKG_PERF_STATUS);
-			double acc_pkg_throttled_time=(double)result*time_units;
-			printf("\tAccumulated Package Throttled Time : %.6fs\n",
-				acc_pkg_throttled_time);
+	while(1) {
+		if (sigtimedwait(&set,NULL,&timeout)<0) {
+			if (errno==EAGAIN) rapl_read();
+			continue;
 		}
+		if (waitpid(pid,&status,WNOHANG)==pid) break;
+	}
 
-		/* only available on *Bridge-EP */
-		if ((cpu_model==CPU_SANDYBRIDGE_EP) || (cpu_model==CPU_IVYBRIDGE_EP)) {
-			result=read_msr(fd,MSR_PP0_PERF_STATUS);
-			double acc_pp0_throttled_time=(double)result*time_units;
-			printf("\tPowerPlane0 (core) Accumulated Throttled Time "
-				": %.6fs\n",acc_pp0_throttled_time);
+	rapl_region_stop(region);
 
-			result=read_msr(fd,MSR_PP0_POLICY);
-			int pp0_policy=(int)result&0x001f;
-			printf("\tPowerPlane0 (core) for core %d policy: %d\n",core,pp0_policy);
+	sigprocmask(SIG_SETMASK,&old,NULL);
 
-		}
+	size=read(exec_pipe[0],&exec_errno,sizeof(exec_errno));
+	close(exec_pipe[0]);
+	if (size==sizeof(exec_errno)) return -1;
 
+	if ((!WIFEXITED(status)) || (WEXITSTATUS(status)!=0)) {
+		fprintf(stderr,"\t%s exited with status %d\n",command[0],
+			WIFEXITED(status)?WEXITSTATUS(status):-1);
+	}
 
-		if (pp1_avail) {
-			result=read_msr(fd,MSR_PP1_POLICY);
-			int pp1_policy=(int)result&0x001f;
-			printf("\tPowerPlane1 (on-core GPU if avail) %d policy: %d\n",
-				core,pp1_policy);
-		}
-		close(fd);
+	return 0;
+}
+
+struct command_stats {
+	struct run_stats time;
+	struct run_stats energy[RAPL_NUM_DOMAINS];
+	struct run_stats power[RAPL_NUM_DOMAINS];
+	/* whole machine energy, see total_domains() */
+	struct run_stats total,edp,ed2p;
+};
 
+/* What to add up for the machine's energy: the package (which has	*/
+/* the cores and GPU in it) plus DRAM, or psys if that's all there	*/
+/* is.									*/
+static int total_domains(void) {
+
+	if (rapl_available&(1<<RAPL_DOMAIN_PKG)) {
+		return rapl_available&((1<<RAPL_DOMAIN_PKG)|
+					(1<<RAPL_DOMAIN_DRAM));
+	}
+	if (rapl_available&(1<<RAPL_DOMAIN_PSYS)) {
+		return 1<<RAPL_DOMAIN_PSYS;
 	}
-	printf("\n");
 
-	for(j=0;j<total_packages;j++) {
+	return rapl_available;
+}
 
-		fd=open_msr(package_map[j]);
+static void command_name(char **command) {
 
-		/* Package Energy */
-		result=read_msr(fd,msr_pkg_energy_status);
-		package_before[j]=(double)result*cpu_energy_units[j];
+	int i;
 
-		/* PP0 energy */
-		/* Not available on Knights* */
-		/* Always returns zero on Haswell-EP? */
-		if (pp0_avail) {
-			result=read_msr(fd,msr_pp0_energy_status);
-			pp0_before[j]=(double)result*cpu_energy_units[j];
-		}
+	fprintf(stderr,"'%s",command[0]);
+	for(i=1;command[i];i++) fprintf(stderr," %s",command[i]);
+	fprintf(stderr,"'");
+}
 
-		/* PP1 energy */
-		/* not available on *Bridge-EP */
-		if (pp1_avail) {
-	 		result=read_msr(fd,MSR_PP1_ENERGY_STATUS);
-			pp1_before[j]=(double)result*cpu_energy_units[j];
-		}
+/* Run it warmups+runs times and collect the last runs, 127 if the	*/
+/* command couldn't be run.					*/
+static int measure_command(char **command, int runs, int warmups,
+			struct command_stats *stats) {
 
+	struct rapl_region region;
+	double seconds,joules,total;
+	int d,i,j;
 
-		/* Updated documentation (but not the Vol3B) says Haswell and	*/
-		/* Broadwell have DRAM support too				*/
-		if (dram_avail) {
-			result=read_msr(fd,MSR_DRAM_ENERGY_STATUS);
-			dram_before[j]=(double)result*dram_energy_units[j];
-		}
+	memset(stats,0,sizeof(*stats));
 
+	/* don't let the children inherit our buffered output */
+	fflush(stdout);
 
-		/* Skylake and newer for Psys				*/
-		if (psys_avail) {
+	for(i=0;i<warmups+runs;i++) {
+		if (run_command(command,&region)<0) return 127;
+		if (i<warmups) continue;
 
-			result=read_msr(fd,MSR_PLATFORM_ENERGY_STATUS);
-			psys_before[j]=(double)result*cpu_energy_units[j];
-		}
+		seconds=rapl_region_seconds(&region);
+		stats_add(&stats->time,seconds);
 
-		close(fd);
+		total=0.0;
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (!(rapl_available&(1<<d))) continue;
+			joules=0.0;
+			for(j=0;j<rapl_total_packages;j++) {
+				joules+=rapl_region_joules(&region,j,d);
+			}
+			stats_add(&stats->energy[d],joules);
+			stats_add(&stats->power[d],joules/seconds);
+			if (total_domains()&(1<<d)) total+=joules;
+		}
+		stats_add(&stats->total,total);
+		stats_add(&stats->edp,total*seconds);
+		stats_add(&stats->ed2p,total*seconds*seconds);
 	}
 
-  	printf("\n\tSleeping 1 second\n\n");
-	sleep(1);
+	return 0;
+}
 
-	for(j=0;j<total_packages;j++) {
+static int rapl_command(int backend, int cpu_model, int runs, int warmups,
+			char **command) {
 
-		fd=open_msr(package_map[j]);
+	struct command_stats stats;
+	char name[64];
+	int d,result;
 
-		printf("\tPackage %d:\n",j);
+	if (rapl_open(backend,cpu_model)<0) return -1;
 
-		result=read_msr(fd,msr_pkg_energy_status);
-		package_after[j]=(double)result*cpu_energy_units[j];
-		printf("\t\tPackage energy: %.6fJ\n",
-			package_after[j]-package_before[j]);
-
-		result=read_msr(fd,msr_pp0_energy_status);
-		pp0_after[j]=(double)result*cpu_energy_units[j];
-		printf("\t\tPowerPlane0 (cores): %.6fJ\n",
-			pp0_after[j]-pp0_before[j]);
-
-		/* not available on SandyBridge-EP */
-		if (pp1_avail) {
-			result=read_msr(fd,MSR_PP1_ENERGY_STATUS);
-			pp1_after[j]=(double)result*cpu_energy_units[j];
-			printf("\t\tPowerPlane1 (on-core GPU if avail): %.6f J\n",
-				pp1_after[j]-pp1_before[j]);
-		}
-
-		if (dram_avail) {
-			result=read_msr(fd,MSR_DRAM_ENERGY_STATUS);
-			dram_after[j]=(double)result*dram_energy_units[j];
-			printf("\t\tDRAM: %.6fJ\n",
-				dram_after[j]-dram_before[j]);
-		}
+	result=measure_command(command,runs,warmups,&stats);
+	if (result) {
+		rapl_close();
+		return result;
+	}
 
-		if (psys_avail) {
-			result=read_msr(fd,MSR_PLATFORM_ENERGY_STATUS);
-			psys_after[j]=(double)result*cpu_energy_units[j];
-			printf("\t\tPSYS: %.6fJ\n",
-				psys_after[j]-psys_before[j]);
-		}
+	fprintf(stderr,"\n Energy stats for ");
+	command_name(command);
+	fprintf(stderr," (%d runs",runs);
+	if (warmups) fprintf(stderr,", %d warmup",warmups);
+	fprintf(stderr,", %s, 95%% CI):\n\n",rapl_backend_name(rapl_backend));
 
-		close(fd);
+	stats_print("time",  "s",&stats.time);
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (!(rapl_available&(1<<d))) continue;
+		stats_print(rapl_domain_name(d),"J",&stats.energy[d]);
 	}
-	printf("\n");
-	printf("Note: the energy measurements can overflow in 60s or so\n");
-	printf("      so try to sample the counters more often than that.\n\n");
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (!(rapl_available&(1<<d))) continue;
+		snprintf(name,sizeof(name),"%s power",rapl_domain_name(d));
+		stats_print(name,"W",&stats.power[d]);
+	}
+	fprintf(stderr,"\n");
+
+	rapl_close();
 
 	return 0;
 }
 
-static int perf_event_open(struct perf_event_attr *hw_event_uptr,
-                    pid_t pid, int cpu, int group_fd, unsigned long flags) {
-
-        return syscall(__NR_perf_event_open,hw_event_uptr, pid, cpu,
-                        group_fd, flags);
-}
 
-#define NUM_RAPL_DOMAINS	5
+/*******************************/
+/* Frequency sweep             */
+/*******************************/
 
-char rapl_domain_names[NUM_RAPL_DOMAINS][30]= {
-	"energy-cores",
-	"energy-gpu",
-	"energy-pkg",
-	"energy-ram",
-	"energy-psys",
-};
+/* rapl-read -d [-f MHz,...] -r N -- cmd pins every CPU to each	*/
+/* frequency in turn, lowest first, and measures the command there	*/
+/* as above.  The table has the mean time and energy at each, and	*/
+/* energy*delay and energy*delay^2 averaged over the runs, with the	*/
+/* lowest of each marked.  Whatever happens the governor and	*/
+/* limits are put back; SIGINT, SIGTERM or SIGHUP stop the sweep	*/
+/* after the current run.						*/
+static volatile sig_atomic_t sweep_stop=0;
 
+static void sweep_signal(int signum) {
 
-static int check_paranoid(void) {
+	sweep_stop=1;
+}
 
-	int paranoid_value;
-	FILE *fff;
+/* "1200,1800,2400" in MHz, into kHz like cpufreq */
+static int parse_freqs(char *list, int *khz, int max) {
 
-	fff=fopen("/proc/sys/kernel/perf_event_paranoid","r");
-	if (fff==NULL) {
-		fprintf(stderr,"Error! could not open /proc/sys/kernel/perf_event_paranoid %s\n",
-			strerror(errno));
+	char *token,*saveptr;
+	int n=0;
 
-		/* We can't return a negative value as that implies no paranoia */
-		return 500;
+	for(token=strtok_r(list,",",&saveptr);token!=NULL;
+			token=strtok_r(NULL,",",&saveptr)) {
+		if ((n>=max) || (atof(token)<=0.0)) return -1;
+		khz[n++]=(int)(atof(token)*1000.0);
 	}
 
-	fscanf(fff,"%d",&paranoid_value);
-	fclose(fff);
+	return n;
+}
 
-	return paranoid_value;
+/* cpufreq would round anything else to a neighbour, and the sweep	*/
+/* table would then be labelled with the wrong frequency		*/
+static int check_freqs(int *khz, int num_freqs) {
 
-}
+	int available[RAPL_MAX_FREQS];
+	int num_available,f,i;
 
-static int rapl_perf(int core) {
-
-	FILE *fff;
-	int type;
-	int config[NUM_RAPL_DOMAINS];
-	char units[NUM_RAPL_DOMAINS][BUFSIZ];
-	char filename[BUFSIZ];
-	int fd[NUM_RAPL_DOMAINS][MAX_PACKAGES];
-	double scale[NUM_RAPL_DOMAINS];
-	struct perf_event_attr attr;
-	long long value;
-	int i,j;
-	int paranoid_value;
-
-	printf("\nTrying perf_event interface to gather results\n\n");
-
-	fff=fopen("/sys/bus/event_source/devices/power/type","r");
-	if (fff==NULL) {
-		printf("\tNo perf_event rapl support found (requires Linux 3.14)\n");
-		printf("\tFalling back to raw msr support\n\n");
+	num_available=rapl_cpufreq_list(available,RAPL_MAX_FREQS);
+	if (num_available<=0) {
+		fprintf(stderr,"-f needs /sys/devices/system/cpu/cpuN/cpufreq\n");
 		return -1;
 	}
-	fscanf(fff,"%d",&type);
-	fclose(fff);
-
-	for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-
-		sprintf(filename,"/sys/bus/event_source/devices/power/events/%s",
-			rapl_domain_names[i]);
 
-		fff=fopen(filename,"r");
-
-		if (fff!=NULL) {
-			fscanf(fff,"event=%x",&config[i]);
-			printf("\tEvent=%s Config=%d ",rapl_domain_names[i],config[i]);
-			fclose(fff);
-		} else {
-			continue;
+	for(f=0;f<num_freqs;f++) {
+		for(i=0;i<num_available;i++) {
+			if (available[i]==khz[f]) break;
 		}
+		if (i<num_available) continue;
 
-		sprintf(filename,"/sys/bus/event_source/devices/power/events/%s.scale",
-			rapl_domain_names[i]);
-		fff=fopen(filename,"r");
-
-		if (fff!=NULL) {
-			fscanf(fff,"%lf",&scale[i]);
-			printf("scale=%g ",scale[i]);
-			fclose(fff);
+		fprintf(stderr,"%d MHz is not an available frequency, "
+			"choose from:",khz[f]/1000);
+		for(i=0;i<num_available;i++) {
+			fprintf(stderr," %d",available[i]/1000);
 		}
-
-		sprintf(filename,"/sys/bus/event_source/devices/power/events/%s.unit",
-			rapl_domain_names[i]);
-		fff=fopen(filename,"r");
-
-		if (fff!=NULL) {
-			fscanf(fff,"%s",units[i]);
-			printf("units=%s ",units[i]);
-			fclose(fff);
-		}
-
-		printf("\n");
+		fprintf(stderr,"\n");
+		return -1;
 	}
 
-	for(j=0;j<total_packages;j++) {
+	return 0;
+}
 
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
+static void sweep_mark(double value, double best) {
 
-			fd[i][j]=-1;
+	fprintf(stderr,"%c ",(value==best)?'*':' ');
+}
 
-			memset(&attr,0x0,sizeof(attr));
-			attr.type=type;
-			attr.config=config[i];
-			if (config[i]==0) continue;
+static int rapl_sweep(int backend, int cpu_model, int runs, int warmups,
+			int *khz, int num_freqs, char **command) {
 
-			fd[i][j]=perf_event_open(&attr,-1, package_map[j],-1,0);
-			if (fd[i][j]<0) {
-				if (errno==EACCES) {
-					paranoid_value=check_paranoid();
-					if (paranoid_value>0) {
-						printf("\t/proc/sys/kernel/perf_event_paranoid is %d\n",paranoid_value);
-						printf("\tThe value must be 0 or lower to read system-wide RAPL values\n");
-					}
+	static struct command_stats stats[RAPL_MAX_FREQS];
+	double best_energy=0.0,best_edp=0.0,best_ed2p=0.0,ci;
+	int best[3]={-1,-1,-1};
+	int measured[RAPL_MAX_FREQS],available[RAPL_MAX_FREQS];
+	int d,f,result=0;
 
-					printf("\tPermission denied; run as root or adjust paranoid value\n\n");
-					return -1;
-				}
-				else {
-					printf("\terror opening core %d config %d: %s\n\n",
-						package_map[j], config[i], strerror(errno));
-					return -1;
-				}
-			}
-		}
+	if ((num_freqs<=0) ||
+		(rapl_cpufreq_list(available,RAPL_MAX_FREQS)<=0)) {
+		fprintf(stderr,"No frequencies to sweep, -d needs "
+			"/sys/devices/system/cpu/cpuN/cpufreq\n");
+		return -1;
 	}
 
-	printf("\n\tSleeping 1 second\n\n");
-	sleep(1);
-
-	for(j=0;j<total_packages;j++) {
-		printf("\tPackage %d:\n",j);
+	if (rapl_open(backend,cpu_model)<0) return -1;
 
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
+	atexit(rapl_cpufreq_restore);
+	signal(SIGINT,sweep_signal);
+	signal(SIGTERM,sweep_signal);
+	signal(SIGHUP,sweep_signal);
 
-			if (fd[i][j]!=-1) {
-				read(fd[i][j],&value,8);
-				close(fd[i][j]);
+	for(f=0;(f<num_freqs) && (!sweep_stop);f++) {
+		measured[f]=0;
+		if (rapl_cpufreq_set(khz[f])<0) continue;
 
-				printf("\t\t%s Energy Consumed: %lf %s\n",
-					rapl_domain_names[i],
-					(double)value*scale[i],
-					units[i]);
+		fprintf(stderr,"%d MHz...\n",khz[f]/1000);
+		result=measure_command(command,runs,warmups,&stats[f]);
+		if (result) break;
 
-			}
+		/* an interrupted run would skew the means */
+		if (sweep_stop) break;
+		measured[f]=1;
 
+		if ((best[0]<0) || (stats[f].total.mean<best_energy)) {
+			best_energy=stats[f].total.mean;
+			best[0]=f;
+		}
+		if ((best[1]<0) || (stats[f].edp.mean<best_edp)) {
+			best_edp=stats[f].edp.mean;
+			best[1]=f;
+		}
+		if ((best[2]<0) || (stats[f].ed2p.mean<best_ed2p)) {
+			best_ed2p=stats[f].ed2p.mean;
+			best[2]=f;
 		}
-
 	}
-	printf("\n");
-
-	return 0;
-}
+	for(;f<num_freqs;f++) measured[f]=0;
 
-static int rapl_sysfs(int core) {
-
-	char event_names[MAX_PACKAGES][NUM_RAPL_DOMAINS][256];
-	char filenames[MAX_PACKAGES][NUM_RAPL_DOMAINS][256];
-	char basename[MAX_PACKAGES][256];
-	char tempfile[256];
-	long long before[MAX_PACKAGES][NUM_RAPL_DOMAINS];
-	long long after[MAX_PACKAGES][NUM_RAPL_DOMAINS];
-	int valid[MAX_PACKAGES][NUM_RAPL_DOMAINS];
-	int i,j;
-	FILE *fff;
-
-	printf("\nTrying sysfs powercap interface to gather results\n\n");
-
-	/* /sys/class/powercap/intel-rapl/intel-rapl:0/ */
-	/* name has name */
-	/* energy_uj has energy */
-	/* subdirectories intel-rapl:0:0 intel-rapl:0:1 intel-rapl:0:2 */
-
-	for(j=0;j<total_packages;j++) {
-		i=0;
-		sprintf(basename[j],"/sys/class/powercap/intel-rapl/intel-rapl:%d",
-			j);
-		sprintf(tempfile,"%s/name",basename[j]);
-		fff=fopen(tempfile,"r");
-		if (fff==NULL) {
-			fprintf(stderr,"\tCould not open %s\n",tempfile);
-			return -1;
-		}
-		fscanf(fff,"%s",event_names[j][i]);
-		valid[j][i]=1;
-		fclose(fff);
-		sprintf(filenames[j][i],"%s/energy_uj",basename[j]);
-
-		/* Handle subdomains */
-		for(i=1;i<NUM_RAPL_DOMAINS;i++) {
-			sprintf(tempfile,"%s/intel-rapl:%d:%d/name",
-				basename[j],j,i-1);
-			fff=fopen(tempfile,"r");
-			if (fff==NULL) {
-				//fprintf(stderr,"\tCould not open %s\n",tempfile);
-				valid[j][i]=0;
-				continue;
-			}
-			valid[j][i]=1;
-			fscanf(fff,"%s",event_names[j][i]);
-			fclose(fff);
-			sprintf(filenames[j][i],"%s/intel-rapl:%d:%d/energy_uj",
-				basename[j],j,i-1);
+	rapl_cpufreq_restore();
+	signal(SIGINT,SIG_DFL);
+	signal(SIGTERM,SIG_DFL);
+	signal(SIGHUP,SIG_DFL);
 
-		}
+	if ((result) || (best[0]<0)) {
+		if (!result) fprintf(stderr,"No frequency could be measured\n");
+		rapl_close();
+		return result?result:-1;
 	}
 
-	/* Gather before values */
-	for(j=0;j<total_packages;j++) {
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-			if (valid[j][i]) {
-				fff=fopen(filenames[j][i],"r");
-				if (fff==NULL) {
-					fprintf(stderr,"\tError opening %s!\n",filenames[j][i]);
-				}
-				else {
-					fscanf(fff,"%lld",&before[j][i]);
-					fclose(fff);
-				}
-			}
+	fprintf(stderr,"\n Frequency sweep of ");
+	command_name(command);
+	fprintf(stderr," (%d runs each",runs);
+	if (warmups) fprintf(stderr,", %d warmup",warmups);
+	fprintf(stderr,", %s, energy is",rapl_backend_name(rapl_backend));
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (total_domains()&(1<<d)) {
+			fprintf(stderr," %s",rapl_domain_name(d));
 		}
 	}
+	fprintf(stderr,"):\n\n");
 
-	printf("\tSleeping 1 second\n\n");
-	sleep(1);
-
-	/* Gather after values */
-	for(j=0;j<total_packages;j++) {
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-			if (valid[j][i]) {
-				fff=fopen(filenames[j][i],"r");
-				if (fff==NULL) {
-					fprintf(stderr,"\tError opening %s!\n",filenames[j][i]);
-				}
-				else {
-					fscanf(fff,"%lld",&after[j][i]);
-					fclose(fff);
-				}
-			}
+	fprintf(stderr,"\t%6s %12s %8s","MHz","time(s)","+-95%");
+	for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+		if (rapl_available&(1<<d)) {
+			fprintf(stderr," %10s(J)",rapl_domain_name(d));
 		}
 	}
-
-	for(j=0;j<total_packages;j++) {
-		printf("\tPackage %d\n",j);
-		for(i=0;i<NUM_RAPL_DOMAINS;i++) {
-			if (valid[j][i]) {
-				printf("\t\t%s\t: %lfJ\n",event_names[j][i],
-					((double)after[j][i]-(double)before[j][i])/1000000.0);
+	fprintf(stderr," %12s  %12s  %12s\n","energy(J)","EDP(Js)","ED2P(Js2)");
+
+	for(f=0;f<num_freqs;f++) {
+		if (!measured[f]) continue;
+		ci=t_95(stats[f].time.n-1)*stats_stddev(&stats[f].time)/
+			sqrt(stats[f].time.n);
+		fprintf(stderr,"\t%6d %12.6f %7.2f%%",khz[f]/1000,
+			stats[f].time.mean,(stats[f].time.mean>0.0)?
+				ci*100.0/stats[f].time.mean:0.0);
+		for(d=0;d<RAPL_NUM_DOMAINS;d++) {
+			if (rapl_available&(1<<d)) {
+				fprintf(stderr," %13.6f",stats[f].energy[d].mean);
 			}
 		}
+		fprintf(stderr," %12.6f",stats[f].total.mean);
+		sweep_mark(stats[f].total.mean,best_energy);
+		fprintf(stderr,"%12.6g",stats[f].edp.mean);
+		sweep_mark(stats[f].edp.mean,best_edp);
+		fprintf(stderr,"%12.6g",stats[f].ed2p.mean);
+		sweep_mark(stats[f].ed2p.mean,best_ed2p);
+		fprintf(stderr,"\n");
 	}
-	printf("\n");
 
-	return 0;
+	fprintf(stderr,"\n\tLowest energy at %d MHz, EDP at %d MHz, "
+		"ED2P at %d MHz\n\n",khz[best[0]]/1000,
+		khz[best[1]]/1000,khz[best[2]]/1000);
+
+	rapl_close();
 
+	return 0;
 }
 
+static struct option long_options[]={
+	{"bench-backends",	no_argument,	NULL,	'B'},
+	{NULL,			0,		NULL,	0},
+};
+
 int main(int argc, char **argv) {
 
 	int c;
 	int force_msr=0,force_perf_event=0,force_sysfs=0;
+	int cheapest=0,bench_backends=0;
+	int backend;
 	int core=0;
 	int result=-1;
 	int cpu_model;
+	int edge_align=0;
+	int runs=0,warmups=0;
+	int sweep=0,num_freqs=-1;
+	int khz[RAPL_MAX_FREQS];
+	long long interval_ns=1000000000LL;
 
 	printf("\n");
 	printf("RAPL read -- use -s for sysfs, -p for perf_event, -m for msr\n\n");
 
 	opterr=0;
 
-	while ((c = getopt (argc, argv, "c:hmps")) != -1) {
+	/* + so that options after the command are left for it */
+	while ((c = getopt_long (argc, argv, "+ac:def:hi:mpR:r:sw:",
+				long_options, NULL)) != -1) {
 		switch (c) {
+		case 'a':
+			cheapest = 1;
+			break;
+		case 'B':
+			bench_backends = 1;
+			break;
 		case 'c':
 			core = atoi(optarg);
 			break;
+		case 'd':
+			sweep = 1;
+			break;
+		case 'e':
+			edge_align = 1;
+			break;
+		case 'f':
+			sweep = 1;
+			num_freqs = parse_freqs(optarg,khz,RAPL_MAX_FREQS);
+			if (num_freqs<=0) {
+				fprintf(stderr,"Invalid frequency list %s\n",optarg);
+				exit(-1);
+			}
+			break;
 		case 'h':
-			printf("Usage: %s [-c core] [-h] [-m]\n\n",argv[0]);
+			printf("Usage: %s [-a] [-c core] [-e] [-h] [-i ms] [-m] [-R dir] [--bench-backends]\n",argv[0]);
+			printf("       %s [-m|-p|-s] [-r runs] [-w warmups] -- command args...\n",argv[0]);
+			printf("       %s -d [-f MHz,...] [-m|-p|-s] [-r runs] [-w warmups] -- command args...\n\n",argv[0]);
+			printf("\t-a      : benchmark the backends and use the cheapest\n");
 			printf("\t-c core : specifies which core to measure\n");
+			printf("\t-d      : run the command at every CPU frequency, report energy, EDP\n");
+			printf("\t          and ED2P at each, then restore the governor\n");
+			printf("\t-e      : start and stop on counter updates, timed with the TSC\n");
+			printf("\t-f list : with -d, just these MHz, e.g. 1200,1800,2400\n");
+			printf("\t          (each must be an available cpufreq frequency)\n");
 			printf("\t-h      : displays this help\n");
+			printf("\t-i ms   : measurement interval for -e (default 1000)\n");
 			printf("\t-m      : forces use of MSR mode\n");
 			printf("\t-p      : forces use of perf_event mode\n");
+			printf("\t-R dir  : read /dev, /sys and /proc under dir (default $HW_ROOT)\n");
+			printf("\t-r runs : run the command this many times (default 1)\n");
 			printf("\t-s      : forces use of sysfs mode\n");
+			printf("\t-w num  : warmup runs of the command, not counted\n");
+			printf("\t--bench-backends : compare the cost of a sample on each backend\n");
 			exit(0);
+		case 'i':
+			interval_ns = (long long)(atof(optarg)*1000000.0);
+			if (interval_ns<=0) {
+				fprintf(stderr,"Invalid interval %s\n",optarg);
+				exit(-1);
+			}
+			break;
 		case 'm':
 			force_msr = 1;
 			break;
 		case 'p':
 			force_perf_event = 1;
 			break;
+		case 'R':
+			rapl_set_root(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			if (runs<=0) {
+				fprintf(stderr,"Invalid run count %s\n",optarg);
+				exit(-1);
+			}
+			break;
 		case 's':
 			force_sysfs = 1;
 			break;
+		case 'w':
+			warmups = atoi(optarg);
+			break;
 		default:
 			fprintf(stderr,"Unknown option %c\n",c);
 			exit(-1);
 		}
 	}
 
-	(void)force_sysfs;
 
-	cpu_model=detect_cpu();
-	detect_packages();
+	if ((optind>=argc) && ((sweep) || (runs) || (warmups))) {
+		fprintf(stderr,"-d, -f, -r and -w need a command, "
+			"e.g. %s -r 5 -- sleep 1\n",argv[0]);
+		return -1;
+	}
+
+	cpu_model=rapl_detect_cpu();
+	rapl_detect_packages();
+
+	if (bench_backends) {
+		rapl_bench_backends(cpu_model,RAPL_BENCH_SAMPLES,1);
+		return 0;
+	}
+
+	if (cheapest) {
+		backend=rapl_bench_backends(cpu_model,RAPL_BENCH_SAMPLES,0);
+		printf("Cheapest backend is %s\n\n",rapl_backend_name(backend));
+		force_msr=(backend==RAPL_BACKEND_MSR);
+		force_perf_event=(backend==RAPL_BACKEND_PERF);
+		force_sysfs=(backend==RAPL_BACKEND_SYSFS);
+	}
+
+	if ((num_freqs>0) && (check_freqs(khz,num_freqs)<0)) return -1;
+
+	if (optind<argc) {
+		if (runs==0) runs=1;
+		if (force_msr) backend=RAPL_BACKEND_MSR;
+		else if (force_perf_event) backend=RAPL_BACKEND_PERF;
+		else if (force_sysfs) backend=RAPL_BACKEND_SYSFS;
+		else backend=RAPL_BACKEND_AUTO;
+		if (sweep) {
+			if (num_freqs<0) {
+				num_freqs=rapl_cpufreq_list(khz,RAPL_MAX_FREQS);
+			}
+			result=rapl_sweep(backend,cpu_model,runs,warmups,
+				khz,num_freqs,&argv[optind]);
+		}
+		else {
+			result=rapl_command(backend,cpu_model,runs,warmups,
+				&argv[optind]);
+		}
+		if (result>0) return result;
+		goto done;
+	}
+
+	if (edge_align) {
+		if (force_msr) {
+			result=rapl_edge(RAPL_BACKEND_MSR,cpu_model,interval_ns);
+		}
+		else if (force_perf_event) {
+			result=rapl_edge(RAPL_BACKEND_PERF,cpu_model,interval_ns);
+		}
+		else if (force_sysfs) {
+			result=rapl_edge(RAPL_BACKEND_SYSFS,cpu_model,interval_ns);
+		}
+		else {
+			result=rapl_edge(RAPL_BACKEND_AUTO,cpu_model,interval_ns);
+		}
+		goto done;
+	}
 
 	if ((!force_msr) && (!force_perf_event)) {
-		result=rapl_sysfs(core);
+		result=rapl_sample(RAPL_BACKEND_SYSFS,core,cpu_model);
 	}
 
 	if (result<0) {
 		if ((force_perf_event) && (!force_msr)) {
-			result=rapl_perf(core);
+			result=rapl_sample(RAPL_BACKEND_PERF,core,cpu_model);
 		}
 	}
 
 	if (result<0) {
-		result=rapl_msr(core,cpu_model);
+		result=rapl_sample(RAPL_BACKEND_MSR,core,cpu_model);
 	}
+	rapl_msr_fds_close();
 
+done:
 	if (result<0) {
 
 		printf("Unable to read RAPL counters.\n");
@@ -0,0 +1,96 @@
+/* Measure the overhead of an empty rapl_region_start()/stop() pair	*/
+/*	on each of the librapl backends.				*/
+/*									*/
+/* This is what it costs to wrap a region of interest in a benchmark	*/
+/*	with the in-process energy API.					*/
+/*									*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rapl-lib.h"
+
+#define DEFAULT_ITERATIONS	10000
+
+static struct rapl_region region;
+
+static int bench_backend(int backend, int cpu_model, int iterations) {
+
+	long long before,after,cost;
+	long long total=0,min=0,max=0;
+	double joules=0.0;
+	int i;
+
+	if (rapl_open(backend,cpu_model)!=backend) {
+		printf("%-12s not available\n",rapl_backend_name(backend));
+		return -1;
+	}
+
+	/* warm up */
+	rapl_region_start(&region);
+	rapl_region_stop(&region);
+
+	for(i=0;i<iterations;i++) {
+		before=rapl_monotonic_ns();
+		rapl_region_start(&region);
+		rapl_region_stop(&region);
+		after=rapl_monotonic_ns();
+
+		cost=after-before;
+		if ((i==0) || (cost<min)) min=cost;
+		if ((i==0) || (cost>max)) max=cost;
+		total+=cost;
+
+		joules+=rapl_region_joules(&region,0,RAPL_DOMAIN_PKG);
+	}
+
+	printf("%-12s %10.3f %10.3f %10.3f   (%d regions, %.6fJ)\n",
+		rapl_backend_name(backend),
+		(double)total/iterations/1000.0,
+		(double)min/1000.0,(double)max/1000.0,
+		iterations,joules);
+
+	rapl_close();
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	int c;
+	int cpu_model;
+	int iterations=DEFAULT_ITERATIONS;
+
+	while ((c = getopt (argc, argv, "hn:")) != -1) {
+		switch (c) {
+		case 'h':
+			printf("Usage: %s [-h] [-n iterations]\n\n",argv[0]);
+			printf("\t-h      : displays this help\n");
+			printf("\t-n num  : number of empty regions per backend (default %d)\n",
+				DEFAULT_ITERATIONS);
+			exit(0);
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations<=0) iterations=DEFAULT_ITERATIONS;
+			break;
+		default:
+			fprintf(stderr,"Unknown option %c\n",c);
+			exit(-1);
+		}
+	}
+
+	cpu_model=rapl_detect_cpu();
+	rapl_detect_packages();
+
+	printf("\nEmpty region cost (start+stop), in microseconds\n\n");
+	printf("%-12s %10s %10s %10s\n","backend","avg","min","max");
+
+	bench_backend(RAPL_BACKEND_MSR,cpu_model,iterations);
+	bench_backend(RAPL_BACKEND_PERF,cpu_model,iterations);
+	bench_backend(RAPL_BACKEND_SYSFS,cpu_model,iterations);
+
+	printf("\n");
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/* Print the readings rapl-plot -S publishes in shared memory	*/
+/*									*/
+/* Only needs rapl-shm.h, this is all a client has to do.		*/
+/*									*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rapl-shm.h"
+
+static const char *domain_names[RAPL_SHM_NUM_DOMAINS]={
+	"PKG","PP0","PP1","DRAM","PSYS",
+};
+
+int main(int argc, char **argv) {
+
+	struct rapl_shm *shm;
+	struct rapl_shm_data data;
+	struct timespec interval;
+	char *name=RAPL_SHM_DEFAULT_NAME;
+	long long period_ns=0,count=1,i;
+	uint64_t last_sample=0;
+	int c,d,j;
+
+	while ((c = getopt (argc, argv, "hi:n:")) != -1) {
+		switch (c) {
+		case 'h':
+			printf("Usage: %s [-h] [-i ms] [-n count] [name]\n\n",argv[0]);
+			printf("\t-h      : displays this help\n");
+			printf("\t-i ms   : keep printing every ms milliseconds\n");
+			printf("\t-n num  : with -i, stop after num (default forever)\n");
+			printf("\tname    : shared memory name (default %s)\n",
+				RAPL_SHM_DEFAULT_NAME);
+			exit(0);
+		case 'i':
+			period_ns = (long long)(atof(optarg)*1000000.0);
+			count = 0;
+			break;
+		case 'n':
+			count = atoll(optarg);
+			break;
+		default:
+			fprintf(stderr,"Unknown option %c\n",c);
+			exit(-1);
+		}
+	}
+
+	if (optind<argc) name=argv[optind];
+
+	shm=rapl_shm_attach(name);
+	if (shm==NULL) {
+		fprintf(stderr,"Nothing publishing to %s, "
+			"start rapl-plot -S %s first\n",name,name);
+		return -1;
+	}
+
+	interval.tv_sec=period_ns/1000000000LL;
+	interval.tv_nsec=period_ns%1000000000LL;
+
+	for(i=0;(count==0) || (i<count);i++) {
+
+		if (i) nanosleep(&interval,NULL);
+
+		/* This is the zero-syscall part */
+		rapl_shm_snapshot(shm,&data);
+		if ((i) && (data.sample==last_sample)) continue;
+		last_sample=data.sample;
+
+		printf("sample %llu at %.6fs, %.3fms interval\n",
+			(unsigned long long)data.sample,
+			(double)(data.time_ns-shm->start_ns)/1000000000.0,
+			(double)data.interval_ns/1000000.0);
+		for(j=0;j<(int)shm->packages;j++) {
+			printf("\tPackage %d:",j);
+			for(d=0;d<RAPL_SHM_NUM_DOMAINS;d++) {
+				if (!(shm->available&(1<<d))) continue;
+				printf(" %s %.3fW %.3fJ",domain_names[d],
+					data.watts[j][d],data.joules[j][d]);
+			}
+			printf("\n");
+		}
+		fflush(stdout);
+	}
+
+	rapl_shm_detach(shm);
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+/* Live RAPL readings published by rapl-plot -S in POSIX shared	*/
+/*	memory, for any number of readers.				*/
+/*									*/
+/* This header stands alone so other programs can just include it.	*/
+/* Attach once with rapl_shm_attach(), after that every		*/
+/* rapl_shm_snapshot() is a plain memory copy with no syscalls.	*/
+/*									*/
+/* The data is guarded by a seqlock: the writer makes seq odd,	*/
+/* updates the data and makes seq even again.  A reader copies the	*/
+/* data and retries if seq was odd or changed underneath it.	*/
+/*									*/
+/* Domains are indexed PKG, PP0, PP1, DRAM, PSYS as in rapl-lib.h	*/
+/* and only those with their bit set in available are valid.	*/
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define RAPL_SHM_DEFAULT_NAME	"/rapl"
+#define RAPL_SHM_MAGIC		0x31304d4853504152ULL	/* "RAPSHM01" */
+#define RAPL_SHM_VERSION	1
+
+#define RAPL_SHM_MAX_PACKAGES	16
+#define RAPL_SHM_NUM_DOMAINS	5
+
+struct rapl_shm_data {
+	uint64_t sample;		/* number published so far */
+	int64_t time_ns;		/* CLOCK_MONOTONIC of this sample */
+	int64_t interval_ns;		/* since the previous one */
+	uint64_t raw[RAPL_SHM_MAX_PACKAGES][RAPL_SHM_NUM_DOMAINS];
+	double joules[RAPL_SHM_MAX_PACKAGES][RAPL_SHM_NUM_DOMAINS];
+	double watts[RAPL_SHM_MAX_PACKAGES][RAPL_SHM_NUM_DOMAINS];
+};
+
+struct rapl_shm {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t packages;
+	uint32_t available;
+	uint32_t backend;
+	int64_t period_ns;
+	int64_t start_ns;
+	double units[RAPL_SHM_MAX_PACKAGES][RAPL_SHM_NUM_DOMAINS];
+
+	/* keep the hot part on its own cache lines */
+	uint64_t seq __attribute__((aligned(64)));
+	struct rapl_shm_data data __attribute__((aligned(64)));
+};
+
+/* Map the segment read-only, NULL if there's no writer */
+static inline struct rapl_shm *rapl_shm_attach(const char *name) {
+
+	struct rapl_shm *shm;
+	int fd;
+
+	fd=shm_open(name,O_RDONLY,0);
+	if (fd<0) return NULL;
+
+	shm=mmap(NULL,sizeof(struct rapl_shm),PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (shm==MAP_FAILED) return NULL;
+
+	if ((shm->magic!=RAPL_SHM_MAGIC) || (shm->version!=RAPL_SHM_VERSION)) {
+		munmap(shm,sizeof(struct rapl_shm));
+		return NULL;
+	}
+
+	return shm;
+}
+
+static inline void rapl_shm_detach(struct rapl_shm *shm) {
+
+	munmap(shm,sizeof(struct rapl_shm));
+}
+
+/* Copy out a consistent snapshot, returns its sample number */
+static inline uint64_t rapl_shm_snapshot(const struct rapl_shm *shm,
+					struct rapl_shm_data *data) {
+
+	uint64_t before,after;
+
+	do {
+		before=__atomic_load_n(&shm->seq,__ATOMIC_ACQUIRE);
+		if (before&1) continue;
+		memcpy(data,(const void *)&shm->data,sizeof(*data));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after=__atomic_load_n(&shm->seq,__ATOMIC_RELAXED);
+		if (before==after) break;
+	} while(1);
+
+	return data->sample;
+}
@@ -0,0 +1,132 @@
+/* Streaming power statistics, see rapl-stats.h			*/
+/*									*/
+/* Nothing in here allocates, the caller owns the structs.		*/
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+#include "rapl-stats.h"
+
+void rapl_stats_init(struct rapl_stats *stats) {
+
+	memset(stats,0,sizeof(*stats));
+}
+
+/* Bucket i>0 holds [MIN*GROWTH^(i-1),MIN*GROWTH^i) */
+static int stats_bucket(double value) {
+
+	int bucket;
+
+	if (!(value>=RAPL_STATS_MIN)) return 0;	/* also catches NaN */
+	if (value>=RAPL_STATS_MAX) return RAPL_STATS_BUCKETS-1;
+
+	bucket=1+(int)(log(value/RAPL_STATS_MIN)/log(RAPL_STATS_GROWTH));
+	if (bucket>RAPL_STATS_BUCKETS-2) bucket=RAPL_STATS_BUCKETS-2;
+
+	return bucket;
+}
+
+void rapl_stats_add(struct rapl_stats *stats, double value) {
+
+	if ((stats->count==0) || (value<stats->min)) stats->min=value;
+	if ((stats->count==0) || (value>stats->max)) stats->max=value;
+	stats->sum+=value;
+	stats->count++;
+	stats->buckets[stats_bucket(value)]++;
+}
+
+double rapl_stats_mean(const struct rapl_stats *stats) {
+
+	if (stats->count==0) return 0.0;
+
+	return stats->sum/stats->count;
+}
+
+double rapl_stats_quantile(const struct rapl_stats *stats, double q) {
+
+	uint64_t target,seen=0;
+	double value;
+	int i;
+
+	if (stats->count==0) return 0.0;
+
+	/* first bucket where we've seen q of the samples */
+	target=(uint64_t)ceil(q*(double)stats->count);
+	if (target<1) target=1;
+	for(i=0;i<RAPL_STATS_BUCKETS;i++) {
+		seen+=stats->buckets[i];
+		if (seen>=target) break;
+	}
+
+	/* The under/overflow buckets have no width, fall back to the	*/
+	/* exact extremes.  Otherwise take the geometric middle.	*/
+	if (i==0) return stats->min;
+	if (i>=RAPL_STATS_BUCKETS-1) return stats->max;
+
+	value=RAPL_STATS_MIN*pow(RAPL_STATS_GROWTH,(double)i-0.5);
+	if (value<stats->min) value=stats->min;
+	if (value>stats->max) value=stats->max;
+
+	return value;
+}
+
+
+void rapl_window_init(struct rapl_window *window, long long length_ns) {
+
+	int i;
+
+	memset(window,0,sizeof(*window));
+	window->length_ns=length_ns;
+	window->slot_ns=length_ns/RAPL_WINDOW_SLOTS;
+	if (window->slot_ns<1) window->slot_ns=1;
+	for(i=0;i<RAPL_WINDOW_SLOTS;i++) window->slots[i].epoch=-1;
+}
+
+void rapl_window_add(struct rapl_window *window, long long time_ns,
+		double value) {
+
+	struct rapl_window_slot *slot;
+	long long epoch=time_ns/window->slot_ns;
+
+	slot=&window->slots[epoch%RAPL_WINDOW_SLOTS];
+
+	/* An old slot coming round again starts over */
+	if (slot->epoch!=epoch) {
+		slot->epoch=epoch;
+		slot->count=0;
+		slot->sum=0.0;
+	}
+
+	if ((slot->count==0) || (value<slot->min)) slot->min=value;
+	if ((slot->count==0) || (value>slot->max)) slot->max=value;
+	slot->sum+=value;
+	slot->count++;
+}
+
+uint64_t rapl_window_get(const struct rapl_window *window, long long now_ns,
+		double *mean, double *min, double *max) {
+
+	const struct rapl_window_slot *slot;
+	long long epoch=now_ns/window->slot_ns;
+	uint64_t count=0;
+	double sum=0.0;
+	int i;
+
+	*mean=*min=*max=0.0;
+
+	for(i=0;i<RAPL_WINDOW_SLOTS;i++) {
+		slot=&window->slots[i];
+		if ((slot->count==0) || (slot->epoch>epoch) ||
+			(slot->epoch<=epoch-RAPL_WINDOW_SLOTS)) continue;
+
+		if ((count==0) || (slot->min<*min)) *min=slot->min;
+		if ((count==0) || (slot->max>*max)) *max=slot->max;
+		sum+=slot->sum;
+		count+=slot->count;
+	}
+
+	if (count) *mean=sum/count;
+
+	return count;
+}
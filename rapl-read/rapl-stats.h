@@ -0,0 +1,51 @@
+/* Streaming power statistics in fixed memory, part of librapl	*/
+/*									*/
+/* struct rapl_stats is a log-scale histogram: each bucket is	*/
+/* RAPL_STATS_GROWTH times wider than the last, so any quantile is	*/
+/* within half a percent of the real value no matter how many	*/
+/* samples went in.  Mean, min and max are exact.			*/
+/*									*/
+/* struct rapl_window keeps count, sum, min and max for the last	*/
+/* length_ns in RAPL_WINDOW_SLOTS slots, so it slides in steps of	*/
+/* a tenth of the window.						*/
+
+#include <stdint.h>
+
+#define RAPL_STATS_MIN		0.001		/* W, less goes in bucket 0 */
+#define RAPL_STATS_MAX		100000.0	/* more goes in the last */
+#define RAPL_STATS_GROWTH	1.01
+/* log(RAPL_STATS_MAX/RAPL_STATS_MIN)/log(RAPL_STATS_GROWTH) + 2 */
+#define RAPL_STATS_BUCKETS	1854
+
+struct rapl_stats {
+	uint64_t count;
+	double sum,min,max;
+	uint64_t buckets[RAPL_STATS_BUCKETS];
+};
+
+void rapl_stats_init(struct rapl_stats *stats);
+void rapl_stats_add(struct rapl_stats *stats, double value);
+double rapl_stats_mean(const struct rapl_stats *stats);
+/* q between 0 and 1, e.g. 0.999 for p99.9 */
+double rapl_stats_quantile(const struct rapl_stats *stats, double q);
+
+
+#define RAPL_WINDOW_SLOTS	10
+
+struct rapl_window_slot {
+	long long epoch;		/* time_ns/slot_ns it belongs to */
+	uint64_t count;
+	double sum,min,max;
+};
+
+struct rapl_window {
+	long long length_ns,slot_ns;
+	struct rapl_window_slot slots[RAPL_WINDOW_SLOTS];
+};
+
+void rapl_window_init(struct rapl_window *window, long long length_ns);
+void rapl_window_add(struct rapl_window *window, long long time_ns,
+		double value);
+/* Stats for the window ending at now_ns, returns the sample count */
+uint64_t rapl_window_get(const struct rapl_window *window, long long now_ns,
+		double *mean, double *min, double *max);